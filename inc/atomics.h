@@ -0,0 +1,21 @@
+#ifndef YAMUX_ATOMICS_H
+#define YAMUX_ATOMICS_H
+
+// atomic struct members. C++ has no type guaranteed to be compatible
+// with _Atomic(T), so C++ code including these headers (see yamux.hpp)
+// only gets opaque storage of the same size and alignment, and has to
+// go through accessor functions such as yamux_session_is_closed.
+#ifdef __cplusplus
+template <class T>
+struct yamux_atomic_opaque
+{
+    alignas(sizeof(T)) unsigned char raw[sizeof(T)];
+};
+#define YAMUX_ATOMIC(T) yamux_atomic_opaque<T>
+#else
+#include <stdatomic.h>
+#define YAMUX_ATOMIC(T) _Atomic(T)
+#endif
+
+#endif
+
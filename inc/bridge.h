@@ -0,0 +1,119 @@
+
+#ifndef YAMUX_BRIDGE_H
+#define YAMUX_BRIDGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "atomics.h"
+
+// Relays between a stream and a file descriptor (usually a TCP
+// connection), for tunnelling, see yamux_stream_bridge (Linux only).
+//
+// Towards the fd, the session reader splices DATA payloads from its
+// socket into a pipe, and the session's relay thread splices them on
+// into the fd, so the data never reaches user space (compressed streams
+// and captured sessions go through a buffer instead). The window is
+// handed back as the fd takes the data (and as recv_rate allows), so a
+// slow fd slows the peer down. The pipe holds a window, but spliced
+// socket data can take a page per packet: what doesn't fit waits in a
+// buffer of the bridge, the session reader never waits for the fd.
+// Data buffered or queued for the stream before it was bridged goes
+// out first.
+//
+// Towards the stream, the relay thread reads the fd into one buffer and
+// writes frames from it, polling the fd only while the stream has send
+// window. It never waits for window or send_rate: what a stream doesn't
+// take right away is kept for it and sent in a later round, so one slow
+// peer or rate-limited stream doesn't hold up the session's other
+// bridges.
+//
+// EOF on the fd closes the stream (FIN). The peer's FIN shuts the fd
+// down for writing once everything before it was written, and ends the
+// relay: this library can't send on a stream the peer has closed.
+// Errors on either side reset the other (RST, or an aborting close).
+// A bridge ending while the session reader fills its pipe raises
+// SIGPIPE, which should be ignored, as for the session socket.
+struct yamux_stream;
+struct yamux_frame;
+
+// called on the relay thread when the bridge ended and closed its fd.
+// status is 0 after a FIN, -errno otherwise. the stream may be freed
+// here.
+typedef void (*yamux_bridge_done_fn)(struct yamux_stream* stream, int status);
+
+struct yamux_bridge
+{
+    struct yamux_bridge* next;
+
+    struct yamux_stream* stream;
+    yamux_bridge_done_fn done  ;
+
+    int fd     ;
+    int pipe[2];
+
+    size_t   piped; // in the pipe, not written to fd yet
+    uint32_t held ; // receive window the piped and spilled data took
+
+    // what didn't fit into the pipe, goes in after what's there
+    char*  spill    ;
+    size_t spill_len;
+    size_t spill_cap;
+
+    // read from fd, not taken by the stream yet. the relay thread's.
+    char*    out    ;
+    uint32_t out_len;
+
+    bool inbound  ; // the session reader is filling the pipe
+    bool busy     ; // the relay thread is moving data, unlocked
+    bool local_eof; // fd reached EOF
+    bool fin_sent ; // closing the stream can fail before it's established
+    bool peer_fin ;
+    int  error    ; // -errno to end with, 0 if none
+
+    bool   closed; // ended, incoming data is dropped
+    bool   polled; // in the relay's pollfd array, at index pfd
+    size_t pfd   ;
+};
+
+// one per session, with a thread, created by its first bridge
+struct yamux_relay
+{
+    pthread_t thread;
+
+    // only held for bookkeeping, never while blocking on I/O: the
+    // session reader takes it too, and a relay stuck in a send would
+    // stop the reader that has to make room for it on the other end
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond ; // inbound or busy went false
+
+    struct yamux_bridge* first;
+
+    int  wake_fd; // eventfd
+    bool stop   ;
+
+    // the relay thread's own
+    struct pollfd* fds    ;
+    size_t         cap_fds;
+    char*          buf    ;
+};
+
+// stops the thread, bridges stay until their streams are freed
+void yamux_relay_stop(struct yamux_relay* relay);
+void yamux_relay_free(struct yamux_relay* relay);
+
+// hands a DATA payload of the bridged stream to its pipe, spliced from
+// the session socket if data is NULL. returns length, or -ENOENT without
+// reading anything if data is NULL and the stream isn't bridged
+// (anymore). payloads of bridges that ended are dropped.
+ssize_t yamux_bridge_recv(struct yamux_stream* stream, const void* data, uint32_t length, uint32_t used);
+
+// the peer's FIN or RST, passed on by yamux_stream_dispatch
+void yamux_bridge_fin(struct yamux_stream* stream, bool reset);
+
+// ends the bridge without calling done, called by yamux_stream_free
+void yamux_bridge_detach(struct yamux_stream* stream);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef YAMUX_BUDGET_H
+#define YAMUX_BUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "atomics.h"
+
+// Caps the memory peers can make us hold. Every session has its own
+// budget (yamux_config.memory_budget), and sessions can additionally
+// share one (yamux_config.shared_budget), e.g. across a whole process.
+//
+// 'committed' is the data we buffer plus all receive window we granted
+// and the peer hasn't used yet, i.e. the most that could be buffered if
+// every peer sent all it may. Window grants shrink and new incoming
+// streams are refused while it's close to the limit.
+struct yamux_budget
+{
+    size_t limit; // 0: unlimited
+
+    YAMUX_ATOMIC(size_t) committed;
+    YAMUX_ATOMIC(size_t) buffered ;
+    YAMUX_ATOMIC(size_t) peak     ; // highest 'buffered' so far
+};
+
+void yamux_budget_init(struct yamux_budget* budget, size_t limit);
+
+// how much more may be committed, SIZE_MAX if unlimited
+size_t yamux_budget_headroom(struct yamux_budget* budget);
+
+void yamux_budget_commit(struct yamux_budget* budget, int64_t delta);
+void yamux_budget_buffer(struct yamux_budget* budget, int64_t delta);
+
+#endif
+
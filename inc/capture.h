@@ -0,0 +1,46 @@
+#ifndef YAMUX_CAPTURE_H
+#define YAMUX_CAPTURE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame.h"
+
+// Records the frames a session receives, to be fed back through a
+// session later by the replay tool (bin/yreplay) for performance
+// comparisons on real traffic mixes.
+//
+// File layout, all integers in network order unless noted:
+//   header: "YMXCAP\0\0", u8 format version, u8 session type,
+//           u8 flags (YAMUX_CAPTURE_PAYLOADS), u8 reserved
+//   record: LEB128 varint nanoseconds since the previous frame,
+//           the 12 byte frame header as received,
+//           DATA payload bytes if the file has payloads
+struct yamux_capture
+{
+    FILE* file;
+
+    bool payloads;
+
+    struct timespec last;
+};
+
+#define YAMUX_CAPTURE_MAGIC   "YMXCAP\0\0"
+#define YAMUX_CAPTURE_VERSION (0x01)
+
+#define YAMUX_CAPTURE_PAYLOADS (0x01)
+
+// 'type' is the enum yamux_session_type of the capturing session.
+// without payloads, only the sizes of DATA frames are kept.
+struct yamux_capture* yamux_capture_open (const char* path, int type, bool payloads);
+void                  yamux_capture_close(struct yamux_capture* capture);
+
+// frame header exactly as received, i.e. before decode_frame
+void yamux_capture_frame  (struct yamux_capture* capture, const struct yamux_frame* frame);
+// (part of) the payload of the last frame
+void yamux_capture_payload(struct yamux_capture* capture, const void* data, size_t length);
+
+#endif
+
@@ -0,0 +1,54 @@
+#ifndef YAMUX_COMPRESS_H
+#define YAMUX_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Optional LZ4 compression of DATA payloads, an extension to yamux.
+//
+// A stream opened with yamux_config.compression set asks for it with
+// yamux_frame_cmp on its SYN; the other side agrees by echoing the bit
+// on its ACK. Both go out as window updates without payload, never on a
+// DATA frame, where the bit means the payload is compressed. Peers that
+// don't know the extension ignore the bit and never set it, so the
+// stream simply stays uncompressed.
+//
+// Once agreed, every DATA frame that has yamux_frame_cmp set carries a
+// 4 byte (network order) plaintext length followed by an LZ4 block that
+// may refer back to the previous YAMUX_COMPRESS_HISTORY bytes of the
+// stream. Frames without the bit are sent as is, e.g. when the data
+// doesn't compress. The frame length, and so the flow control window,
+// always counts the bytes on the wire.
+//
+// Only available when built with LZ4=1; otherwise it's never agreed on.
+struct yamux_compress;
+
+#define YAMUX_COMPRESS_CHUNK   (0x10000) // most plaintext per frame
+#define YAMUX_COMPRESS_HISTORY (0x10000)
+
+bool yamux_compress_available(void);
+
+struct yamux_compress* yamux_compress_new (void);
+void                   yamux_compress_free(struct yamux_compress* c);
+
+// room needed in dst for a chunk of 'length' bytes
+uint32_t yamux_compress_bound(uint32_t length);
+
+// compresses a chunk of at most YAMUX_COMPRESS_CHUNK bytes into dst.
+// returns the payload size, or 0 if the chunk should be sent as is
+// (which has then been added to the history all the same). a frame that
+// then can't be sent leaves the peer out of step, the stream is reset.
+uint32_t yamux_compress_frame(struct yamux_compress* c, const char* src, uint32_t length, char* dst);
+
+// plaintext length of a compressed payload, -EPROTO if malformed
+ssize_t yamux_compress_length(const char* src, uint32_t length);
+// decompresses a yamux_frame_cmp payload into dst (of at least
+// yamux_compress_length bytes), returns the plaintext length
+ssize_t yamux_decompress_frame(struct yamux_compress* c, const char* src, uint32_t length, char* dst);
+// records a payload that arrived without yamux_frame_cmp
+void    yamux_decompress_raw  (struct yamux_compress* c, const char* src, uint32_t length);
+
+#endif
+
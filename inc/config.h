@@ -7,18 +7,69 @@
 #include <stdbool.h>
 #include <time.h>
 
+#include "budget.h"
+
+struct yamux_dispatch;
+
 struct yamux_config
 {
     size_t   accept_backlog        ;
     uint32_t max_stream_window_size;
+
+    // per session cap on buffered data plus outstanding receive window,
+    // 0 for none. see budget.h.
+    size_t               memory_budget;
+    // optional cap shared by every session using it
+    struct yamux_budget* shared_budget;
+
+    // offer/accept compressed DATA frames on new streams, see compress.h
+    bool compression;
+
+    // run stream callbacks on worker threads, see dispatch.h
+    struct yamux_dispatch* dispatch;
+
+    // microseconds the session reader spins on non-blocking reads before
+    // it blocks, 0 to block right away. also sets SO_BUSY_POLL (and
+    // SO_PREFER_BUSY_POLL) on the socket where available. trades a core
+    // for lower latency; no spinning with a single CPU.
+    uint32_t busy_poll;
+    // set TCP_NODELAY, so small frames go out immediately
+    bool nodelay;
+
+    // smallest DATA frame yamux_stream_write_zc sends with MSG_ZEROCOPY,
+    // 0 to never use it. below ~10K copying is cheaper.
+    size_t zerocopy_threshold;
+
+    // established streams every session keeps ready for
+    // yamux_session_take_stream, 0 for none. see spare.h.
+    size_t spare_streams;
+
+    // time every callback into the session's latency histograms, see
+    // latency.h
+    bool callback_timing;
+    // microseconds a callback may take before session->stall_fn hears
+    // of it, 0 for never. times callbacks too.
+    uint32_t stall_threshold;
 };
 
 #define YAMUX_DEFAULT_WINDOW (0x100*0x400)
+// smallest window grant under memory pressure, so streams keep moving
+#define YAMUX_MIN_WINDOW_GRANT (0x10*0x400)
 
 #define YAMUX_DEFAULT_CONFIG ((struct yamux_config)\
 {\
     .accept_backlog=0x100,\
-    .max_stream_window_size=YAMUX_DEFAULT_WINDOW\
+    .max_stream_window_size=YAMUX_DEFAULT_WINDOW,\
+    .memory_budget=0,\
+    .shared_budget=NULL,\
+    .compression=false,\
+    .dispatch=NULL,\
+    .busy_poll=0,\
+    .nodelay=false,\
+    .zerocopy_threshold=0,\
+    .spare_streams=0,\
+    .callback_timing=false,\
+    .stall_threshold=0\
 })\
 
 
@@ -0,0 +1,110 @@
+#ifndef YAMUX_DISPATCH_H
+#define YAMUX_DISPATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Runs stream callbacks (read_fn, fin_fn, rst_fn and the session's
+// new_stream_fn) on worker threads instead of the thread calling
+// yamux_session_read. Set yamux_config.dispatch to use one; it can be
+// shared by any number of sessions.
+//
+// Every stream has a serial queue: its callbacks run one at a time and
+// in the order the frames arrived, while different streams run in
+// parallel. Received data waits in the queue and keeps counting against
+// the receive window and memory budget until read_fn has run (or, for
+// streams without a read_fn, until yamux_stream_read took it), so a
+// slow stream stops getting data. On top of that, once more than
+// max_queued bytes are waiting over all streams, yamux_session_read
+// blocks until the workers catch up.
+//
+// new_stream_fn runs on the new stream's queue before anything else of
+// it, so it can still install the stream's callbacks. The stream only
+// counts as closed by the peer (yamux_stream_read returning 0) once
+// everything before the FIN went through its queue. A callback that
+// waits for something only the session's reader can provide (e.g.
+// window) blocks a worker meanwhile.
+struct yamux_dispatch;
+struct yamux_stream;
+struct yamux_rx_chunk;
+
+enum yamux_dispatch_event
+{
+    yamux_dispatch_on_new ,
+    yamux_dispatch_on_data,
+    yamux_dispatch_on_fin ,
+    yamux_dispatch_on_rst ,
+    yamux_dispatch_on_release // yamux_stream_release, clears the callbacks
+};
+
+// one queued callback. data events carry the payload as an rx chunk, so
+// it can go straight into the stream's receive buffer.
+struct yamux_dispatch_job
+{
+    struct yamux_dispatch_job* next;
+
+    enum yamux_dispatch_event event;
+
+    uint32_t               used ; // receive window the payload took
+    struct yamux_rx_chunk* chunk;
+};
+
+// a stream's queue, allocated with its first job
+struct yamux_strand
+{
+    struct yamux_stream* stream; // NULL once freed during a callback
+
+    struct yamux_dispatch_job* first;
+    struct yamux_dispatch_job* last ;
+
+    struct yamux_strand* next; // in the dispatcher's run queue
+
+    bool queued ; // in the run queue
+    bool running; // a worker is in one of its callbacks
+};
+
+struct yamux_dispatch
+{
+    size_t     num_threads;
+    pthread_t* threads    ;
+
+    size_t max_queued; // bytes, 0 for no limit
+    size_t queued    ;
+
+    // strands with jobs that no worker has taken yet
+    struct yamux_strand* first;
+    struct yamux_strand* last ;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  work ; // run queue not empty
+    pthread_cond_t  room ; // queued went down
+    pthread_cond_t  done ; // a strand stopped running
+
+    bool stop;
+};
+
+// threads: 0 for one per online CPU
+struct yamux_dispatch* yamux_dispatch_new (size_t threads, size_t max_queued);
+// finishes queued jobs first. no session may use it anymore.
+void                   yamux_dispatch_free(struct yamux_dispatch* dispatch);
+
+// runs the callback for event right away if the stream's session has no
+// dispatcher, queues it otherwise. called by the session reader.
+void    yamux_dispatch_event(struct yamux_stream* stream, enum yamux_dispatch_event event);
+// queues a received payload (taking the chunk), blocking while the
+// dispatcher is full. only used with a dispatcher.
+ssize_t yamux_dispatch_data (struct yamux_stream* stream, struct yamux_rx_chunk* chunk, uint32_t used);
+// queues yamux_stream_release's part behind the stream's callbacks.
+// only used with a dispatcher.
+ssize_t yamux_dispatch_release(struct yamux_stream* stream);
+
+// drops the stream's pending jobs and waits for a running one, unless
+// that's the caller. called by yamux_stream_free, returns the receive
+// window the dropped payloads took.
+uint32_t yamux_dispatch_detach(struct yamux_stream* stream);
+
+#endif
+
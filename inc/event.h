@@ -0,0 +1,44 @@
+#ifndef YAMUX_EVENT_H
+#define YAMUX_EVENT_H
+
+#include <stdint.h>
+#include "atomics.h"
+#include <time.h>
+
+// An event count: lets a thread sleep until a condition that other
+// threads change without a lock (e.g. a stream's window) may have
+// become true. Notifying costs a single atomic load while nobody waits,
+// so it can sit on hot paths.
+//
+// Waiting always looks like this:
+//
+//     while (!cond)
+//     {
+//         uint32_t key = yamux_event_prepare(ev);
+//         if (cond)
+//         {
+//             yamux_event_cancel(ev);
+//             break;
+//         }
+//         yamux_event_wait(ev, key, NULL);
+//     }
+struct yamux_event
+{
+    YAMUX_ATOMIC(uint32_t) seq    ; // futex word, bumped by every notify
+    YAMUX_ATOMIC(uint32_t) waiters;
+};
+
+void yamux_event_init(struct yamux_event* ev);
+
+// announces a waiter, must be followed by cancel or wait
+uint32_t yamux_event_prepare(struct yamux_event* ev);
+void     yamux_event_cancel (struct yamux_event* ev);
+
+// sleeps until a notify after prepare returned key, or until the
+// relative timeout (NULL: none) expires. returns 0 or -ETIMEDOUT.
+int  yamux_event_wait  (struct yamux_event* ev, uint32_t key, const struct timespec* timeout);
+// call after changing the condition
+void yamux_event_notify(struct yamux_event* ev);
+
+#endif
+
@@ -25,7 +25,10 @@ enum yamux_frame_flags
     yamux_frame_syn = 0x0001,
     yamux_frame_ack = 0x0002,
     yamux_frame_fin = 0x0004,
-    yamux_frame_rst = 0x0008
+    yamux_frame_rst = 0x0008,
+
+    // extension, see compress.h. other implementations ignore it.
+    yamux_frame_cmp = 0x0100
 };
 
 #pragma pack(push,1)
@@ -0,0 +1,106 @@
+#ifndef YAMUX_LATENCY_H
+#define YAMUX_LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "atomics.h"
+#include "frame.h"
+
+// How long the application's callbacks take, per session and callback
+// type. Without a dispatcher they all run on the thread in
+// yamux_session_read, so a slow one holds up every stream and ping of
+// the connection.
+//
+// Enabled by yamux_config.callback_timing, or by a stall_threshold: a
+// callback taking at least that many microseconds is reported to the
+// session's stall_fn. A per-session watchdog thread looks at the
+// callbacks still running every half threshold, so one that never
+// returns is reported too. Timing costs two clock reads per callback.
+
+// what was called
+enum yamux_callback
+{
+    yamux_callback_new_stream, // session->new_stream_fn
+    yamux_callback_read      , // read_fn (and message callbacks, in it)
+    yamux_callback_fin       , // fin_fn
+    yamux_callback_rst       , // rst_fn
+    yamux_callback_ping      , // ping_fn
+    yamux_callback_pong      , // pong_fn
+    yamux_callback_go_away   , // go_away_fn
+    yamux_callback_userdata  , // get_str_ud_fn
+    yamux_callback_free      , // the stream's or the session's free_fn
+    yamux_callback_notify    , // session->notify_fn
+    yamux_callback_bridge    , // a bridge's done callback
+    yamux_callback_zerocopy  , // a yamux_stream_write_zc done callback
+
+    yamux_callback_count
+};
+
+// bucket i counts calls of 2^i up to 2^(i+1) nanoseconds (the first
+// one also those under 1ns), the last one everything longer
+#define YAMUX_LATENCY_BUCKETS 40
+
+struct yamux_latency
+{
+    YAMUX_ATOMIC(uint64_t) buckets[yamux_callback_count][YAMUX_LATENCY_BUCKETS];
+    YAMUX_ATOMIC(uint64_t) max    [yamux_callback_count]; // ns
+};
+
+struct yamux_session;
+
+// streamid is 0 for session callbacks. duration in nanoseconds. called
+// once per slow call: by the watchdog thread while the callback still
+// runs (with the duration so far), or by the thread that ran it once
+// it returned between two looks.
+typedef void (*yamux_session_stall_fn)(struct yamux_session* session, yamux_streamid streamid,
+        enum yamux_callback type, uint64_t duration);
+
+// a callback being run, as the watchdog sees it
+struct yamux_running
+{
+    YAMUX_ATOMIC(bool    ) used ;
+    YAMUX_ATOMIC(uint64_t) begin; // ns, 0 until set; the lowest bit once reported
+
+    YAMUX_ATOMIC(uint32_t      ) type    ;
+    YAMUX_ATOMIC(yamux_streamid) streamid;
+};
+
+// callbacks running at the same time (on the reader, dispatcher workers
+// and the session's other threads) that are watched, more are only
+// reported once they return
+#define YAMUX_WATCHED 64
+
+struct yamux_watchdog
+{
+    struct yamux_session* session;
+
+    pthread_t       thread;
+    pthread_mutex_t mutex ;
+    pthread_cond_t  cond  ; // monotonic
+    bool            stop  ;
+
+    struct yamux_running running[YAMUX_WATCHED];
+};
+
+void yamux_latency_init(struct yamux_latency* latency);
+
+// started by yamux_session_new with a stall_threshold, NULL if it can't be
+struct yamux_watchdog* yamux_watchdog_new (struct yamux_session* session);
+void                   yamux_watchdog_free(struct yamux_watchdog* w);
+
+// the least duration (ns) at least fraction (0 to 1) of the calls took
+// no longer than, rounded up to a bucket boundary. 0 without calls.
+uint64_t yamux_latency_percentile(struct yamux_latency* latency, enum yamux_callback type, double fraction);
+// calls counted so far
+uint64_t yamux_latency_count     (struct yamux_latency* latency, enum yamux_callback type);
+
+// around a callback: begin returns 0 if the session doesn't time them.
+// type and streamid have to be the same for both.
+uint64_t yamux_callback_begin(struct yamux_session* session, enum yamux_callback type,
+        yamux_streamid streamid);
+void     yamux_callback_end  (struct yamux_session* session, enum yamux_callback type,
+        yamux_streamid streamid, uint64_t begin);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef YAMUX_MESSAGE_H
+#define YAMUX_MESSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "atomics.h"
+
+// Length-prefixed messages on a stream, see yamux_stream_messages.
+//
+// Every message goes out as a 4 byte big-endian length and its payload.
+// yamux_stream_send_message only appends to a per-stream batch, which is
+// written as one DATA frame (and one send) once it is full, once the
+// oldest message in it waited delay_us, or on yamux_stream_flush.
+// Delays are kept by the session's flusher thread, started with the
+// first stream that has one. It never waits for a stream: it writes
+// what the window and send_rate take, and tries the rest of the batch
+// again later, as it does when a sender holds the batch.
+// yamux_stream_close doesn't flush (the session reader closes streams
+// too, and can't wait for window), so flush before closing.
+//
+// Incoming payloads are split into messages by the stream's read_fn.
+// A message that lies within one payload is passed on in place; only
+// messages spanning payloads are copied together. The receive window is
+// handed back as the payloads are consumed, by their size on the wire,
+// in updates of half a window (see yamux_stream_grant).
+struct yamux_stream;
+
+// called for every whole message, with the stream's read_fn. data is
+// only valid during the call. may free the stream, the rest of the
+// payload is dropped then.
+typedef void (*yamux_message_fn)(struct yamux_stream* stream, uint32_t length, void* data);
+
+// larger incoming messages reset the stream
+#define YAMUX_MESSAGE_MAX (0x10*0x100000)
+
+struct yamux_messages
+{
+    struct yamux_messages* next; // while queued on the flusher
+
+    struct yamux_stream* stream ;
+    yamux_message_fn     message;
+
+    // sending, under mutex (held while the batch is written)
+    pthread_mutex_t mutex;
+
+    char*    out      ;
+    uint32_t out_len  ;
+    uint32_t batch    ; // out's size
+    uint32_t delay_us ; // 0: only full batches and flushes go out
+
+    // the flusher's, under its mutex
+    uint64_t due   ; // CLOCK_MONOTONIC ns the batch has to go out by
+    bool     queued;
+
+    // receiving, only touched by read_fn
+    bool*    gone    ; // set if the stream is freed during message
+    char     head[4];
+    uint32_t head_len;
+    char*    part    ; // a message spanning payloads
+    uint32_t part_len; // its length
+    uint32_t part_off; // received so far
+};
+
+// one per session, with a thread, created by the first stream with a delay
+struct yamux_flusher
+{
+    pthread_t thread;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond ; // a stream was queued, busy went NULL, or stop
+
+    struct yamux_messages* first;
+    struct yamux_messages* busy ; // being flushed, unlocked
+    bool                   stop ;
+};
+
+// stops the thread, streams keep their batches until they are freed
+void yamux_flusher_stop(struct yamux_flusher* flusher);
+void yamux_flusher_free(struct yamux_flusher* flusher);
+
+// drops the stream's batch and message state, called by yamux_stream_free
+void yamux_messages_detach(struct yamux_stream* stream);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef YAMUX_POOL_H
+#define YAMUX_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "session.h"
+#include "stream.h"
+
+// A fixed number of client sessions (connections) to the same peer.
+// New streams are placed on the least loaded session (see
+// yamux_session_load), and sessions that were closed or told to go away
+// are replaced by fresh connections the next time a stream is placed.
+//
+// The pool only places streams; reading every session (one thread per
+// session, or an event loop) is still up to the caller.
+struct yamux_pool;
+
+// returns a connected socket to the peer, or a negative value on failure
+typedef int  (*yamux_pool_connect_fn)(struct yamux_pool* pool);
+// called for every newly connected session, before any stream is put
+// on it, so callbacks can be installed
+typedef void (*yamux_pool_setup_fn  )(struct yamux_pool* pool, struct yamux_session* session);
+// called when a closed session is taken out of the pool; from then on
+// the caller owns it. if unset, the pool keeps it until yamux_pool_reap
+// or yamux_pool_free, since a reader may still be in yamux_session_read.
+typedef void (*yamux_pool_retire_fn )(struct yamux_pool* pool, struct yamux_session* session);
+
+struct yamux_pool
+{
+    struct yamux_config* config;
+
+    size_t num_sessions;
+    struct yamux_session** sessions;
+
+    // taken out of the pool without a retire_fn, not freed yet
+    size_t num_retired;
+    size_t cap_retired;
+    struct yamux_session** retired;
+
+    yamux_pool_connect_fn connect_fn;
+    yamux_pool_setup_fn   setup_fn  ;
+    yamux_pool_retire_fn  retire_fn ;
+
+    void* userdata;
+
+    pthread_mutex_t mutex;
+};
+
+// sessions are connected lazily, on first use
+struct yamux_pool* yamux_pool_new (struct yamux_config* config, size_t num_sessions, yamux_pool_connect_fn connect_fn, void* userdata);
+// frees all sessions still in the pool and the retired ones, does not
+// close their sockets. nothing may be reading them anymore.
+void               yamux_pool_free(struct yamux_pool* pool);
+// frees the retired sessions, once the caller stopped reading them
+void               yamux_pool_reap(struct yamux_pool* pool);
+
+// the least loaded live session, or NULL if none could be connected
+struct yamux_session* yamux_pool_session   (struct yamux_pool* pool);
+// yamux_stream_new on the least loaded session
+struct yamux_stream*  yamux_pool_stream_new(struct yamux_pool* pool, void* userdata);
+
+#endif
+
@@ -0,0 +1,80 @@
+
+#ifndef YAMUX_RATE_H
+#define YAMUX_RATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "atomics.h"
+
+// Token bucket bandwidth limits, for streams (send_rate, recv_rate) and
+// whole sessions (the same pair). Nothing sleeps on them while holding
+// window or inside a non-blocking call:
+//
+// - a write that both its stream's and its session's send_rate don't let
+//   through stops short, or returns -EAGAIN if it sent nothing, see
+//   yamux_stream_send_delay
+// - recv_rate holds back the window updates of consumed data, so the
+//   peer is slowed down by flow control instead of data being dropped.
+//   Updates that can't go yet stay owed, and the session's granter
+//   thread sends them once the rate allows.
+//
+// Implemented as a GCRA: the bucket is a single 'theoretical arrival
+// time' that every frame pushes forward by its size over the rate, so
+// taking from it is one CAS, whatever the rate. Frames are charged by
+// payload, before compression. A NULL bucket is unlimited, see
+// yamux_stream_send_rate.
+struct yamux_rate
+{
+    YAMUX_ATOMIC(uint64_t) rate ; // bytes per second, 0: unlimited
+    YAMUX_ATOMIC(uint64_t) burst; // bytes that may go at once
+    YAMUX_ATOMIC(uint64_t) tat  ; // ns, CLOCK_MONOTONIC
+};
+
+void yamux_rate_init(struct yamux_rate* rate, uint64_t bytes_per_sec, uint64_t burst);
+
+// can be called at any time, also while writes wait. burst 0 allows
+// 100ms worth of data.
+void yamux_rate_set(struct yamux_rate* rate, uint64_t bytes_per_sec, uint64_t burst);
+
+// the largest frame worth sending at once, UINT32_MAX if unlimited
+uint32_t yamux_rate_chunk(struct yamux_rate* rate);
+
+// charges length bytes and returns how many ns the caller has to wait
+// before sending them, 0 if they may go now
+uint64_t yamux_rate_take(struct yamux_rate* rate, uint64_t length);
+// what take would return, without charging anything
+uint64_t yamux_rate_delay(struct yamux_rate* rate, uint64_t length);
+// gives back what was taken for bytes that didn't go out after all
+void     yamux_rate_refund(struct yamux_rate* rate, uint64_t length);
+
+void yamux_rate_sleep(uint64_t ns);
+
+struct yamux_session;
+struct yamux_stream;
+
+// one per session, with a thread, started by the first window update
+// recv_rate held back. calls yamux_stream_grant on streams when due.
+struct yamux_granter
+{
+    pthread_t thread;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond ; // a stream was queued, busy went NULL, or stop
+
+    struct yamux_stream* first;
+    struct yamux_stream* busy ; // being granted to, unlocked
+    bool                 stop ;
+};
+
+// has yamux_stream_grant called on stream in ns nanoseconds (or earlier,
+// if it was due earlier already)
+int  yamux_granter_schedule(struct yamux_stream* stream, uint64_t ns);
+// takes the stream off the granter, called by yamux_stream_free
+void yamux_granter_detach  (struct yamux_stream* stream);
+
+void yamux_granter_stop(struct yamux_granter* granter);
+void yamux_granter_free(struct yamux_granter* granter);
+
+#endif
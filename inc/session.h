@@ -5,10 +5,19 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "atomics.h"
 #include <time.h>
 
 #include "config.h"
 #include "frame.h"
+#include "capture.h"
+#include "event.h"
+#include "zerocopy.h"
+#include "spare.h"
+#include "latency.h"
+#include "rate.h"
 #include "stream.h"
 
 enum yamux_session_type
@@ -32,19 +41,103 @@ typedef void  (*yamux_session_pong_fn      )(struct yamux_session* session, uint
 typedef void  (*yamux_session_go_away_fn   )(struct yamux_session* session, enum yamux_error err       );
 typedef void  (*yamux_session_new_stream_fn)(struct yamux_session* session, struct yamux_stream* stream);
 typedef void  (*yamux_session_free_fn      )(struct yamux_session* sesssion                            );
-
-struct yamux_session_stream
+typedef void  (*yamux_session_notify_fn    )(struct yamux_session* session, struct yamux_stream* stream);
+
+// what the frame dispatch and the write path need of every stream, as
+// parallel arrays indexed by the stream's slot, so the dispatch doesn't
+// touch the streams themselves. allocated for config->accept_backlog
+// streams up front and never moved, which lets writers use the atomics
+// from any thread.
+//
+// index maps ids to slots: slot + 1 (0: empty), linear probing from
+// id / 2, at least twice as many entries as slots. it's changed under
+// session->lock; the frame dispatch reads it without, and looks again
+// under the lock when it finds nothing. that's why ids are atomic too:
+// a slot found that way may be freed or taken again meanwhile, its id
+// is what tells. the id is set last when a stream is added.
+struct yamux_stream_table
 {
-    struct yamux_stream* stream;
-    bool alive;
+    YAMUX_ATOMIC(yamux_streamid)* ids    ; // 0: free slot
+    YAMUX_ATOMIC(uint8_t       )* states ; // enum yamux_stream_state
+    YAMUX_ATOMIC(uint32_t      )* windows; // send window
+    struct yamux_stream**         streams;
+
+    YAMUX_ATOMIC(uint32_t)* index;
+    size_t                  index_mask;
 };
 struct yamux_session
 {
     struct yamux_config* config;
 
     size_t num_streams;
-    size_t cap_streams;
-    struct yamux_session_stream* streams;
+    size_t cap_streams; // slots in use are all below this
+    struct yamux_stream_table streams;
+
+    // taking and freeing slots, and nextid: streams can be opened by the
+    // session reader (for the peer, or as spares) and anyone else
+    pthread_mutex_t lock;
+    // held for every frame written to sock, see yamux_session_send
+    pthread_mutex_t send_lock;
+
+    // ready to be taken, see spare.h
+    struct yamux_spares spares;
+    YAMUX_ATOMIC(struct yamux_refiller*) refiller;
+
+    // for the session reader, linked through spare_next of their cold
+    // state: spares takers found closed, and streams released without a
+    // dispatcher
+    YAMUX_ATOMIC(struct yamux_stream*) orphans;
+    YAMUX_ATOMIC(struct yamux_stream*) released;
+
+    // streams that ran out of send window and are waiting for an update
+    YAMUX_ATOMIC(size_t) stalled_streams;
+
+    // notified whenever any of the streams may have become ready, what
+    // yamux_poll sleeps on
+    struct yamux_event poll_event;
+
+    // buffered data and outstanding receive window of all streams,
+    // limited by config->memory_budget
+    struct yamux_budget memory;
+
+    // if set, every received frame is recorded, see capture.h
+    struct yamux_capture* capture;
+
+    // read ahead by yamux_session_prefetch, yamux_session_recv takes
+    // from here first
+    char*  in_buf;
+    size_t in_len;
+    size_t in_off;
+    size_t in_cap;
+
+    // set by yamux_session_set_nonblocking. what a send couldn't finish
+    // then waits here for yamux_session_flush, guarded by send_lock.
+    bool   nonblocking;
+    char*  out_buf;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+
+    // MSG_ZEROCOPY sends the kernel hasn't released yet
+    struct yamux_zerocopy zerocopy;
+
+    // limits for all streams together, on top of their own
+    struct yamux_rate send_rate;
+    struct yamux_rate recv_rate;
+
+    // runs the streams' bridges, see bridge.h
+    YAMUX_ATOMIC(struct yamux_relay*) relay;
+
+    // writes message batches whose delay is up, see message.h
+    YAMUX_ATOMIC(struct yamux_flusher*) flusher;
+
+    // sends window updates recv_rate held back, see rate.h
+    YAMUX_ATOMIC(struct yamux_granter*) granter;
+
+    // how long the callbacks took, if config->callback_timing
+    struct yamux_latency latency;
+    // reports callbacks still running past config->stall_threshold
+    struct yamux_watchdog* watchdog;
 
     yamux_session_get_str_ud_fn get_str_ud_fn;
     yamux_session_ping_fn       ping_fn      ;
@@ -52,6 +145,11 @@ struct yamux_session
     yamux_session_go_away_fn    go_away_fn   ;
     yamux_session_new_stream_fn new_stream_fn;
     yamux_session_free_fn       free_fn      ;
+    // called whenever a stream may have become readable, writable or
+    // closed (see yamux_stream_ready), from whichever thread changed it
+    yamux_session_notify_fn     notify_fn    ;
+    // a callback took config->stall_threshold or longer
+    yamux_session_stall_fn      stall_fn     ;
 
     void* userdata;
 
@@ -60,14 +158,18 @@ struct yamux_session
     enum yamux_session_type type;
 
     int sock;
+    int event_fd; // see yamux_session_eventfd, -1 if unused
 
     yamux_streamid nextid;
 
-    bool closed;
+    // set by yamux_session_close or a Go Away, read from any thread
+    YAMUX_ATOMIC(bool) closed;
 };
 
 struct yamux_session* yamux_session_new (struct yamux_config* config, int sock, enum yamux_session_type type, void* userdata);
-// does not close the socket, but does close the session
+// does not close the socket, but does close the session. waits for the
+// kernel to release outstanding zerocopy sends, unless the socket was
+// closed or reset.
 void                  yamux_session_free(struct yamux_session* session);
 
 // does not free used memory
@@ -79,8 +181,66 @@ inline ssize_t yamux_session_go_away(struct yamux_session* session, enum yamux_e
 
 ssize_t yamux_session_ping(struct yamux_session* session, uint32_t value, bool pong);
 
-// defers to stream read handlers
+// defers to stream read handlers. opens spare streams first, if some
+// are missing.
 ssize_t yamux_session_read(struct yamux_session* session);
 
+// an open stream from the spares, or if there are none (left), a
+// new one, whose SYN goes out with its first write. see spare.h.
+struct yamux_stream* yamux_session_take_stream(struct yamux_session* session, void* userdata);
+
+// runs the callbacks of finished yamux_stream_write_zc calls, returns
+// how many there were. also done by yamux_session_read and every
+// zerocopy write; worth calling when the socket polls with POLLERR.
+int yamux_session_reap_zerocopy(struct yamux_session* session);
+
+// reads what the socket has without blocking, until a whole frame is
+// buffered. returns 1 once yamux_session_read can take it without
+// blocking, 0 if more has to arrive, -1 when the peer closed the
+// connection or on errors, -EPROTO for a frame no window allows.
+int yamux_session_prefetch(struct yamux_session* session);
+
+// for C++, which can't use the atomic members (see atomics.h)
+bool yamux_session_is_closed(struct yamux_session* session);
+
+// makes the socket non-blocking, for event loops that only read through
+// yamux_session_prefetch. what of a frame the socket doesn't take is
+// kept and sent by yamux_session_flush, so frames are never torn; until
+// then stream writes stop short, as they do without window.
+int yamux_session_set_nonblocking(struct yamux_session* session);
+// false while a non-blocking session has something left over
+bool yamux_session_writable(struct yamux_session* session);
+// sends what's left over without blocking. returns 1 once nothing is
+// left, 0 if the socket is full again, -1 on errors.
+int yamux_session_flush(struct yamux_session* session);
+
+// receives exactly length bytes from the session's socket, spinning
+// first if config->busy_poll is set. returns length, or less on error
+// or when the peer closed the connection. prefetched bytes come first.
+ssize_t yamux_session_recv(struct yamux_session* session, void* buf, size_t length);
+// sends one frame (header and payload in buf) on the session's socket,
+// under send_lock: stream sockets don't keep concurrent large sends in
+// one piece. see yamux_session_set_nonblocking for non-blocking ones.
+ssize_t yamux_session_send(struct yamux_session* session, const void* buf, size_t length);
+
+// like yamux_stream_eventfd, but signalled for events on any stream of
+// the session (including new ones). closed by yamux_session_free.
+int yamux_session_eventfd(struct yamux_session* session);
+
+// adds or removes streams.ids[slot] in streams.index, holding
+// session->lock
+void yamux_session_index_add(struct yamux_session* session, uint32_t slot);
+void yamux_session_index_del(struct yamux_session* session, uint32_t slot);
+
+// memory accounting against the session's and the shared budget
+size_t yamux_session_headroom(struct yamux_session* session);
+void   yamux_session_commit  (struct yamux_session* session, int64_t delta);
+void   yamux_session_buffer  (struct yamux_session* session, int64_t delta);
+
+// rough measure of how busy a session is, used to spread streams over
+// several sessions: open streams, window stalls and unsent socket bytes
+// (every 16K counting as one more stream)
+size_t yamux_session_load(struct yamux_session* session);
+
 #endif
 
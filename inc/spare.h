@@ -0,0 +1,91 @@
+
+#ifndef YAMUX_SPARE_H
+#define YAMUX_SPARE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "atomics.h"
+
+// Open streams kept ready for yamux_session_take_stream, so a request
+// doesn't pay for a SYN, or for the peer setting up its side of the
+// stream. yamux_config.spare_streams sets how many; the session's
+// refiller thread opens replacements whenever a stream was taken (or
+// the reader finds some missing) and pushes them here as soon as their
+// SYN is out. They need not be ACKed yet: peers only ACK with the first
+// frame they send back, and a stream can be written before that anyway.
+//
+// A bounded lock-free queue (Vyukov's MPMC ring): every cell has a
+// sequence number telling producers and consumers whose turn it is, so
+// taking a stream is a CAS on 'head' and nothing else.
+//
+// Only the session reader frees spares the peer closed or refused
+// meanwhile, and only between frames (or yamux_session_free): a taker
+// finding one hands it over through yamux_spares_orphan. Released
+// streams go back into the ring the same way, see
+// yamux_stream_release.
+#include <pthread.h>
+
+struct yamux_session;
+struct yamux_stream;
+
+struct yamux_spare_cell
+{
+    YAMUX_ATOMIC(size_t) seq;
+    struct yamux_stream* stream;
+};
+
+struct yamux_spares
+{
+    size_t                   mask ; // cells - 1, cells is a power of 2
+    struct yamux_spare_cell* cells;
+
+    YAMUX_ATOMIC(size_t) head; // next to take
+    YAMUX_ATOMIC(size_t) tail; // next to fill
+
+    size_t target; // 0: no spares
+
+    // the peer refused one; no more until a stream is taken, or every
+    // RST would be answered with the next SYN
+    YAMUX_ATOMIC(bool) paused;
+};
+
+// one per session with spares, with a thread, started by the first
+// yamux_spares_kick
+struct yamux_refiller
+{
+    pthread_t thread;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond ; // wanted or stop was set
+
+    struct yamux_session* session;
+
+    bool wanted; // the ring may be short
+    bool stop  ;
+};
+
+// -ENOMEM if the ring couldn't be allocated
+int  yamux_spares_init   (struct yamux_spares* spares, size_t target);
+// doesn't free the streams, they belong to the session
+void yamux_spares_destroy(struct yamux_spares* spares);
+
+bool                 yamux_spares_push (struct yamux_spares* spares, struct yamux_stream* stream);
+struct yamux_stream* yamux_spares_pop  (struct yamux_spares* spares);
+// ready streams, a snapshot
+size_t               yamux_spares_count(struct yamux_spares* spares);
+
+// has the session's refiller top the ring up, unless it's full or paused
+void yamux_spares_kick(struct yamux_session* session);
+// hands a closed (or closing) spare to the session reader for freeing
+void yamux_spares_orphan(struct yamux_stream* stream);
+// hands a stream released without a dispatcher to the session reader
+void yamux_spares_return(struct yamux_stream* stream);
+// called by the session reader between frames: frees orphans and puts
+// streams released without a dispatcher back into the ring
+void yamux_spares_reclaim(struct yamux_session* session);
+
+void yamux_refiller_stop(struct yamux_refiller* refiller);
+void yamux_refiller_free(struct yamux_refiller* refiller);
+
+#endif
@@ -4,12 +4,26 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <pthread.h> // 引入 pthread 库
+#include <sys/types.h>
+#include "atomics.h"
 
+#include "event.h"
+#include "compress.h"
+#include "rate.h"
+#include "bridge.h"
+#include "message.h"
+#include "dispatch.h"
 #include "session.h"
 
 // NOTE: 'data' is not guaranteed to be preserved when the read_fn
 // handler exists (read: it will be freed).
+// Streams without a read_fn buffer incoming data instead, see
+// yamux_stream_read.
+//
+// A FIN is handled after the payload of its own frame: read_fn gets the
+// data first, then fin_fn runs, and only then does the stream count as
+// closed (yamux_stream_read returning 0). With a dispatcher that also
+// waits for every callback queued before it.
 struct yamux_stream;
 
 typedef void (*yamux_stream_read_fn)(struct yamux_stream* stream, uint32_t data_length, void* data);
@@ -27,6 +41,72 @@ enum yamux_stream_state
     yamux_stream_closed
 };
 
+// readiness, as reported by yamux_stream_ready and yamux_poll
+enum yamux_poll_events
+{
+    yamux_poll_in  = 0x01, // buffered data, or the peer closed the stream
+    yamux_poll_out = 0x04, // send window available
+    yamux_poll_hup = 0x10  // closed, nothing more can be written
+};
+
+// one received DATA payload, queued for yamux_stream_read
+struct yamux_rx_chunk
+{
+    YAMUX_ATOMIC(struct yamux_rx_chunk*) next;
+
+    uint32_t length;
+    uint32_t offset; // consumed so far
+    uint32_t wire  ; // frame length, may differ when compressed
+    uint32_t size  ; // room allocated after the chunk, for reuse
+    char*    data  ;
+};
+
+// receive buffer when there's no read_fn: a single producer/consumer
+// queue, filled by the session reader and drained by yamux_stream_read.
+// first is only touched by the reader side, last only by the session
+// side. allocated when the first payload is buffered.
+struct yamux_rx_queue
+{
+    struct yamux_rx_chunk  stub ;
+    struct yamux_rx_chunk* first;
+    struct yamux_rx_chunk* last ;
+};
+
+// state only some streams need, allocated by yamux_stream_cold the first
+// time one of its features is used and freed with the stream
+struct yamux_stream_cold
+{
+    int event_fd; // see yamux_stream_eventfd, -1 if unused
+
+    // set once both sides agreed on compression. only one thread may
+    // write to a compressed stream at a time.
+    YAMUX_ATOMIC(struct yamux_compress*) compress;
+
+    // unlimited until set with yamux_rate_set, see rate.h
+    struct yamux_rate send_rate;
+    struct yamux_rate recv_rate;
+
+    // queued on the session's granter, guarded by its mutex
+    struct yamux_stream* grant_next;
+    uint64_t             grant_due;
+    bool                 grant_queued;
+
+    // set while relaying to an fd, see bridge.h
+    YAMUX_ATOMIC(struct yamux_bridge*) bridge;
+
+    // opened for session->spares and not taken yet
+    YAMUX_ATOMIC(bool) spare;
+    // on session->orphans or session->released
+    struct yamux_stream* spare_next;
+
+    // set by yamux_stream_messages, see message.h
+    struct yamux_messages* messages;
+};
+
+// the parts of a stream the frame dispatch doesn't need. state and send
+// window live in session->streams (see struct yamux_stream_table), read
+// them with yamux_stream_get_state and yamux_stream_get_window. kept
+// within two cache lines, anything optional goes to cold.
 struct yamux_stream
 {
     struct yamux_session* session;
@@ -38,19 +118,49 @@ struct yamux_stream
 
     void* userdata;
 
-    enum yamux_stream_state state;
+    yamux_streamid id  ;
+    uint32_t       slot; // index into session->streams
+
+    YAMUX_ATOMIC(bool) stalled; // counted in session->stalled_streams
+    bool cmp_requested;         // our SYN offered compression
+
+    // consumed bytes not yet handed back to the peer, see
+    // yamux_stream_grant. granting is held by the thread sending them.
+    YAMUX_ATOMIC(bool)     granting;
+    YAMUX_ATOMIC(uint32_t) owed;
+
+    // notified when the window grows, data arrives or the stream closes
+    struct yamux_event event;
+
+    YAMUX_ATOMIC(struct yamux_rx_queue*) rx;
+    YAMUX_ATOMIC(uint32_t)               rx_bytes;
+    // payloads waiting for a worker, see dispatch.h. a bridge takes
+    // incoming data directly only once they went through.
+    YAMUX_ATOMIC(uint32_t)               rx_queued;
+    // the last consumed chunk, reused for the next payload that fits
+    YAMUX_ATOMIC(struct yamux_rx_chunk*) rx_spare;
 
-    yamux_streamid id;
+    // receive credit the peer still has
+    YAMUX_ATOMIC(uint32_t) recv_window;
+    // the window the payload read_fn is called with took: its size on
+    // the wire, before decompression. only valid in read_fn.
+    uint32_t rx_wire;
 
-    uint32_t window_size;
+    // callbacks waiting for a worker, see dispatch.h. guarded by the
+    // dispatcher's mutex.
+    struct yamux_strand* strand;
 
-    pthread_mutex_t mutex; // 新增：用于保护 stream 状态和 window_size
-    pthread_cond_t cond;   // 新增：用于在 window_size 增长时发出信号
+    // NULL until needed, see yamux_stream_cold
+    YAMUX_ATOMIC(struct yamux_stream_cold*) cold;
 };
 
-// does not init the stream
+// does not init the stream. NULL if the session's memory budget can't
+// take another full receive window.
 struct yamux_stream* yamux_stream_new(struct yamux_session* session, yamux_streamid id, void* userdata);
 
+enum yamux_stream_state yamux_stream_get_state (struct yamux_stream* stream);
+uint32_t                yamux_stream_get_window(struct yamux_stream* stream);
+
 // not obligatory, SYN is sent by yamux_stream_write when the stream
 // isn't initialised anyway
 ssize_t yamux_stream_init (struct yamux_stream* stream);
@@ -63,12 +173,102 @@ ssize_t yamux_stream_reset(struct yamux_stream* stream);
 
 void yamux_stream_free(struct yamux_stream* stream);
 
+// the stream's cold state, allocated on first use. NULL if that fails.
+struct yamux_stream_cold* yamux_stream_cold(struct yamux_stream* stream);
+
+// the stream's token buckets, see rate.h. NULL if they can't be
+// allocated, which the yamux_rate functions take as unlimited.
+struct yamux_rate* yamux_stream_send_rate(struct yamux_stream* stream);
+struct yamux_rate* yamux_stream_recv_rate(struct yamux_stream* stream);
+
+// puts an open stream back into the session's spares for the
+// next yamux_session_take_stream, with its callbacks and userdata
+// cleared. that happens behind callbacks still running or queued for it:
+// on the dispatcher, or without one on the session reader before the
+// next frame, so it can't be taken before. only for protocols that know neither side will still send
+// anything for the last request. -EINVAL if it's not open or has unread
+// data, -ENOSPC if there are enough spares; close it then.
+int yamux_stream_release(struct yamux_stream* stream);
+
 ssize_t yamux_stream_window_update(struct yamux_stream* stream, int32_t delta);
+// stops short where the send window ends or the stream's or session's
+// send_rate doesn't let the next frame through yet, or a non-blocking
+// socket is full (see yamux_session_set_nonblocking); -EAGAIN then if
+// nothing was sent. yamux_stream_wait_for_window waits for the first two.
 ssize_t yamux_stream_write(struct yamux_stream* stream, uint32_t data_length, void* data);
+// like yamux_stream_write, but frames of at least
+// config->zerocopy_threshold bytes are sent with MSG_ZEROCOPY, see
+// zerocopy.h. data must stay untouched until done(arg, status) was
+// called, which happens exactly once, also if nothing was sent.
+ssize_t yamux_stream_write_zc(struct yamux_stream* stream, uint32_t data_length, void* data,
+        yamux_write_done_fn done, void* arg);
 
 ssize_t yamux_stream_process(struct yamux_stream* stream, struct yamux_frame* frame, int sock);
 
-// 当 stream->window_size 为 0 时，等待其增长
+// runs the callback for one event of the stream: inline from the session
+// reader, or on a worker through yamux_dispatch_event. data events hand
+// the payload to read_fn, or to the receive buffer if there's none.
+void yamux_stream_dispatch(struct yamux_stream* stream, enum yamux_dispatch_event event, struct yamux_rx_chunk* chunk, uint32_t used);
+
+// 当发送窗口为 0 时，等待其增长；超出发送限速时再等到允许发送
 ssize_t yamux_stream_wait_for_window(struct yamux_stream* stream);
+// ns until send_rate lets the next frame through, 0 if it may go now
+uint64_t yamux_stream_send_delay(struct yamux_stream* stream);
+
+// wakes threads in yamux_stream_wait_for_window or yamux_poll, and
+// signals eventfds, after a state change
+void yamux_stream_wake(struct yamux_stream* stream);
+
+// copies buffered data (only for streams without a read_fn) and hands
+// the consumed bytes back to the peer as window, see yamux_stream_grant.
+// never blocks. returns 0 once the peer closed the stream and the buffer is
+// empty, -EAGAIN if it's just empty.
+ssize_t yamux_stream_read(struct yamux_stream* stream, uint32_t data_length, void* data);
+
+// adds consumed to what's owed to the peer and sends it as a window
+// update once it's half a window, smaller close to the memory budget.
+// when recv_rate doesn't let it through yet it stays owed, and the
+// session's granter calls this again once it does. the tokens are
+// given back if the update can't be sent.
+void yamux_stream_grant(struct yamux_stream* stream, uint32_t consumed);
+
+// current enum yamux_poll_events mask
+uint32_t yamux_stream_ready(struct yamux_stream* stream);
+
+// waits until at least one streams[i] is ready for one of events[i], or
+// timeout milliseconds have passed (negative: forever). revents[i] gets
+// the ready subset of events[i] (hup is always reported). returns the
+// number of ready streams, 0 on timeout. sleeps on the streams' session;
+// streams of several sessions are rescanned every millisecond.
+int yamux_poll(struct yamux_stream* streams[], const uint32_t events[], uint32_t revents[], size_t n, int timeout);
+
+// relays between the stream and fd (taking it over) on the session's
+// relay thread until either side closes, then calls done. read_fn and
+// receive buffering aren't used meanwhile, and the stream's eventfd
+// belongs to the relay; data already buffered goes to fd first. call it
+// from new_stream_fn or another callback of the stream, or before the
+// peer sends anything. -ENOBUFS if the pipe can't be made to hold a
+// window (see /proc/sys/fs/pipe-user-pages-soft). see bridge.h.
+int yamux_stream_bridge(struct yamux_stream* stream, int fd, yamux_bridge_done_fn done);
+
+// switches the stream to length-prefixed messages: incoming data is
+// handed to message one message at a time (taking over read_fn), and
+// outgoing messages are batched up to batch bytes (0: 16K) or delay_us
+// (0: until full or flushed). call before the stream can receive, e.g.
+// in new_stream_fn. don't mix with yamux_stream_write. see message.h.
+int yamux_stream_messages(struct yamux_stream* stream, yamux_message_fn message,
+        uint32_t batch, uint32_t delay_us);
+// queues a message, writing the batch if it's full. messages larger
+// than a batch are written right away. writing waits for send window,
+// so without a dispatcher don't send from the session reader's
+// callbacks more than the peer's window takes. returns length or -errno.
+ssize_t yamux_stream_send_message(struct yamux_stream* stream, uint32_t length, const void* data);
+// writes the batched messages now
+ssize_t yamux_stream_flush(struct yamux_stream* stream);
+
+// an eventfd that is signalled whenever the stream may have become
+// readable, writable or closed, for use in an application's own epoll
+// set. created on first call, closed by yamux_stream_free.
+int yamux_stream_eventfd(struct yamux_stream* stream);
 
 #endif
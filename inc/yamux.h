@@ -2,10 +2,23 @@
 #ifndef YAMUX_H
 #define YAMUX_H
 
+// pulls in <atomic> for C++, which must happen outside extern "C"
+#include "atomics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #include "frame.h"
 #include "config.h"
 #include "session.h"
 #include "stream.h"
+#include "pool.h"
+#include "dispatch.h"
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
 
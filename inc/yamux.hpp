@@ -0,0 +1,809 @@
+#ifndef YAMUX_HPP
+#define YAMUX_HPP
+
+// C++20 coroutine layer over sessions and streams, header only.
+//
+// Everything runs on one thread, in yamux::loop::run: sessions are read
+// when their socket is readable, and coroutines waiting on a stream are
+// resumed when the session's notify_fn reports a change on it. Waiting
+// costs no thread and no allocation; the awaiter lives in the coroutine
+// frame. Streams use the buffered receive path (no read_fn).
+//
+//     yamux::task serve(yamux::session& s)
+//     {
+//         while (yamux::stream st = co_await s.accept())
+//             echo(std::move(st));
+//     }
+//     yamux::task echo(yamux::stream st)
+//     {
+//         std::byte buf[0x1000];
+//         ssize_t n;
+//         while ((n = co_await st.read(buf)) > 0)
+//             co_await st.write(std::span(buf, n));
+//     }
+//
+// Frames are read ahead without blocking (yamux_session_prefetch) and
+// only handed to yamux_session_read once complete, so a partial frame
+// doesn't hold up the loop. Sends don't block either: the socket is
+// non-blocking, a frame the kernel send buffer doesn't take whole is
+// finished by yamux_session_flush once epoll reports it writable, and
+// writers that found it full wait for that like they wait for window.
+// Both ends of a connection can share a loop.
+
+#include <algorithm>
+#include <coroutine>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <exception>
+#include <new>
+#include <span>
+#include <system_error>
+#include <utility>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "yamux.h"
+
+namespace yamux
+{
+
+class loop;
+class session;
+class stream;
+
+// a coroutine nobody awaits: starts right away, frees itself when done
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() noexcept { return {}; }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend  () noexcept { return {}; }
+
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+namespace detail
+{
+
+struct session_state;
+
+// something suspended on a stream or session. 'poll' makes what
+// progress it can and returns true once the coroutine may resume.
+struct waiter
+{
+    bool (*poll)(waiter* self);
+    std::coroutine_handle<> handle;
+};
+
+struct stream_state
+{
+    yamux_stream*  handle = nullptr; // null once the session freed it
+    session_state* owner  = nullptr;
+
+    waiter* reader = nullptr;
+    waiter* writer = nullptr;
+
+    // intrusive list of streams the loop has to look at
+    stream_state* prev_ready = nullptr;
+    stream_state* next_ready = nullptr;
+    bool          queued     = false;
+
+    // accepted but not yet handed out
+    stream_state* next_accept = nullptr;
+
+    // intrusive list of streams whose writer waits for send_rate
+    stream_state* next_timed = nullptr;
+    std::uint64_t due        = 0; // CLOCK_MONOTONIC ns
+    bool          timed      = false;
+
+    // intrusive list of streams whose writer waits for the socket
+    stream_state* next_blocked = nullptr;
+    bool          blocked      = false;
+};
+
+struct session_state
+{
+    loop*          lp     = nullptr;
+    yamux_session* handle = nullptr;
+
+    stream_state* accept_head = nullptr;
+    stream_state* accept_tail = nullptr;
+    waiter*       acceptor    = nullptr;
+
+    session_state* next_ready = nullptr;
+    bool           queued     = false;
+
+    stream_state* blocked = nullptr;
+
+    bool dead = false;
+};
+
+} // namespace detail
+
+class loop
+{
+public:
+    loop() : epfd(epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (epfd < 0)
+            throw std::system_error(errno, std::generic_category(), "epoll_create1");
+    }
+    ~loop() { close(epfd); }
+
+    loop(const loop&) = delete;
+    loop& operator=(const loop&) = delete;
+
+    // runs until stop() or until no session is left alive
+    void run()
+    {
+        stopped = false;
+
+        while (!stopped)
+        {
+            dispatch();
+
+            if (stopped || !live)
+                break;
+
+            epoll_event ev[0x40];
+            int n = epoll_wait(epfd, ev, 0x40, timeout());
+            if (n < 0 && errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "epoll_wait");
+
+            for (int i = 0; i < n; ++i)
+            {
+                auto* s = static_cast<detail::session_state*>(ev[i].data.ptr);
+
+                if (ev[i].events & EPOLLOUT)
+                    drain(s);
+                if ((ev[i].events & ~EPOLLOUT) && !s->dead)
+                    pump(s);
+            }
+
+            expire();
+        }
+    }
+    void stop() noexcept { stopped = true; }
+
+private:
+    friend class session;
+    friend class stream;
+
+    void add(detail::session_state* s)
+    {
+        // edge triggered: pump reads until the socket is empty, and
+        // writability only matters after a send found it full
+        epoll_event ev{};
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = s;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->handle->sock, &ev) < 0)
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+
+        live++;
+    }
+    void remove(detail::session_state* s) noexcept
+    {
+        if (!s->dead)
+        {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, s->handle->sock, nullptr);
+            s->dead = true;
+            live--;
+        }
+
+        if (s->queued)
+        {
+            detail::session_state** p = &ready_sessions;
+            while (*p != s)
+                p = &(*p)->next_ready;
+            *p = s->next_ready;
+            s->queued = false;
+        }
+    }
+
+    void mark(detail::stream_state* st) noexcept
+    {
+        if (st->queued)
+            return;
+
+        st->queued     = true;
+        st->prev_ready = nullptr;
+        st->next_ready = ready_streams;
+        if (ready_streams)
+            ready_streams->prev_ready = st;
+        ready_streams = st;
+    }
+    void unmark(detail::stream_state* st) noexcept
+    {
+        if (!st->queued)
+            return;
+
+        if (st->prev_ready)
+            st->prev_ready->next_ready = st->next_ready;
+        else
+            ready_streams = st->next_ready;
+        if (st->next_ready)
+            st->next_ready->prev_ready = st->prev_ready;
+
+        st->queued = false;
+    }
+    static std::uint64_t now_ns() noexcept
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (std::uint64_t)ts.tv_sec * 1000000000u + (std::uint64_t)ts.tv_nsec;
+    }
+
+    // marks st again in ns nanoseconds
+    void delay(detail::stream_state* st, std::uint64_t ns) noexcept
+    {
+        st->due = now_ns() + ns;
+
+        if (st->timed)
+            return;
+
+        st->timed      = true;
+        st->next_timed = timed_streams;
+        timed_streams  = st;
+    }
+    void untime(detail::stream_state* st) noexcept
+    {
+        if (!st->timed)
+            return;
+
+        detail::stream_state** p = &timed_streams;
+        while (*p != st)
+            p = &(*p)->next_timed;
+        *p = st->next_timed;
+
+        st->timed = false;
+    }
+
+    // marks st again once its session's socket is writable
+    void block(detail::stream_state* st) noexcept
+    {
+        if (st->blocked)
+            return;
+
+        st->blocked        = true;
+        st->next_blocked   = st->owner->blocked;
+        st->owner->blocked = st;
+    }
+    void unblock(detail::stream_state* st) noexcept
+    {
+        if (!st->blocked)
+            return;
+
+        detail::stream_state** p = &st->owner->blocked;
+        while (*p != st)
+            p = &(*p)->next_blocked;
+        *p = st->next_blocked;
+
+        st->blocked = false;
+    }
+    // epoll_wait's, until the first delayed stream is due
+    int timeout() const noexcept
+    {
+        if (!timed_streams)
+            return -1;
+
+        std::uint64_t first = UINT64_MAX;
+        for (detail::stream_state* st = timed_streams; st; st = st->next_timed)
+            if (st->due < first)
+                first = st->due;
+
+        std::uint64_t now = now_ns();
+
+        // rounded up to whole milliseconds
+        return first <= now ? 0 : (int)std::min<std::uint64_t>((first - now) / 1000000 + 1, 1000);
+    }
+    void expire() noexcept
+    {
+        std::uint64_t now = now_ns();
+
+        for (detail::stream_state** p = &timed_streams; *p;)
+        {
+            detail::stream_state* st = *p;
+            if (st->due > now)
+            {
+                p = &st->next_timed;
+                continue;
+            }
+
+            *p = st->next_timed;
+            st->timed = false;
+            mark(st);
+        }
+    }
+
+    void mark(detail::session_state* s) noexcept
+    {
+        if (s->queued)
+            return;
+
+        s->queued      = true;
+        s->next_ready  = ready_sessions;
+        ready_sessions = s;
+    }
+
+    // sends what's left over, and once all of it went lets the writers
+    // that found the socket full try again
+    void drain(detail::session_state* s)
+    {
+        int r = yamux_session_flush(s->handle);
+        if (r < 0)
+        {
+            fail(s);
+            return;
+        }
+
+        while (r && s->blocked)
+        {
+            detail::stream_state* st = s->blocked;
+            s->blocked  = st->next_blocked;
+            st->blocked = false;
+            mark(st);
+        }
+    }
+
+    // reads every whole frame that's already there
+    void pump(detail::session_state* s)
+    {
+        int r;
+
+        while ((r = yamux_session_prefetch(s->handle)) > 0)
+            if (yamux_session_read(s->handle) < 0 || yamux_session_is_closed(s->handle))
+            {
+                fail(s);
+                return;
+            }
+
+        if (r < 0)
+            fail(s);
+    }
+    // connection is gone: every waiter on it resumes and sees an error
+    void fail(detail::session_state* s)
+    {
+        yamux_session_close(s->handle, yamux_error_normal);
+        remove(s);
+
+        yamux_session* h = s->handle;
+        for (size_t i = 0; i < h->cap_streams; ++i)
+            if (h->streams.streams[i] && h->streams.streams[i]->userdata)
+                mark(static_cast<detail::stream_state*>(h->streams.streams[i]->userdata));
+
+        mark(s);
+    }
+
+    // detaches w if it's done, the caller resumes it
+    static std::coroutine_handle<> take(detail::waiter*& w)
+    {
+        detail::waiter* cur = w;
+        if (!cur || !cur->poll(cur))
+            return nullptr;
+
+        w = nullptr;
+        return cur->handle;
+    }
+    static void wake(detail::waiter*& w)
+    {
+        if (std::coroutine_handle<> h = take(w))
+            h.resume();
+    }
+
+    void dispatch()
+    {
+        while (ready_streams || ready_sessions)
+        {
+            while (ready_streams)
+            {
+                detail::stream_state* st = ready_streams;
+                unmark(st);
+
+                // either coroutine may destroy the stream once resumed
+                std::coroutine_handle<> r = take(st->reader);
+                std::coroutine_handle<> w = take(st->writer);
+
+                if (r)
+                    r.resume();
+                if (w)
+                    w.resume();
+            }
+
+            while (ready_sessions)
+            {
+                detail::session_state* s = ready_sessions;
+                ready_sessions = s->next_ready;
+                s->queued = false;
+
+                wake(s->acceptor);
+            }
+        }
+    }
+
+    int epfd;
+    bool stopped = false;
+    size_t live = 0;
+
+    detail::stream_state*  ready_streams  = nullptr;
+    detail::session_state* ready_sessions = nullptr;
+    detail::stream_state*  timed_streams  = nullptr;
+};
+
+class stream
+{
+public:
+    stream() noexcept = default;
+    stream(stream&& o) noexcept : st(std::exchange(o.st, nullptr)) {}
+    stream& operator=(stream&& o) noexcept
+    {
+        if (this != &o)
+        {
+            release();
+            st = std::exchange(o.st, nullptr);
+        }
+        return *this;
+    }
+    ~stream() { release(); }
+
+    explicit operator bool() const noexcept { return st && st->handle; }
+    yamux_stream* get() const noexcept { return st ? st->handle : nullptr; }
+
+    // FIN and RST
+    ssize_t close() noexcept { return *this ? yamux_stream_close(st->handle) : -EINVAL; }
+    ssize_t reset() noexcept { return *this ? yamux_stream_reset(st->handle) : -EINVAL; }
+
+    // bytes read, 0 once the peer closed the stream, or -errno
+    struct read_awaiter : detail::waiter
+    {
+        detail::stream_state* st;
+        std::span<std::byte>  buf;
+        ssize_t               result = -EAGAIN;
+
+        static bool try_read(detail::waiter* w)
+        {
+            auto* self = static_cast<read_awaiter*>(w);
+
+            if (!self->st->handle)
+                self->result = -EPIPE;
+            else
+            {
+                self->result = yamux_stream_read(self->st->handle,
+                        (uint32_t)self->buf.size(), self->buf.data());
+
+                // can't become readable anymore
+                if (self->result == -EAGAIN &&
+                        (yamux_stream_ready(self->st->handle) & yamux_poll_hup) &&
+                        yamux_session_is_closed(self->st->handle->session))
+                    self->result = -EPIPE;
+            }
+
+            return self->result != -EAGAIN;
+        }
+
+        bool await_ready() noexcept { return !buf.size() ? (result = 0, true) : try_read(this); }
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            handle = h;
+            st->reader = this;
+        }
+        ssize_t await_resume() const noexcept { return result; }
+    };
+    read_awaiter read(std::span<std::byte> buf) noexcept
+    {
+        read_awaiter a;
+        a.poll = read_awaiter::try_read;
+        a.st   = st;
+        a.buf  = buf;
+        return a;
+    }
+
+    // writes all of data, waiting for window and send_rate as needed.
+    // returns the bytes written, which is less than data.size() only on
+    // error.
+    struct write_awaiter : detail::waiter
+    {
+        detail::stream_state*      st;
+        std::span<const std::byte> data;
+        size_t                     done = 0;
+        ssize_t                    err  = 0;
+
+        static bool try_write(detail::waiter* w)
+        {
+            auto* self = static_cast<write_awaiter*>(w);
+
+            while (self->done < self->data.size())
+            {
+                if (!self->st->handle)
+                {
+                    self->err = -EPIPE;
+                    return true;
+                }
+
+                ssize_t r = yamux_stream_write(self->st->handle,
+                        (uint32_t)(self->data.size() - self->done),
+                        const_cast<std::byte*>(self->data.data() + self->done));
+
+                // send_rate: the loop looks again once it lets frames
+                // through. otherwise the socket was full: once it drained
+                if (r == -EAGAIN)
+                {
+                    loop* lp = self->st->owner->lp;
+
+                    if (std::uint64_t ns = yamux_stream_send_delay(self->st->handle))
+                        lp->delay(self->st, ns);
+                    else
+                        lp->block(self->st);
+                    return false;
+                }
+                if (r < 0)
+                {
+                    self->err = r;
+                    return true;
+                }
+
+                self->done += (size_t)r;
+
+                // out of window, wait for an update unless it's over
+                if (!r)
+                {
+                    if (yamux_stream_ready(self->st->handle) & yamux_poll_hup)
+                    {
+                        self->err = -EPIPE;
+                        return true;
+                    }
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        bool await_ready() noexcept { return try_write(this); }
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            handle = h;
+            st->writer = this;
+        }
+        ssize_t await_resume() const noexcept { return (err && !done) ? err : (ssize_t)done; }
+    };
+    write_awaiter write(std::span<const std::byte> data) noexcept
+    {
+        write_awaiter a;
+        a.poll = write_awaiter::try_write;
+        a.st   = st;
+        a.data = data;
+        return a;
+    }
+
+    // waits until there's send window; false if the stream is closed
+    struct window_awaiter : detail::waiter
+    {
+        detail::stream_state* st;
+        bool                  open = false;
+
+        static bool check(detail::waiter* w)
+        {
+            auto* self = static_cast<window_awaiter*>(w);
+
+            uint32_t ev = self->st->handle ? yamux_stream_ready(self->st->handle) : (uint32_t)yamux_poll_hup;
+            self->open = ev & yamux_poll_out;
+
+            return ev & (yamux_poll_out | yamux_poll_hup);
+        }
+
+        bool await_ready() noexcept { return check(this); }
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            handle = h;
+            st->writer = this;
+        }
+        bool await_resume() const noexcept { return open; }
+    };
+    window_awaiter window() noexcept
+    {
+        window_awaiter a;
+        a.poll = window_awaiter::check;
+        a.st   = st;
+        return a;
+    }
+
+private:
+    friend class session;
+
+    explicit stream(detail::stream_state* s) noexcept : st(s) {}
+
+    void release() noexcept
+    {
+        if (!st)
+            return;
+
+        if (st->owner && st->owner->lp)
+        {
+            st->owner->lp->unmark(st);
+            st->owner->lp->untime(st);
+            st->owner->lp->unblock(st);
+        }
+
+        if (st->handle)
+        {
+            st->handle->userdata = nullptr;
+            yamux_stream_free(st->handle);
+        }
+
+        delete st;
+        st = nullptr;
+    }
+
+    detail::stream_state* st = nullptr;
+};
+
+class session
+{
+public:
+    // the socket has to be connected; it's made non-blocking, but isn't
+    // closed by the session
+    session(loop& lp, int sock, yamux_session_type type, yamux_config* config = nullptr)
+        : s(new detail::session_state)
+    {
+        s->lp     = &lp;
+        s->handle = yamux_session_new(config, sock, type, s);
+        if (!s->handle)
+        {
+            delete s;
+            throw std::system_error(EINVAL, std::generic_category(), "yamux_session_new");
+        }
+
+        if (int err = yamux_session_set_nonblocking(s->handle); err < 0)
+        {
+            yamux_session_free(s->handle);
+            delete s;
+            throw std::system_error(-err, std::generic_category(), "yamux_session_set_nonblocking");
+        }
+
+        s->handle->new_stream_fn = on_new_stream;
+        s->handle->notify_fn     = on_notify;
+
+        lp.add(s);
+    }
+    ~session()
+    {
+        s->lp->remove(s);
+
+        // accepted streams nobody picked up
+        while (detail::stream_state* st = s->accept_head)
+        {
+            s->accept_head = st->next_accept;
+            s->lp->unmark(st);
+            delete st;
+        }
+
+        // streams still held by yamux::stream objects outlive the
+        // session's C streams, which yamux_session_free takes down
+        yamux_session* h = s->handle;
+        for (size_t i = 0; i < h->cap_streams; ++i)
+            if (h->streams.streams[i] && h->streams.streams[i]->userdata)
+            {
+                auto* st = static_cast<detail::stream_state*>(h->streams.streams[i]->userdata);
+                s->lp->unmark(st);
+                s->lp->untime(st);
+                s->lp->unblock(st);
+                st->handle = nullptr;
+                st->owner  = nullptr;
+            }
+
+        yamux_session_free(h);
+        delete s;
+    }
+
+    session(const session&) = delete;
+    session& operator=(const session&) = delete;
+
+    yamux_session* get() const noexcept { return s->handle; }
+
+    ssize_t go_away(yamux_error err = yamux_error_normal) noexcept { return yamux_session_close(s->handle, err); }
+
+    // opens a stream, the SYN goes out with its first write
+    stream open()
+    {
+        auto* st  = new detail::stream_state;
+        st->owner = s;
+
+        st->handle = yamux_stream_new(s->handle, 0, st);
+        if (!st->handle)
+        {
+            delete st;
+            return stream();
+        }
+
+        return stream(st);
+    }
+
+    // next stream opened by the peer; empty once the session is gone
+    struct accept_awaiter : detail::waiter
+    {
+        detail::session_state* s;
+
+        static bool check(detail::waiter* w)
+        {
+            auto* self = static_cast<accept_awaiter*>(w);
+            return self->s->accept_head || self->s->dead;
+        }
+
+        bool await_ready() noexcept { return check(this); }
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            handle = h;
+            s->acceptor = this;
+        }
+        stream await_resume() noexcept
+        {
+            detail::stream_state* st = s->accept_head;
+            if (!st)
+                return stream();
+
+            s->accept_head = st->next_accept;
+            if (!s->accept_head)
+                s->accept_tail = nullptr;
+
+            return stream(st);
+        }
+    };
+    accept_awaiter accept() noexcept
+    {
+        accept_awaiter a;
+        a.poll = accept_awaiter::check;
+        a.s    = s;
+        return a;
+    }
+
+private:
+    // allocated only once the C stream exists, nothing to leak if it
+    // couldn't be opened
+    static void on_new_stream(yamux_session* h, yamux_stream* handle)
+    {
+        auto* s  = static_cast<detail::session_state*>(h->userdata);
+        auto* st = new (std::nothrow) detail::stream_state;
+
+        // can't be handed out, freed with the session
+        if (!st)
+        {
+            yamux_stream_reset(handle);
+            return;
+        }
+
+        st->owner  = s;
+        st->handle = handle;
+        handle->userdata = st;
+
+        if (s->accept_tail)
+            s->accept_tail->next_accept = st;
+        else
+            s->accept_head = st;
+        s->accept_tail = st;
+
+        s->lp->mark(s);
+    }
+    static void on_notify(yamux_session* h, yamux_stream* handle)
+    {
+        auto* s = static_cast<detail::session_state*>(h->userdata);
+
+        if (handle->userdata)
+            s->lp->mark(static_cast<detail::stream_state*>(handle->userdata));
+    }
+
+    detail::session_state* s;
+};
+
+} // namespace yamux
+
+#endif
+
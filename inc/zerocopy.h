@@ -0,0 +1,104 @@
+#ifndef YAMUX_ZEROCOPY_H
+#define YAMUX_ZEROCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "atomics.h"
+#include "frame.h"
+
+struct yamux_session;
+
+// MSG_ZEROCOPY sends of large DATA frames (Linux 4.14+), used by
+// yamux_stream_write_zc for frames of at least
+// yamux_config.zerocopy_threshold bytes.
+//
+// The kernel keeps referencing the pages of such a send until it
+// reports the send as completed on the socket's error queue, so the
+// caller's buffer must stay untouched until then, and so must the frame
+// header, which goes out in the same sendmsg to keep the frame in one
+// piece. Headers therefore live in heap records that are freed when the
+// completion comes in.
+//
+// Completions are collected (without blocking) whenever the session
+// reads a frame or a zerocopy write is made, and by
+// yamux_session_reap_zerocopy, e.g. when the socket polls with POLLERR.
+
+// called once the buffer given to yamux_stream_write_zc can be reused.
+// status is 0, or -ECANCELED if the socket was closed before the kernel
+// reported all sends as done.
+typedef void (*yamux_write_done_fn)(void* arg, int status);
+
+// one yamux_stream_write_zc call
+struct yamux_zc_write
+{
+    struct yamux_zc_write* next; // while its callback is due
+
+    yamux_streamid streamid; // whose, for timing the callback
+    yamux_write_done_fn done;
+    void*               arg ;
+
+    uint32_t pending; // frames the kernel hasn't released yet
+    bool     issued ; // all frames were sent, done may run once pending is 0
+};
+
+// one zerocopy sendmsg, header included
+struct yamux_zc_frame
+{
+    struct yamux_zc_frame* next;
+
+    uint32_t               seq  ; // the kernel's counter for this send
+    struct yamux_zc_write* write;
+
+    char header[12];
+};
+
+struct yamux_zerocopy
+{
+    struct yamux_session* session; // the one it's embedded in
+
+    bool enabled; // SO_ZEROCOPY was accepted
+
+    uint32_t next_seq;
+
+    // in send order
+    struct yamux_zc_frame* first;
+    struct yamux_zc_frame* last ;
+
+    // frames in the list, for checking without the mutex
+    YAMUX_ATOMIC(size_t) in_flight;
+
+    size_t sends ;
+    size_t copied; // sends the kernel copied anyway (e.g. over loopback)
+
+    pthread_mutex_t mutex; // sends have to be numbered in order
+};
+
+// enables SO_ZEROCOPY on sock if asked to; stays disabled if it can't be
+void yamux_zerocopy_init   (struct yamux_zerocopy* zc, struct yamux_session* session, int sock,
+        bool enable);
+// waits until the kernel released every send, or until sock was closed
+// or reset (then the rest is cancelled by destroy)
+void yamux_zerocopy_drain  (struct yamux_zerocopy* zc, int sock);
+// cancels whatever is still outstanding
+void yamux_zerocopy_destroy(struct yamux_zerocopy* zc);
+
+// sends header and data in one MSG_ZEROCOPY sendmsg, the header is
+// copied into a record. returns the bytes sent including the header, or
+// -errno; -ENOBUFS means the caller should copy instead. anything less
+// than the whole frame leaves the connection out of step.
+ssize_t yamux_zerocopy_send(struct yamux_zerocopy* zc, int sock, const void* header,
+        const void* data, uint32_t length, struct yamux_zc_write* write);
+
+// marks a write (heap allocated) as fully issued; runs its callback and
+// frees it once nothing is pending anymore
+void yamux_zerocopy_issued(struct yamux_zerocopy* zc, struct yamux_zc_write* write);
+
+// handles completions waiting on sock's error queue, returns how many
+// writes were finished by them
+int yamux_zerocopy_reap(struct yamux_zerocopy* zc, int sock);
+
+#endif
+
@@ -0,0 +1,271 @@
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "yamux.h"
+
+// Ping-pong latency over TCP loopback: one stream, one message in
+// flight, echoed back by the other end. Both ends answer from their
+// read_fn, so every round trip is two wake-ups of a session reader.
+// Runs once with the default config and once with busy_poll and nodelay
+// and prints the round trip percentiles of both.
+//
+// usage: ybench [round trips] [message size] [busy poll us]
+
+struct bench
+{
+    size_t   rounds;
+    uint32_t size  ;
+
+    size_t    done; // only touched by the client's reader while it runs
+    uint64_t* rtt ; // ns
+    struct timespec sent;
+
+    char* msg;
+
+    uint32_t owed; // window to hand back
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  finished;
+    bool            over; // all rounds done, guarded by mutex
+};
+
+static uint64_t ns_since(const struct timespec* t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)((int64_t)(now.tv_sec - t->tv_sec) * 1000000000
+        + (int64_t)(now.tv_nsec - t->tv_nsec));
+}
+
+// like the Go implementation, in chunks of half a window
+static void give_back(struct yamux_stream* stream, uint32_t* owed, uint32_t n)
+{
+    *owed += n;
+    if (*owed >= YAMUX_DEFAULT_WINDOW / 2)
+    {
+        yamux_stream_window_update(stream, (int32_t)*owed);
+        *owed = 0;
+    }
+}
+
+static void on_echo(struct yamux_stream* stream, uint32_t len, void* data)
+{
+    yamux_stream_write(stream, len, data);
+    give_back(stream, (uint32_t*)stream->userdata, len);
+}
+static void* on_new_ud(struct yamux_session* session, yamux_streamid id)
+{
+    (void)session; (void)id;
+    return calloc(1, sizeof(uint32_t));
+}
+static void on_free(struct yamux_stream* stream)
+{
+    free(stream->userdata);
+}
+static void on_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+    stream->read_fn = on_echo;
+    stream->free_fn = on_free;
+}
+
+static void on_pong(struct yamux_stream* stream, uint32_t len, void* data)
+{
+    (void)data;
+    struct bench* b = (struct bench*)stream->userdata;
+
+    b->rtt[b->done++] = ns_since(&b->sent);
+    give_back(stream, &b->owed, len);
+
+    if (b->done < b->rounds)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &b->sent);
+        yamux_stream_write(stream, b->size, b->msg);
+        return;
+    }
+
+    pthread_mutex_lock(&b->mutex);
+    b->over = true;
+    pthread_cond_signal(&b->finished);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+static void* reader(void* arg)
+{
+    struct yamux_session* session = (struct yamux_session*)arg;
+
+    while (yamux_session_read(session) >= 0)
+        ;
+
+    return NULL;
+}
+
+static int connect_pair(int* client, int* server)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = 0;
+
+    int lsock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (lsock < 0)
+        return -errno;
+
+    if (bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) < 0
+            || listen(lsock, 1) < 0
+            || getsockname(lsock, (struct sockaddr*)&addr, &len) < 0)
+        goto FAIL;
+
+    if ((*client = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        goto FAIL;
+    if (connect(*client, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(*client);
+        goto FAIL;
+    }
+    if ((*server = accept(lsock, NULL, NULL)) < 0)
+    {
+        close(*client);
+        goto FAIL;
+    }
+
+    close(lsock);
+    return 0;
+
+FAIL:;
+    int e = errno;
+    close(lsock);
+    return -e;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int run(const char* name, struct yamux_config* cfg, struct bench* b)
+{
+    int cs = -1, ss = -1, e;
+    if ((e = connect_pair(&cs, &ss)) < 0)
+    {
+        printf("connecting over loopback failed with %i\n", -e);
+        return 1;
+    }
+
+    struct yamux_session* client = yamux_session_new(cfg, cs, yamux_session_client, NULL);
+    struct yamux_session* server = yamux_session_new(cfg, ss, yamux_session_server, NULL);
+    if (!client || !server)
+    {
+        printf("yamux_session_new() failed\n");
+        return 1;
+    }
+    server->get_str_ud_fn = on_new_ud;
+    server->new_stream_fn = on_new;
+
+    b->done = 0;
+    b->owed = 0;
+    b->over = false;
+
+    struct yamux_stream* st = yamux_stream_new(client, 0, b);
+    st->read_fn = on_pong;
+
+    pthread_t cr, sr;
+    pthread_create(&cr, NULL, reader, client);
+    pthread_create(&sr, NULL, reader, server);
+
+    pthread_mutex_lock(&b->mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &b->sent);
+    yamux_stream_write(st, b->size, b->msg);
+
+    while (!b->over)
+        pthread_cond_wait(&b->finished, &b->mutex);
+
+    pthread_mutex_unlock(&b->mutex);
+
+    shutdown(cs, SHUT_RDWR);
+    shutdown(ss, SHUT_RDWR);
+    pthread_join(cr, NULL);
+    pthread_join(sr, NULL);
+
+    yamux_session_free(client);
+    yamux_session_free(server);
+    close(cs);
+    close(ss);
+
+    // the first rounds include connection setup and cold caches
+    size_t skip = b->rounds / 100;
+    size_t n = b->rounds - skip;
+    uint64_t* r = b->rtt + skip;
+
+    qsort(r, n, sizeof(uint64_t), cmp_u64);
+
+    printf("%-9s p50 %8.2f us  p99 %8.2f us  p99.9 %8.2f us  max %8.2f us\n", name,
+            (double)r[n / 2] / 1e3,
+            (double)r[n * 99 / 100] / 1e3,
+            (double)r[n * 999 / 1000] / 1e3,
+            (double)r[n - 1] / 1e3);
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t   rounds = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    uint32_t size   = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 64;
+    uint32_t spin   = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 0) : 50;
+
+    if (rounds < 100 || !size || size > YAMUX_DEFAULT_WINDOW / 2)
+    {
+        printf("usage: %s [round trips >= 100] [message size] [busy poll us]\n", argv[0]);
+        return 1;
+    }
+
+    // a session can still be answering when the other end is shut down
+    signal(SIGPIPE, SIG_IGN);
+
+    struct bench b = {
+        .rounds = rounds,
+        .size   = size,
+        .rtt    = (uint64_t*)malloc(rounds * sizeof(uint64_t)),
+        .msg    = (char*)calloc(1, size)
+    };
+    if (!b.rtt || !b.msg)
+        return 1;
+
+    pthread_mutex_init(&b.mutex, NULL);
+    pthread_cond_init(&b.finished, NULL);
+
+    printf("%zu round trips of %u bytes\n", rounds, size);
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        printf("only one CPU online, busy-poll mode won't spin\n");
+
+    struct yamux_config dflt = YAMUX_DEFAULT_CONFIG;
+    struct yamux_config busy = YAMUX_DEFAULT_CONFIG;
+    busy.busy_poll = spin;
+    busy.nodelay   = true;
+
+    int r = run("default"  , &dflt, &b)
+          | run("busy-poll", &busy, &b);
+
+    pthread_cond_destroy(&b.finished);
+    pthread_mutex_destroy(&b.mutex);
+    free(b.rtt);
+    free(b.msg);
+
+    return r;
+}
@@ -0,0 +1,787 @@
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "bridge.h"
+#include "session.h"
+#include "stream.h"
+
+// what the relay thread reads from an fd at once
+#define RELAY_BUF 0x10000
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+#ifdef __linux__
+
+static void* relay_main(void* arg);
+
+// NULL also if the stream never had cold state
+static struct yamux_bridge* get_bridge(struct yamux_stream* stream)
+{
+    struct yamux_stream_cold* c = atomic_load(&stream->cold);
+    return c ? atomic_load(&c->bridge) : NULL;
+}
+
+static void wake(struct yamux_relay* r)
+{
+    eventfd_write(r->wake_fd, 1);
+}
+
+static struct yamux_relay* relay_new(void)
+{
+    struct yamux_relay* r = (struct yamux_relay*)malloc(sizeof(struct yamux_relay));
+    char* buf = (char*)malloc(RELAY_BUF);
+
+    if (!r || !buf)
+    {
+        free(buf);
+        free(r);
+        return NULL;
+    }
+
+    *r = (struct yamux_relay){
+        .first = NULL,
+
+        .wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+        .stop    = false,
+
+        .fds     = NULL,
+        .cap_fds = 0,
+        .buf     = buf
+    };
+
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init (&r->cond , NULL);
+
+    if (r->wake_fd < 0 || pthread_create(&r->thread, NULL, relay_main, r) != 0)
+    {
+        r->stop = true; // no thread to join
+        yamux_relay_free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+// the session's relay, started with its first bridge
+static struct yamux_relay* get_relay(struct yamux_session* session)
+{
+    struct yamux_relay* r = atomic_load(&session->relay);
+    if (r)
+        return r;
+
+    if (!(r = relay_new()))
+        return NULL;
+
+    struct yamux_relay* other = NULL;
+    if (!atomic_compare_exchange_strong(&session->relay, &other, r))
+    {
+        yamux_relay_stop(r);
+        yamux_relay_free(r);
+        return other;
+    }
+
+    return r;
+}
+
+// with the mutex held and the bridge idle. takes it out and closes it.
+static void end(struct yamux_relay* r, struct yamux_bridge* b, int status)
+{
+    struct yamux_bridge** p = &r->first;
+    while (*p != b)
+        p = &(*p)->next;
+    *p = b->next;
+
+    b->closed = true;
+    atomic_store(&atomic_load(&b->stream->cold)->bridge, NULL);
+
+    // a reader waiting for room in the pipe gets EPIPE
+    close(b->pipe[0]);
+    while (b->inbound)
+        pthread_cond_wait(&r->cond, &r->mutex);
+    close(b->pipe[1]);
+
+    // piped data that never made it still counts as committed
+    yamux_session_commit(b->stream->session, -(int64_t)b->held);
+
+    free(b->spill);
+    free(b->out);
+
+    // an aborting close, so the other end sees a reset too
+    if (status < 0)
+    {
+        struct linger l = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(b->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    }
+    else
+        shutdown(b->fd, SHUT_WR);
+
+    close(b->fd);
+}
+
+// pipe -> fd, up to what was piped when the round started
+static size_t drain(struct yamux_bridge* b, size_t piped, int* error)
+{
+    size_t done = 0;
+
+    while (done < piped)
+    {
+        ssize_t n = splice(b->pipe[0], NULL, b->fd, NULL, piped - done, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            break;
+        if (n <= 0)
+        {
+            *error = n < 0 ? -errno : -EPIPE;
+            break;
+        }
+
+        done += (size_t)n;
+    }
+
+    return done;
+}
+
+// with the mutex held: spilled data -> pipe, as far as it fits. only
+// writes to the pipe while the session reader doesn't, which only does
+// while nothing is spilled.
+static void unspill(struct yamux_bridge* b)
+{
+    size_t done = 0;
+
+    while (done < b->spill_len)
+    {
+        ssize_t n = write(b->pipe[1], b->spill + done, b->spill_len - done);
+        if (n <= 0)
+            break;
+
+        done += (size_t)n;
+    }
+
+    memmove(b->spill, b->spill + done, b->spill_len - done);
+    b->spill_len -= done;
+    b->piped     += done;
+}
+
+// with the mutex held
+static int spill(struct yamux_bridge* b, const char* data, size_t length)
+{
+    if (b->spill_len + length > b->spill_cap)
+    {
+        size_t cap = b->spill_cap ? b->spill_cap : RELAY_BUF;
+        while (cap < b->spill_len + length)
+            cap *= 2;
+
+        char* p = (char*)realloc(b->spill, cap);
+        if (!p)
+            return -ENOMEM;
+
+        b->spill     = p;
+        b->spill_cap = cap;
+    }
+
+    memcpy(b->spill + b->spill_len, data, length);
+    b->spill_len += length;
+
+    return 0;
+}
+
+// with the bridge busy: what yamux_stream_write takes of the data read
+// from fd right now. the rest stays in b->out for a later round, when
+// there is window and send_rate lets it through again; the relay never
+// waits for one stream. whether everything went out.
+static bool send_out(struct yamux_bridge* b, const char* data, uint32_t length, int* error)
+{
+    struct yamux_stream* st = b->stream;
+
+    ssize_t res = yamux_stream_write(st, length, (void*)data);
+    if (res == -EAGAIN)
+        res = 0;
+
+    if (res < 0)
+    {
+        // the FIN may have come in meanwhile, its handling ends the bridge
+        if (!(yamux_stream_ready(st) & yamux_poll_hup))
+            *error = (int)res;
+
+        b->out_len = 0;
+        return false;
+    }
+
+    uint32_t left = length - (uint32_t)res;
+
+    if (left && !b->out && !(b->out = (char*)malloc(RELAY_BUF)))
+    {
+        *error = -ENOMEM;
+        return false;
+    }
+
+    memmove(b->out, data + res, left);
+    b->out_len = left;
+
+    return !left;
+}
+
+// fd -> stream, one buffer per round, after what's left of the last one
+static void fill(struct yamux_relay* r, struct yamux_bridge* b, int* error)
+{
+    struct yamux_stream* st = b->stream;
+
+    if (b->out_len && !send_out(b, b->out, b->out_len, error))
+        return;
+
+    // no window, the peer's FIN is in, or send_rate holds it back
+    if (b->local_eof || !(yamux_stream_ready(st) & yamux_poll_out) || yamux_stream_send_delay(st))
+        return;
+
+    // no more than send_rate lets through at once
+    uint32_t max = MIN(yamux_stream_get_window(st), RELAY_BUF);
+    max = MIN(max, yamux_rate_chunk(yamux_stream_send_rate(st)));
+    max = MIN(max, yamux_rate_chunk(&st->session->send_rate));
+
+    ssize_t n = read(b->fd, r->buf, max);
+
+    // other streams may have used up the session's send_rate meanwhile
+    if (n > 0)
+        send_out(b, r->buf, (uint32_t)n, error);
+    else if (!n)
+        b->local_eof = true;
+    else if (errno != EAGAIN && errno != EINTR)
+        *error = -errno;
+}
+
+// called and returns with the mutex held, but drops it to move data.
+// returns whether the bridge is done, and how.
+static bool service(struct yamux_relay* r, struct yamux_bridge* b, int* status)
+{
+    struct yamux_stream* st = b->stream;
+    short events = r->fds[b->pfd].revents;
+    bool  woken  = r->fds[b->pfd + 1].revents & POLLIN;
+
+    size_t piped = b->piped;
+    int    error = b->error;
+
+    b->busy = true;
+    pthread_mutex_unlock(&r->mutex);
+
+    if (woken)
+    {
+        eventfd_t v;
+        eventfd_read(atomic_load(&st->cold)->event_fd, &v);
+    }
+
+    size_t drained = error ? 0 : drain(b, piped, &error);
+
+    if (!error && (b->out_len || (!b->local_eof && (events & (POLLIN | POLLHUP | POLLERR)))))
+        fill(r, b, &error);
+
+    // after what was read before the EOF
+    if (b->local_eof && !b->out_len && !b->fin_sent && !error)
+        b->fin_sent = yamux_stream_close(st) >= 0;
+
+    pthread_mutex_lock(&r->mutex);
+
+    b->busy = false;
+    pthread_cond_broadcast(&r->cond);
+
+    if (error && !b->error)
+        b->error = error;
+
+    // the window goes back as the fd takes the data. decompressed
+    // payloads don't match their window one to one, so all of it goes
+    // once the pipe is empty.
+    b->piped -= drained;
+
+    uint32_t w = b->piped || b->spill_len ? MIN((uint32_t)drained, b->held) : b->held;
+    b->held -= w;
+
+    yamux_session_commit(st->session, -(int64_t)w);
+
+    // room in the pipe now, the next round writes it to fd
+    if (b->spill_len && !error)
+        unspill(b);
+
+    if (b->error)
+    {
+        *status = b->error;
+        return true;
+    }
+
+    // everything before the peer's FIN is out
+    if (b->peer_fin && !b->piped && !b->inbound)
+    {
+        *status = 0;
+        return true;
+    }
+
+    // in chunks of half a window, as recv_rate allows
+    if (w)
+    {
+        pthread_mutex_unlock(&r->mutex);
+        yamux_stream_grant(st, w);
+        pthread_mutex_lock(&r->mutex);
+    }
+
+    return false;
+}
+
+static void* relay_main(void* arg)
+{
+    struct yamux_relay* r = (struct yamux_relay*)arg;
+
+    pthread_mutex_lock(&r->mutex);
+
+    while (!r->stop)
+    {
+        size_t n = 1;
+        for (struct yamux_bridge* b = r->first; b; b = b->next)
+            n += 2;
+
+        if (n > r->cap_fds)
+        {
+            struct pollfd* fds = (struct pollfd*)realloc(r->fds, n * sizeof(struct pollfd));
+            if (!fds)
+                break;
+
+            r->fds     = fds;
+            r->cap_fds = n;
+        }
+
+        n = 0;
+        r->fds[n++] = (struct pollfd){ .fd = r->wake_fd, .events = POLLIN };
+
+        // until the first stream send_rate holds back may send again
+        uint64_t delay = UINT64_MAX;
+
+        // the fd is only read while the stream may send
+        for (struct yamux_bridge* b = r->first; b; b = b->next)
+        {
+            // e.g. what was buffered before the bridge
+            if (b->spill_len && !b->error)
+                unspill(b);
+
+            // data left over from fd goes first, without polling it
+            short events = b->piped ? POLLOUT : 0;
+            if ((b->out_len || !b->local_eof) && (yamux_stream_ready(b->stream) & yamux_poll_out))
+            {
+                uint64_t d = yamux_stream_send_delay(b->stream);
+                if (d)
+                    delay = MIN(delay, d);
+                else if (b->out_len)
+                    delay = 0;
+                else
+                    events |= POLLIN;
+            }
+
+            b->polled = true;
+            b->pfd    = n;
+
+            // -1: not even for POLLHUP, which would come back every round
+            r->fds[n++] = (struct pollfd){ .fd = events ? b->fd : -1, .events = events };
+            r->fds[n++] = (struct pollfd){ .fd = atomic_load(&b->stream->cold)->event_fd, .events = POLLIN };
+        }
+
+        pthread_mutex_unlock(&r->mutex);
+
+        // rounded up to whole milliseconds
+        int timeout = delay == UINT64_MAX ? -1 : delay ? (int)MIN(delay / 1000000 + 1, 1000) : 0;
+        poll(r->fds, n, timeout);
+
+        pthread_mutex_lock(&r->mutex);
+
+        eventfd_t v;
+        eventfd_read(r->wake_fd, &v);
+
+        // bridges added meanwhile wait for the next round
+    RESTART:
+        for (struct yamux_bridge* b = r->first; b; b = b->next)
+        {
+            if (!b->polled)
+                continue;
+            b->polled = false;
+
+            int status;
+            if (!service(r, b, &status))
+                continue;
+
+            struct yamux_stream* st   = b->stream;
+            yamux_bridge_done_fn done = b->done;
+            bool reset = status < 0 && !b->peer_fin;
+
+            // done may free the stream
+            struct yamux_session* session = st->session;
+            yamux_streamid        id      = st->id;
+
+            end(r, b, status);
+            free(b);
+
+            pthread_mutex_unlock(&r->mutex);
+
+            if (reset)
+                yamux_stream_reset(st);
+            if (done)
+            {
+                uint64_t t = yamux_callback_begin(session, yamux_callback_bridge, id);
+                done(st, status);
+                yamux_callback_end(session, yamux_callback_bridge, id, t);
+            }
+
+            pthread_mutex_lock(&r->mutex);
+
+            // the list may have changed meanwhile
+            goto RESTART;
+        }
+    }
+
+    pthread_mutex_unlock(&r->mutex);
+
+    return NULL;
+}
+
+void yamux_relay_stop(struct yamux_relay* r)
+{
+    if (!r)
+        return;
+
+    pthread_mutex_lock(&r->mutex);
+    bool running = !r->stop;
+    r->stop = true;
+    pthread_mutex_unlock(&r->mutex);
+
+    if (running)
+    {
+        wake(r);
+        pthread_join(r->thread, NULL);
+    }
+}
+
+void yamux_relay_free(struct yamux_relay* r)
+{
+    if (!r)
+        return;
+
+    if (r->wake_fd >= 0)
+        close(r->wake_fd);
+
+    pthread_cond_destroy (&r->cond );
+    pthread_mutex_destroy(&r->mutex);
+
+    free(r->fds);
+    free(r->buf);
+    free(r);
+}
+
+int yamux_stream_bridge(struct yamux_stream* stream, int fd, yamux_bridge_done_fn done)
+{
+    if (!stream || fd < 0)
+        return -EINVAL;
+    if (get_bridge(stream))
+        return -EBUSY;
+
+    int efd = yamux_stream_eventfd(stream);
+    if (efd < 0)
+        return efd;
+
+    struct yamux_relay* r = get_relay(stream->session);
+    if (!r)
+        return -ENOMEM;
+
+    struct yamux_bridge* b = (struct yamux_bridge*)malloc(sizeof(struct yamux_bridge));
+    if (!b)
+        return -ENOMEM;
+
+    *b = (struct yamux_bridge){
+        .next   = NULL,
+        .stream = stream,
+        .done   = done,
+
+        .fd = fd,
+
+        .piped = 0,
+        .held  = 0,
+
+        .spill     = NULL,
+        .spill_len = 0,
+        .spill_cap = 0,
+
+        .out     = NULL,
+        .out_len = 0,
+
+        .inbound   = false,
+        .busy      = false,
+        .local_eof = false,
+        .fin_sent  = false,
+        .peer_fin  = false,
+        .error     = 0,
+
+        .closed = false,
+        .polled = false,
+        .pfd    = 0
+    };
+
+    if (pipe2(b->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        int e = errno;
+        free(b);
+        return -e;
+    }
+
+    // a whole window has to fit, as long as it isn't spliced in a page
+    // per packet; the rest is spilled. over pipe-user-pages-soft, new
+    // pipes only get a page.
+    if (fcntl(b->pipe[1], F_SETPIPE_SZ, YAMUX_DEFAULT_WINDOW) < YAMUX_DEFAULT_WINDOW)
+    {
+        close(b->pipe[0]);
+        close(b->pipe[1]);
+        free(b);
+        return -ENOBUFS;
+    }
+
+    // buffered before the bridge: goes to fd before anything else
+    uint32_t pending = atomic_load(&stream->rx_bytes);
+    if (pending)
+    {
+        b->spill = (char*)malloc(pending);
+        if (!b->spill)
+        {
+            close(b->pipe[0]);
+            close(b->pipe[1]);
+            free(b);
+            return -ENOMEM;
+        }
+
+        ssize_t n = yamux_stream_read(stream, pending, b->spill);
+
+        b->spill_len = n > 0 ? (size_t)n : 0;
+        b->spill_cap = pending;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_lock(&r->mutex);
+
+    b->next  = r->first;
+    r->first = b;
+    atomic_store(&atomic_load(&stream->cold)->bridge, b);
+
+    pthread_mutex_unlock(&r->mutex);
+
+    wake(r);
+
+    return 0;
+}
+
+static ssize_t discard(struct yamux_session* session, size_t length)
+{
+    char buf[0x1000];
+
+    while (length)
+    {
+        size_t n = MIN(length, sizeof(buf));
+        if (yamux_session_recv(session, buf, n) != (ssize_t)n)
+            return -1;
+
+        length -= n;
+    }
+
+    return 0;
+}
+
+// takes (the next part of) a payload into the spill buffer, received
+// from the session socket if data is NULL. dropped if the bridge ended.
+static ssize_t spill_recv(struct yamux_relay* r, struct yamux_bridge* b, const char* data, size_t length)
+{
+    char buf[0x4000];
+
+    if (!data)
+    {
+        length = MIN(length, sizeof(buf));
+        if (yamux_session_recv(b->stream->session, buf, length) != (ssize_t)length)
+            return -1;
+    }
+
+    pthread_mutex_lock(&r->mutex);
+
+    int e = b->closed ? 0 : spill(b, data ? data : buf, length);
+    if (e < 0 && !b->error)
+        b->error = e;
+
+    pthread_mutex_unlock(&r->mutex);
+
+    return (ssize_t)length;
+}
+
+ssize_t yamux_bridge_recv(struct yamux_stream* stream, const void* data, uint32_t length, uint32_t used)
+{
+    struct yamux_session* session = stream->session;
+    struct yamux_relay*   r       = atomic_load(&session->relay);
+
+    if (!r)
+        return data ? (ssize_t)length : -ENOENT;
+
+    pthread_mutex_lock(&r->mutex);
+
+    struct yamux_bridge* b = get_bridge(stream);
+    if (!b)
+    {
+        pthread_mutex_unlock(&r->mutex);
+        if (!data)
+            return -ENOENT;
+
+        yamux_session_commit(session, -(int64_t)used);
+        return length;
+    }
+
+    b->inbound = true;
+    b->held   += used;
+
+    // once something is spilled, everything after it is too
+    bool spilling = b->spill_len > 0;
+
+    pthread_mutex_unlock(&r->mutex);
+
+    const char* p   = (const char*)data;
+    size_t      left = length;
+    ssize_t     res  = length;
+
+    while (left)
+    {
+        // the pipe was full: the rest waits in the spill buffer instead
+        // of holding up the session reader
+        if (spilling)
+        {
+            ssize_t n = spill_recv(r, b, p, left);
+            if (n < 0)
+            {
+                res = -1;
+                break;
+            }
+
+            left -= (size_t)n;
+            if (p)
+                p += n;
+            continue;
+        }
+
+        ssize_t n = p ? write(b->pipe[1], p, left)
+                      : splice(session->sock, NULL, b->pipe[1], NULL, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n > 0)
+        {
+            left -= (size_t)n;
+            if (p)
+                p += n;
+
+            pthread_mutex_lock(&r->mutex);
+            b->piped += (size_t)n;
+            pthread_mutex_unlock(&r->mutex);
+
+            wake(r);
+            continue;
+        }
+
+        if (!n)
+        {
+            res = -1; // the peer closed the connection
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN)
+        {
+            spilling = true;
+            continue;
+        }
+
+        // EPIPE: the bridge ended meanwhile, drop the rest
+        if (!p && discard(session, left) < 0)
+            res = -1;
+        break;
+    }
+
+    pthread_mutex_lock(&r->mutex);
+    b->inbound = false;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+
+    wake(r);
+
+    return res;
+}
+
+void yamux_bridge_fin(struct yamux_stream* stream, bool reset)
+{
+    struct yamux_relay* r = atomic_load(&stream->session->relay);
+    if (!r || !get_bridge(stream))
+        return;
+
+    pthread_mutex_lock(&r->mutex);
+
+    struct yamux_bridge* b = get_bridge(stream);
+    if (b)
+    {
+        b->peer_fin = true;
+        if (reset)
+            b->error = -ECONNRESET;
+    }
+
+    pthread_mutex_unlock(&r->mutex);
+
+    wake(r);
+}
+
+void yamux_bridge_detach(struct yamux_stream* stream)
+{
+    struct yamux_relay* r = atomic_load(&stream->session->relay);
+    if (!r || !get_bridge(stream))
+        return;
+
+    pthread_mutex_lock(&r->mutex);
+
+    struct yamux_bridge* b = get_bridge(stream);
+    while (b && b->busy)
+    {
+        pthread_cond_wait(&r->cond, &r->mutex);
+        b = get_bridge(stream);
+    }
+
+    if (b)
+    {
+        end(r, b, -ECANCELED);
+        free(b);
+    }
+
+    pthread_mutex_unlock(&r->mutex);
+}
+
+#else
+
+void yamux_relay_stop(struct yamux_relay* r) { (void)r; }
+void yamux_relay_free(struct yamux_relay* r) { (void)r; }
+
+int yamux_stream_bridge(struct yamux_stream* stream, int fd, yamux_bridge_done_fn done)
+{
+    (void)stream; (void)fd; (void)done;
+    return -ENOTSUP;
+}
+
+ssize_t yamux_bridge_recv(struct yamux_stream* stream, const void* data, uint32_t length, uint32_t used)
+{
+    (void)stream; (void)data; (void)length; (void)used;
+    return -ENOENT;
+}
+
+void yamux_bridge_fin   (struct yamux_stream* stream, bool reset) { (void)stream; (void)reset; }
+void yamux_bridge_detach(struct yamux_stream* stream            ) { (void)stream; }
+
+#endif
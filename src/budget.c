@@ -0,0 +1,40 @@
+
+#include "budget.h"
+
+void yamux_budget_init(struct yamux_budget* budget, size_t limit)
+{
+    budget->limit = limit;
+
+    atomic_init(&budget->committed, 0);
+    atomic_init(&budget->buffered , 0);
+    atomic_init(&budget->peak     , 0);
+}
+
+size_t yamux_budget_headroom(struct yamux_budget* budget)
+{
+    if (!budget || !budget->limit)
+        return SIZE_MAX;
+
+    size_t committed = atomic_load(&budget->committed);
+
+    return committed < budget->limit ? budget->limit - committed : 0;
+}
+
+void yamux_budget_commit(struct yamux_budget* budget, int64_t delta)
+{
+    if (budget)
+        atomic_fetch_add(&budget->committed, (size_t)delta);
+}
+void yamux_budget_buffer(struct yamux_budget* budget, int64_t delta)
+{
+    if (!budget)
+        return;
+
+    size_t now  = atomic_fetch_add(&budget->buffered, (size_t)delta) + (size_t)delta;
+    size_t peak = atomic_load(&budget->peak);
+
+    while (delta > 0 && now > peak &&
+            !atomic_compare_exchange_weak(&budget->peak, &peak, now))
+        ;
+}
+
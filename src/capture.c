@@ -0,0 +1,75 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+struct yamux_capture* yamux_capture_open(const char* path, int type, bool payloads)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return NULL;
+
+    uint8_t header[12];
+    memcpy(header, YAMUX_CAPTURE_MAGIC, 8);
+    header[ 8] = YAMUX_CAPTURE_VERSION;
+    header[ 9] = (uint8_t)type;
+    header[10] = payloads ? YAMUX_CAPTURE_PAYLOADS : 0;
+    header[11] = 0;
+
+    struct yamux_capture* capture = (struct yamux_capture*)malloc(sizeof(struct yamux_capture));
+    if (!capture || fwrite(header, sizeof(header), 1, file) != 1)
+    {
+        free(capture);
+        fclose(file);
+        return NULL;
+    }
+
+    capture->file     = file;
+    capture->payloads = payloads;
+
+    clock_gettime(CLOCK_MONOTONIC, &capture->last);
+
+    return capture;
+}
+void yamux_capture_close(struct yamux_capture* capture)
+{
+    if (!capture)
+        return;
+
+    fclose(capture->file);
+    free(capture);
+}
+
+void yamux_capture_frame(struct yamux_capture* capture, const struct yamux_frame* frame)
+{
+    if (!capture)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t dt = (uint64_t)(now.tv_sec - capture->last.tv_sec) * 1000000000ULL
+        + (uint64_t)now.tv_nsec - (uint64_t)capture->last.tv_nsec;
+    capture->last = now;
+
+    uint8_t varint[10];
+    size_t  n = 0;
+
+    do
+    {
+        varint[n++] = (uint8_t)((dt & 0x7F) | (dt > 0x7F ? 0x80 : 0));
+        dt >>= 7;
+    } while (dt);
+
+    fwrite(varint, n, 1, capture->file);
+    fwrite(frame, sizeof(struct yamux_frame), 1, capture->file);
+}
+void yamux_capture_payload(struct yamux_capture* capture, const void* data, size_t length)
+{
+    if (capture && capture->payloads)
+        fwrite(data, length, 1, capture->file);
+}
+
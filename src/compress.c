@@ -0,0 +1,221 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#ifdef YAMUX_LZ4
+#include <lz4.h>
+#endif
+
+#include "compress.h"
+
+// chunks smaller than this aren't worth the effort
+#define MIN_LENGTH (0x40)
+// most chunks skipped in a row after one that didn't compress
+#define MAX_BACKOFF (0x40)
+
+#ifdef YAMUX_LZ4
+
+struct yamux_compress
+{
+    LZ4_stream_t* tx;
+    bool          tx_synced; // tx's dictionary is tx_hist
+
+    // chunks to send without trying, after poor results
+    uint32_t skip   ;
+    uint32_t backoff;
+
+    uint32_t tx_hlen;
+    uint32_t rx_hlen;
+    char tx_hist[YAMUX_COMPRESS_HISTORY];
+    char rx_hist[YAMUX_COMPRESS_HISTORY];
+};
+
+// keeps the last YAMUX_COMPRESS_HISTORY bytes of everything appended
+static void hist_append(char* hist, uint32_t* hlen, const char* src, uint32_t length)
+{
+    if (length >= YAMUX_COMPRESS_HISTORY)
+    {
+        memcpy(hist, src + length - YAMUX_COMPRESS_HISTORY, YAMUX_COMPRESS_HISTORY);
+        *hlen = YAMUX_COMPRESS_HISTORY;
+        return;
+    }
+
+    if (*hlen + length > YAMUX_COMPRESS_HISTORY)
+    {
+        uint32_t keep = YAMUX_COMPRESS_HISTORY - length;
+        memmove(hist, hist + *hlen - keep, keep);
+        *hlen = keep;
+    }
+
+    memcpy(hist + *hlen, src, length);
+    *hlen += length;
+}
+
+bool yamux_compress_available(void)
+{
+    return true;
+}
+
+struct yamux_compress* yamux_compress_new(void)
+{
+    struct yamux_compress* c = (struct yamux_compress*)malloc(sizeof(struct yamux_compress));
+    if (!c)
+        return NULL;
+
+    if (!(c->tx = LZ4_createStream()))
+    {
+        free(c);
+        return NULL;
+    }
+
+    c->tx_synced = false;
+    c->skip      = 0;
+    c->backoff   = 1;
+    c->tx_hlen   = 0;
+    c->rx_hlen   = 0;
+
+    return c;
+}
+void yamux_compress_free(struct yamux_compress* c)
+{
+    if (!c)
+        return;
+
+    LZ4_freeStream(c->tx);
+    free(c);
+}
+
+uint32_t yamux_compress_bound(uint32_t length)
+{
+    return sizeof(uint32_t) + (uint32_t)LZ4_compressBound((int)length);
+}
+
+static uint32_t send_raw(struct yamux_compress* c, const char* src, uint32_t length)
+{
+    hist_append(c->tx_hist, &c->tx_hlen, src, length);
+    c->tx_synced = false;
+
+    return 0;
+}
+
+uint32_t yamux_compress_frame(struct yamux_compress* c, const char* src, uint32_t length, char* dst)
+{
+    if (length < MIN_LENGTH || length > YAMUX_COMPRESS_CHUNK)
+        return send_raw(c, src, length);
+
+    if (c->skip)
+    {
+        c->skip--;
+        return send_raw(c, src, length);
+    }
+
+    if (!c->tx_synced)
+        LZ4_loadDict(c->tx, c->tx_hist, (int)c->tx_hlen);
+
+    // anything that doesn't save at least an eighth is sent as is
+    int cap = (int)(length - length / 8 - sizeof(uint32_t));
+    int r   = LZ4_compress_fast_continue(c->tx, src, dst + sizeof(uint32_t),
+            (int)length, cap, 1);
+
+    if (r <= 0)
+    {
+        // incompressible, back off exponentially before trying again.
+        // a failed call leaves the LZ4 stream unusable until reloaded.
+        c->skip    = c->backoff;
+        c->backoff = c->backoff < MAX_BACKOFF ? c->backoff * 2 : MAX_BACKOFF;
+
+        return send_raw(c, src, length);
+    }
+
+    c->backoff   = 1;
+    c->tx_hlen   = (uint32_t)LZ4_saveDict(c->tx, c->tx_hist, YAMUX_COMPRESS_HISTORY);
+    c->tx_synced = true;
+
+    uint32_t plain = htonl(length);
+    memcpy(dst, &plain, sizeof(uint32_t));
+
+    return sizeof(uint32_t) + (uint32_t)r;
+}
+
+ssize_t yamux_compress_length(const char* src, uint32_t length)
+{
+    uint32_t plain;
+
+    if (length < sizeof(uint32_t))
+        return -EPROTO;
+
+    memcpy(&plain, src, sizeof(uint32_t));
+    plain = ntohl(plain);
+
+    if (plain > YAMUX_COMPRESS_CHUNK)
+        return -EPROTO;
+
+    return plain;
+}
+
+ssize_t yamux_decompress_frame(struct yamux_compress* c, const char* src, uint32_t length, char* dst)
+{
+    ssize_t plain = yamux_compress_length(src, length);
+    if (plain < 0)
+        return plain;
+
+    int r = LZ4_decompress_safe_usingDict(src + sizeof(uint32_t), dst,
+            (int)(length - sizeof(uint32_t)), (int)plain,
+            c->rx_hist, (int)c->rx_hlen);
+    if (r != plain)
+        return -EPROTO;
+
+    hist_append(c->rx_hist, &c->rx_hlen, dst, (uint32_t)plain);
+
+    return plain;
+}
+void yamux_decompress_raw(struct yamux_compress* c, const char* src, uint32_t length)
+{
+    hist_append(c->rx_hist, &c->rx_hlen, src, length);
+}
+
+#else
+
+bool yamux_compress_available(void)
+{
+    return false;
+}
+
+struct yamux_compress* yamux_compress_new(void)
+{
+    return NULL;
+}
+void yamux_compress_free(struct yamux_compress* c)
+{
+    (void)c;
+}
+
+uint32_t yamux_compress_bound(uint32_t length)
+{
+    return length;
+}
+uint32_t yamux_compress_frame(struct yamux_compress* c, const char* src, uint32_t length, char* dst)
+{
+    (void)c; (void)src; (void)length; (void)dst;
+    return 0;
+}
+
+ssize_t yamux_compress_length(const char* src, uint32_t length)
+{
+    (void)src; (void)length;
+    return -ENOTSUP;
+}
+ssize_t yamux_decompress_frame(struct yamux_compress* c, const char* src, uint32_t length, char* dst)
+{
+    (void)c; (void)src; (void)length; (void)dst;
+    return -ENOTSUP;
+}
+void yamux_decompress_raw(struct yamux_compress* c, const char* src, uint32_t length)
+{
+    (void)c; (void)src; (void)length;
+}
+
+#endif
+
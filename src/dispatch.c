@@ -0,0 +1,309 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dispatch.h"
+#include "session.h"
+#include "stream.h"
+
+// the strand whose callback this worker is running, if any
+static _Thread_local struct yamux_strand* current;
+
+static void* worker(void* arg);
+
+struct yamux_dispatch* yamux_dispatch_new(size_t threads, size_t max_queued)
+{
+    if (!threads)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (size_t)n : 1;
+    }
+
+    struct yamux_dispatch* d = (struct yamux_dispatch*)malloc(sizeof(struct yamux_dispatch));
+    pthread_t* tids = (pthread_t*)calloc(threads, sizeof(pthread_t));
+
+    if (!d || !tids)
+    {
+        free(tids);
+        free(d);
+        return NULL;
+    }
+
+    *d = (struct yamux_dispatch){
+        .num_threads = 0,
+        .threads     = tids,
+
+        .max_queued = max_queued,
+        .queued     = 0,
+
+        .first = NULL,
+        .last  = NULL,
+
+        .stop = false
+    };
+
+    pthread_mutex_init(&d->mutex, NULL);
+    pthread_cond_init (&d->work , NULL);
+    pthread_cond_init (&d->room , NULL);
+    pthread_cond_init (&d->done , NULL);
+
+    for (; d->num_threads < threads; d->num_threads++)
+        if (pthread_create(&tids[d->num_threads], NULL, worker, d) != 0)
+            break;
+
+    if (!d->num_threads)
+    {
+        yamux_dispatch_free(d);
+        return NULL;
+    }
+
+    return d;
+}
+void yamux_dispatch_free(struct yamux_dispatch* d)
+{
+    if (!d)
+        return;
+
+    pthread_mutex_lock(&d->mutex);
+    d->stop = true;
+    pthread_cond_broadcast(&d->work);
+    pthread_cond_broadcast(&d->room);
+    pthread_mutex_unlock(&d->mutex);
+
+    for (size_t i = 0; i < d->num_threads; ++i)
+        pthread_join(d->threads[i], NULL);
+
+    pthread_cond_destroy (&d->done );
+    pthread_cond_destroy (&d->room );
+    pthread_cond_destroy (&d->work );
+    pthread_mutex_destroy(&d->mutex);
+
+    free(d->threads);
+    free(d);
+}
+
+static size_t job_cost(struct yamux_dispatch_job* job)
+{
+    return sizeof(struct yamux_dispatch_job) + (job->chunk ? job->chunk->length : 0);
+}
+
+// with the mutex held
+static void schedule(struct yamux_dispatch* d, struct yamux_strand* s)
+{
+    if (s->queued || s->running || !s->first)
+        return;
+
+    s->queued = true;
+    s->next   = NULL;
+
+    if (d->last)
+        d->last->next = s;
+    else
+        d->first = s;
+    d->last = s;
+
+    pthread_cond_signal(&d->work);
+}
+
+static void* worker(void* arg)
+{
+    struct yamux_dispatch* d = (struct yamux_dispatch*)arg;
+
+    pthread_mutex_lock(&d->mutex);
+
+    for (;;)
+    {
+        while (!d->first && !d->stop)
+            pthread_cond_wait(&d->work, &d->mutex);
+
+        // keeps going until the queues are drained
+        struct yamux_strand* s = d->first;
+        if (!s)
+            break;
+
+        d->first = s->next;
+        if (!d->first)
+            d->last = NULL;
+
+        // one job per turn, so a busy stream doesn't starve the others
+        struct yamux_dispatch_job* job = s->first;
+        s->first = job->next;
+        if (!s->first)
+            s->last = NULL;
+
+        s->queued  = false;
+        s->running = true;
+
+        pthread_mutex_unlock(&d->mutex);
+
+        size_t cost = job_cost(job);
+
+        current = s;
+        yamux_stream_dispatch(s->stream, job->event, job->chunk, job->used);
+        current = NULL;
+
+        free(job);
+
+        pthread_mutex_lock(&d->mutex);
+
+        d->queued -= cost;
+        pthread_cond_broadcast(&d->room);
+
+        s->running = false;
+
+        // the stream was freed by its own callback
+        if (!s->stream)
+            free(s);
+        else
+            schedule(d, s);
+
+        pthread_cond_broadcast(&d->done);
+    }
+
+    pthread_mutex_unlock(&d->mutex);
+
+    return NULL;
+}
+
+static ssize_t enqueue(struct yamux_stream* stream, enum yamux_dispatch_event event,
+        struct yamux_rx_chunk* chunk, uint32_t used)
+{
+    struct yamux_dispatch* d = stream->session->config->dispatch;
+
+    struct yamux_dispatch_job* job = (struct yamux_dispatch_job*)malloc(sizeof(struct yamux_dispatch_job));
+    if (!job)
+        return -ENOMEM;
+
+    *job = (struct yamux_dispatch_job){
+        .next  = NULL,
+        .event = event,
+        .used  = used,
+        .chunk = chunk
+    };
+
+    pthread_mutex_lock(&d->mutex);
+
+    struct yamux_strand* s = stream->strand;
+    if (!s)
+    {
+        s = (struct yamux_strand*)malloc(sizeof(struct yamux_strand));
+        if (!s)
+        {
+            pthread_mutex_unlock(&d->mutex);
+            free(job);
+            return -ENOMEM;
+        }
+
+        *s = (struct yamux_strand){
+            .stream = stream,
+            .first  = NULL,
+            .last   = NULL,
+            .next   = NULL,
+
+            .queued  = false,
+            .running = false
+        };
+
+        stream->strand = s;
+    }
+
+    if (s->last)
+        s->last->next = job;
+    else
+        s->first = job;
+    s->last = job;
+
+    d->queued += job_cost(job);
+
+    schedule(d, s);
+
+    // the job is in, so a single large one can't wedge the reader
+    while (d->max_queued && d->queued > d->max_queued && !d->stop)
+        pthread_cond_wait(&d->room, &d->mutex);
+
+    pthread_mutex_unlock(&d->mutex);
+
+    return 0;
+}
+
+void yamux_dispatch_event(struct yamux_stream* stream, enum yamux_dispatch_event event)
+{
+    if (!stream->session->config->dispatch || enqueue(stream, event, NULL, 0) < 0)
+        yamux_stream_dispatch(stream, event, NULL, 0);
+}
+ssize_t yamux_dispatch_data(struct yamux_stream* stream, struct yamux_rx_chunk* chunk, uint32_t used)
+{
+    return enqueue(stream, yamux_dispatch_on_data, chunk, used);
+}
+
+ssize_t yamux_dispatch_release(struct yamux_stream* stream)
+{
+    return enqueue(stream, yamux_dispatch_on_release, NULL, 0);
+}
+
+uint32_t yamux_dispatch_detach(struct yamux_stream* stream)
+{
+    struct yamux_dispatch* d = stream->session->config->dispatch;
+    if (!d)
+        return 0;
+
+    // the strand is set by enqueue, under the mutex
+    pthread_mutex_lock(&d->mutex);
+
+    struct yamux_strand* s = stream->strand;
+    if (!s)
+    {
+        pthread_mutex_unlock(&d->mutex);
+        return 0;
+    }
+
+    uint32_t used = 0;
+
+    for (struct yamux_dispatch_job *job = s->first, *next; job; job = next)
+    {
+        next = job->next;
+
+        d->queued -= job_cost(job);
+        used += job->used;
+
+        free(job->chunk);
+        free(job);
+    }
+
+    s->first = s->last = NULL;
+    pthread_cond_broadcast(&d->room);
+
+    if (s->queued)
+    {
+        struct yamux_strand** p = &d->first;
+        while (*p != s)
+            p = &(*p)->next;
+
+        *p = s->next;
+        if (d->last == s)
+        {
+            d->last = NULL;
+            for (struct yamux_strand* t = d->first; t; t = t->next)
+                d->last = t;
+        }
+
+        s->queued = false;
+    }
+
+    if (current == s)
+        s->stream = NULL; // the worker frees it after the callback
+    else
+    {
+        while (s->running)
+            pthread_cond_wait(&d->done, &d->mutex);
+
+        free(s);
+    }
+
+    stream->strand = NULL;
+
+    pthread_mutex_unlock(&d->mutex);
+
+    return used;
+}
@@ -0,0 +1,77 @@
+
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "event.h"
+
+void yamux_event_init(struct yamux_event* ev)
+{
+    atomic_init(&ev->seq    , 0);
+    atomic_init(&ev->waiters, 0);
+}
+
+uint32_t yamux_event_prepare(struct yamux_event* ev)
+{
+    // the waiter count has to be visible before the caller checks its
+    // condition again, or a notify in between would be missed
+    atomic_fetch_add(&ev->waiters, 1);
+    return atomic_load(&ev->seq);
+}
+void yamux_event_cancel(struct yamux_event* ev)
+{
+    atomic_fetch_sub(&ev->waiters, 1);
+}
+
+int yamux_event_wait(struct yamux_event* ev, uint32_t key, const struct timespec* timeout)
+{
+    int r = 0;
+
+#ifdef __linux__
+    if (atomic_load(&ev->seq) == key &&
+            syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, key, timeout, NULL, 0) < 0
+            && errno == ETIMEDOUT)
+        r = -ETIMEDOUT;
+#else
+    // no futex, poll the sequence number instead
+    struct timespec step = { .tv_sec = 0, .tv_nsec = 50000 };
+    long long left = timeout
+        ? (long long)timeout->tv_sec * 1000000000LL + timeout->tv_nsec
+        : -1;
+
+    while (atomic_load(&ev->seq) == key)
+    {
+        if (left == 0)
+        {
+            r = -ETIMEDOUT;
+            break;
+        }
+
+        nanosleep(&step, NULL);
+
+        if (left > 0)
+            left = (left > step.tv_nsec) ? left - step.tv_nsec : 0;
+    }
+#endif
+
+    atomic_fetch_sub(&ev->waiters, 1);
+    return r;
+}
+
+void yamux_event_notify(struct yamux_event* ev)
+{
+    if (!atomic_load(&ev->waiters))
+        return;
+
+    atomic_fetch_add(&ev->seq, 1);
+
+#ifdef __linux__
+    syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
@@ -0,0 +1,263 @@
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "latency.h"
+#include "session.h"
+
+#define NSEC 1000000000ull
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * NSEC + (uint64_t)t.tv_nsec;
+}
+
+static unsigned bucket(uint64_t ns)
+{
+    unsigned b = 0;
+    while (ns >>= 1)
+        b++;
+
+    return b < YAMUX_LATENCY_BUCKETS ? b : YAMUX_LATENCY_BUCKETS - 1;
+}
+
+void yamux_latency_init(struct yamux_latency* latency)
+{
+    for (size_t t = 0; t < yamux_callback_count; ++t)
+    {
+        for (size_t b = 0; b < YAMUX_LATENCY_BUCKETS; ++b)
+            atomic_init(&latency->buckets[t][b], 0);
+
+        atomic_init(&latency->max[t], 0);
+    }
+}
+
+uint64_t yamux_latency_count(struct yamux_latency* latency, enum yamux_callback type)
+{
+    uint64_t n = 0;
+
+    for (size_t b = 0; b < YAMUX_LATENCY_BUCKETS; ++b)
+        n += atomic_load(&latency->buckets[type][b]);
+
+    return n;
+}
+
+uint64_t yamux_latency_percentile(struct yamux_latency* latency, enum yamux_callback type, double fraction)
+{
+    uint64_t total = yamux_latency_count(latency, type);
+    if (!total)
+        return 0;
+
+    // calls that have to be covered, at least one
+    uint64_t want = (uint64_t)(fraction * (double)total + 0.5);
+    if (!want)
+        want = 1;
+
+    uint64_t seen = 0;
+
+    for (size_t b = 0; b < YAMUX_LATENCY_BUCKETS - 1; ++b)
+        if ((seen += atomic_load(&latency->buckets[type][b])) >= want)
+            return 2ull << b;
+
+    // the last bucket has no upper bound
+    return atomic_load(&latency->max[type]);
+}
+
+static uint64_t threshold_ns(struct yamux_session* session)
+{
+    return (uint64_t)session->config->stall_threshold * 1000u;
+}
+
+// reports what has been running for too long, once
+static void look(struct yamux_watchdog* w, uint64_t threshold)
+{
+    struct yamux_session* session = w->session;
+    uint64_t now = now_ns();
+
+    for (size_t i = 0; i < YAMUX_WATCHED; ++i)
+    {
+        struct yamux_running* r = &w->running[i];
+
+        uint64_t b = atomic_load(&r->begin);
+        if (!b || (b & 1) || now - b < threshold)
+            continue;
+
+        enum yamux_callback type     = (enum yamux_callback)atomic_load(&r->type);
+        yamux_streamid      streamid = atomic_load(&r->streamid);
+
+        // the same call still, type and streamid were set before begin
+        if (!atomic_compare_exchange_strong(&r->begin, &b, b | 1))
+            continue;
+
+        if (session->stall_fn)
+            session->stall_fn(session, streamid, type, now - b);
+    }
+}
+
+static void* watchdog_main(void* arg)
+{
+    struct yamux_watchdog* w = (struct yamux_watchdog*)arg;
+
+    uint64_t threshold = threshold_ns(w->session);
+    uint64_t interval  = threshold / 2 ? threshold / 2 : 1;
+
+    pthread_mutex_lock(&w->mutex);
+
+    while (!w->stop)
+    {
+        uint64_t due = now_ns() + interval;
+        struct timespec ts = {
+            .tv_sec  = (time_t)(due / NSEC),
+            .tv_nsec = (long  )(due % NSEC)
+        };
+        pthread_cond_timedwait(&w->cond, &w->mutex, &ts);
+
+        if (!w->stop)
+            look(w, threshold);
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+struct yamux_watchdog* yamux_watchdog_new(struct yamux_session* session)
+{
+    struct yamux_watchdog* w = (struct yamux_watchdog*)malloc(sizeof(struct yamux_watchdog));
+    if (!w)
+        return NULL;
+
+    w->session = session;
+    w->stop    = false;
+
+    for (size_t i = 0; i < YAMUX_WATCHED; ++i)
+    {
+        atomic_init(&w->running[i].used    , false);
+        atomic_init(&w->running[i].begin   , 0);
+        atomic_init(&w->running[i].type    , 0);
+        atomic_init(&w->running[i].streamid, 0);
+    }
+
+    // deadlines are monotonic
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init (&w->cond , &attr);
+
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&w->thread, NULL, watchdog_main, w) != 0)
+    {
+        w->stop = true; // no thread to join
+        yamux_watchdog_free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+void yamux_watchdog_free(struct yamux_watchdog* w)
+{
+    if (!w)
+        return;
+
+    pthread_mutex_lock(&w->mutex);
+    bool running = !w->stop;
+    w->stop = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+
+    if (running)
+        pthread_join(w->thread, NULL);
+
+    pthread_cond_destroy (&w->cond );
+    pthread_mutex_destroy(&w->mutex);
+
+    free(w);
+}
+
+// a free slot for the call, or none if too many are running
+static void watch(struct yamux_watchdog* w, enum yamux_callback type,
+        yamux_streamid streamid, uint64_t begin)
+{
+    for (size_t i = 0; i < YAMUX_WATCHED; ++i)
+    {
+        struct yamux_running* r = &w->running[i];
+
+        bool used = false;
+        if (atomic_load(&r->used) || !atomic_compare_exchange_strong(&r->used, &used, true))
+            continue;
+
+        atomic_store(&r->type    , (uint32_t)type);
+        atomic_store(&r->streamid, streamid);
+        atomic_store(&r->begin   , begin);
+        return;
+    }
+}
+
+// frees the call's slot, whether the watchdog reported it
+static bool unwatch(struct yamux_watchdog* w, enum yamux_callback type,
+        yamux_streamid streamid, uint64_t begin)
+{
+    for (size_t i = 0; i < YAMUX_WATCHED; ++i)
+    {
+        struct yamux_running* r = &w->running[i];
+
+        uint64_t b = atomic_load(&r->begin);
+        if ((b & ~1ull) != begin || atomic_load(&r->type) != (uint32_t)type ||
+                atomic_load(&r->streamid) != streamid)
+            continue;
+
+        // the watchdog sets the lowest bit when it reports
+        b = begin;
+        bool reported = !atomic_compare_exchange_strong(&r->begin, &b, 0);
+        atomic_store(&r->begin, 0);
+        atomic_store(&r->used , false);
+
+        return reported;
+    }
+
+    return false;
+}
+
+uint64_t yamux_callback_begin(struct yamux_session* session, enum yamux_callback type,
+        yamux_streamid streamid)
+{
+    if (!session->config->callback_timing && !session->config->stall_threshold)
+        return 0;
+
+    // even, the watchdog marks reported calls with the lowest bit
+    uint64_t begin = now_ns() & ~1ull;
+
+    if (session->watchdog)
+        watch(session->watchdog, type, streamid, begin);
+
+    return begin;
+}
+
+void yamux_callback_end(struct yamux_session* session, enum yamux_callback type,
+        yamux_streamid streamid, uint64_t begin)
+{
+    if (!begin)
+        return;
+
+    uint64_t d = now_ns() - begin;
+    struct yamux_latency* l = &session->latency;
+
+    atomic_fetch_add(&l->buckets[type][bucket(d)], 1);
+
+    uint64_t max = atomic_load(&l->max[type]);
+    while (d > max && !atomic_compare_exchange_weak(&l->max[type], &max, d));
+
+    bool reported = session->watchdog && unwatch(session->watchdog, type, streamid, begin);
+
+    uint64_t threshold = threshold_ns(session);
+
+    if (threshold && d >= threshold && !reported && session->stall_fn)
+        session->stall_fn(session, streamid, type, d);
+}
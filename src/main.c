@@ -4,9 +4,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <errno.h>
+#include <time.h>
 
 #include "yamux.h"
 
@@ -50,8 +55,1348 @@ static ssize_t init(int sock)
 #endif
 }
 
+// Behavioural tests, run with `bin/ytest test [name...]` (make test).
+// Each one connects sessions over a socketpair, reads both on their own
+// threads, and checks what the callbacks saw.
+
+static int failures;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            printf("  %s:%d: %s\n", __func__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// where test_capture records, replayed by make test afterwards
+static const char* capture_path = "bin/test.cap";
+
+// polls for up to 5s until *value is at least want
+static bool wait_for(atomic_int* value, int want)
+{
+    for (int i = 0; i < 5000 && atomic_load(value) < want; ++i)
+        usleep(1000);
+
+    return atomic_load(value) >= want;
+}
+
+static void* read_loop(void* arg)
+{
+    while (yamux_session_read((struct yamux_session*)arg) >= 0)
+        ;
+
+    return NULL;
+}
+
+// two sessions over a socketpair
+struct pair
+{
+    int sv[2];
+
+    struct yamux_session* client;
+    struct yamux_session* server;
+
+    pthread_t readers[2];
+};
+
+// sessions on both ends of p->sv
+static bool pair_sessions(struct pair* p, struct yamux_config* client, struct yamux_config* server)
+{
+    p->client = yamux_session_new(client, p->sv[0], yamux_session_client, NULL);
+    p->server = yamux_session_new(server, p->sv[1], yamux_session_server, NULL);
+
+    return p->client && p->server;
+}
+
+// NULL configs are the default one. the readers start with pair_start,
+// once the callbacks are set.
+static bool pair_open(struct pair* p, struct yamux_config* client, struct yamux_config* server)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, p->sv) < 0)
+        return false;
+
+    return pair_sessions(p, client, server);
+}
+
+// the same over a loopback TCP connection
+static bool pair_open_tcp(struct pair* p, struct yamux_config* client, struct yamux_config* server)
+{
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(sa);
+
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+    if (lsock < 0)
+        return false;
+
+    p->sv[0] = -1;
+    p->sv[1] = -1;
+
+    if (bind(lsock, (struct sockaddr*)&sa, len) == 0 && listen(lsock, 1) == 0 &&
+            getsockname(lsock, (struct sockaddr*)&sa, &len) == 0 &&
+            (p->sv[0] = socket(AF_INET, SOCK_STREAM, 0)) >= 0 &&
+            connect(p->sv[0], (struct sockaddr*)&sa, len) == 0)
+        p->sv[1] = accept(lsock, NULL, NULL);
+
+    close(lsock);
+
+    return p->sv[1] >= 0 && pair_sessions(p, client, server);
+}
+
+static void pair_start(struct pair* p)
+{
+    pthread_create(&p->readers[0], NULL, read_loop, p->client);
+    pthread_create(&p->readers[1], NULL, read_loop, p->server);
+}
+
+static void pair_close(struct pair* p)
+{
+    shutdown(p->sv[0], SHUT_RDWR);
+    shutdown(p->sv[1], SHUT_RDWR);
+
+    pthread_join(p->readers[0], NULL);
+    pthread_join(p->readers[1], NULL);
+
+    yamux_session_free(p->client);
+    yamux_session_free(p->server);
+
+    close(p->sv[0]);
+    close(p->sv[1]);
+}
+
+// writes everything, waiting for window
+static bool write_all(struct yamux_stream* stream, uint32_t length, char* data)
+{
+    for (uint32_t done = 0; done < length; )
+    {
+        ssize_t res = yamux_stream_write(stream, length - done, data + done);
+        if (res == -EAGAIN)
+            res = 0;
+        if (res < 0)
+            return false;
+
+        done += (uint32_t)res;
+
+        if (done < length && yamux_stream_wait_for_window(stream) < 0)
+            return false;
+    }
+
+    return true;
+}
+
+// bytes received by count_read, the stream's window handed back
+static atomic_int received;
+
+static void count_read(struct yamux_stream* stream, uint32_t data_len, void* data)
+{
+    (void)data;
+
+    atomic_fetch_add(&received, (int)data_len);
+    yamux_stream_grant(stream, stream->rx_wire);
+}
+static void count_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+    stream->read_fn = count_read;
+}
+
+// the sockets pool_connect handed to the pool, and their peers
+static int pool_socks[2][8];
+static int pool_connects;
+
+static int pool_connect(struct yamux_pool* pool)
+{
+    (void)pool;
+
+    int sv[2];
+    if (pool_connects == 8 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return -1;
+
+    pool_socks[0][pool_connects] = sv[0];
+    pool_socks[1][pool_connects] = sv[1];
+    pool_connects++;
+
+    return sv[0];
+}
+
+// streams go to the least loaded session, and a closed one is replaced
+// by a fresh connection (nothing is read, opening sends nothing yet)
+static void test_pool(void)
+{
+    pool_connects = 0;
+
+    struct yamux_pool* pool = yamux_pool_new(NULL, 2, pool_connect, NULL);
+    CHECK(pool);
+
+    for (int i = 0; i < 4; ++i)
+        CHECK(yamux_pool_stream_new(pool, NULL));
+
+    CHECK(pool_connects == 2);
+    CHECK(pool->sessions[0]->num_streams == 2);
+    CHECK(pool->sessions[1]->num_streams == 2);
+
+    // the next stream goes where one was freed
+    struct yamux_session* first = pool->sessions[0];
+    yamux_stream_free(first->streams.streams[0]);
+
+    struct yamux_stream* st = yamux_pool_stream_new(pool, NULL);
+    CHECK(st && st->session == first);
+
+    // kept until reaped, since a reader could still be in it
+    yamux_session_close(first, yamux_error_normal);
+
+    st = yamux_pool_stream_new(pool, NULL);
+    CHECK(st && st->session != first && st->session->num_streams == 1);
+    CHECK(pool_connects == 3);
+    CHECK(pool->num_retired == 1 && pool->retired[0] == first);
+
+    yamux_pool_free(pool);
+
+    for (int i = 0; i < pool_connects; ++i)
+    {
+        close(pool_socks[0][i]);
+        close(pool_socks[1][i]);
+    }
+}
+
+struct writer
+{
+    struct yamux_stream* stream;
+    uint32_t             length;
+    char*                data;
+    bool                 ok;
+};
+
+static void* write_thread(void* arg)
+{
+    struct writer* w = (struct writer*)arg;
+    w->ok = write_all(w->stream, w->length, w->data);
+
+    return NULL;
+}
+
+// threads writing to one stream share its window without a lock: every
+// byte arrives, and once it settles the window lacks exactly what the
+// peer still owes
+static void test_window(void)
+{
+    enum { writers = 4, each = 2 * YAMUX_DEFAULT_WINDOW };
+
+    struct pair p;
+    CHECK(pair_open(&p, NULL, NULL));
+
+    p.server->new_stream_fn = count_new;
+
+    atomic_store(&received, 0);
+    pair_start(&p);
+
+    char* data = (char*)calloc(1, each);
+    struct yamux_stream* st = yamux_stream_new(p.client, 0, NULL);
+
+    pthread_t     threads[writers];
+    struct writer w[writers];
+
+    for (int i = 0; i < writers; ++i)
+    {
+        w[i] = (struct writer){ .stream = st, .length = each, .data = data, .ok = false };
+        pthread_create(&threads[i], NULL, write_thread, &w[i]);
+    }
+    for (int i = 0; i < writers; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        CHECK(w[i].ok);
+    }
+
+    CHECK(wait_for(&received, writers * each));
+
+    struct yamux_stream* peer = p.server->streams.streams[0];
+    bool settled = false;
+
+    for (int i = 0; i < 5000 && !settled; ++i)
+    {
+        settled = yamux_stream_get_window(st) + atomic_load(&peer->owed) == YAMUX_DEFAULT_WINDOW;
+        if (!settled)
+            usleep(1000);
+    }
+
+    CHECK(settled);
+    CHECK(atomic_load(&p.client->stalled_streams) == 0);
+
+    pair_close(&p);
+    free(data);
+}
+
+// the last stream the peer opened, for tests that read it themselves
+static struct yamux_stream* _Atomic accepted;
+
+static void accept_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+    atomic_store(&accepted, stream);
+}
+
+// waits for up to 5s for a stream from the peer
+static struct yamux_stream* wait_accepted(void)
+{
+    for (int i = 0; i < 5000 && !atomic_load(&accepted); ++i)
+        usleep(1000);
+
+    return atomic_load(&accepted);
+}
+
+// buffered data, window and the peer's FIN show up in yamux_poll, and
+// new data signals the stream's eventfd
+static void test_poll(void)
+{
+    struct pair p;
+    CHECK(pair_open(&p, NULL, NULL));
+
+    p.server->new_stream_fn = accept_new;
+
+    atomic_store(&accepted, NULL);
+    pair_start(&p);
+
+    struct yamux_stream* st = yamux_stream_new(p.client, 0, NULL);
+    CHECK(yamux_stream_write(st, 4, "ping") == 4);
+
+    struct yamux_stream* peer = wait_accepted();
+    CHECK(peer);
+
+    struct yamux_stream* streams[2] = { peer, st };
+    uint32_t events[2] = { yamux_poll_in, yamux_poll_out }, revents[2];
+
+    // the stream is announced before its first payload is buffered
+    CHECK(yamux_poll(streams, events, revents, 1, 1000) == 1);
+    CHECK(yamux_poll(streams, events, revents, 2, 0) == 2);
+    CHECK(revents[0] == yamux_poll_in && revents[1] == yamux_poll_out);
+
+    char buf[8];
+    CHECK(yamux_stream_read(peer, sizeof(buf), buf) == 4 && !memcmp(buf, "ping", 4));
+    CHECK(yamux_poll(streams, events, revents, 1, 20) == 0);
+
+    // the ACK comes with it, only then can the stream be closed
+    CHECK(yamux_stream_write(peer, 2, "ok") == 2);
+    CHECK(yamux_poll(&st, events, revents, 1, 1000) == 1);
+    CHECK(yamux_stream_read(st, sizeof(buf), buf) == 2);
+
+    int efd = yamux_stream_eventfd(peer);
+    CHECK(efd >= 0);
+    CHECK(yamux_stream_write(st, 4, "pong") == 4);
+
+    struct pollfd pfd = { .fd = efd, .events = POLLIN };
+    CHECK(poll(&pfd, 1, 1000) == 1);
+
+    CHECK(yamux_stream_read(peer, sizeof(buf), buf) == 4 && !memcmp(buf, "pong", 4));
+    CHECK(yamux_stream_close(st) >= 0);
+
+    // the session answers the FIN with its own first, so hup can show
+    // up a moment before the stream counts as closed
+    for (int i = 0; i < 1000; ++i)
+    {
+        CHECK(yamux_poll(streams, events, revents, 1, 1000) == 1);
+        if (revents[0] != yamux_poll_hup)
+            break;
+        usleep(1000);
+    }
+
+    CHECK(revents[0] == (yamux_poll_in | yamux_poll_hup));
+    CHECK(yamux_stream_read(peer, sizeof(buf), buf) == 0);
+
+    pair_close(&p);
+}
+
+// a session only takes on streams whose window fits its budget, the
+// rest are refused with a RST. buffered data counts until it's read.
+static void test_budget(void)
+{
+    struct yamux_config server = YAMUX_DEFAULT_CONFIG;
+    server.memory_budget = 2 * YAMUX_DEFAULT_WINDOW;
+
+    struct pair p;
+    CHECK(pair_open(&p, NULL, &server));
+
+    p.server->new_stream_fn = accept_new;
+
+    atomic_store(&accepted, NULL);
+    pair_start(&p);
+
+    char data[100] = { 0 };
+    struct yamux_stream* st[3];
+    struct yamux_stream* peer[2];
+
+    for (int i = 0; i < 2; ++i)
+    {
+        st[i] = yamux_stream_new(p.client, 0, NULL);
+        CHECK(yamux_stream_write(st[i], sizeof(data), data) == sizeof(data));
+
+        peer[i] = wait_accepted();
+        CHECK(peer[i]);
+        atomic_store(&accepted, NULL);
+
+        uint32_t in = yamux_poll_in, rev;
+        CHECK(yamux_poll(&peer[i], &in, &rev, 1, 1000) == 1);
+    }
+
+    CHECK(atomic_load(&p.server->memory.committed) == 2 * YAMUX_DEFAULT_WINDOW);
+    CHECK(atomic_load(&p.server->memory.buffered) == 2 * sizeof(data));
+
+    // no room for a third window
+    st[2] = yamux_stream_new(p.client, 0, NULL);
+    CHECK(yamux_stream_write(st[2], sizeof(data), data) == sizeof(data));
+
+    uint32_t in = yamux_poll_in, rev;
+    CHECK(yamux_poll(&st[2], &in, &rev, 1, 1000) == 1 && (rev & yamux_poll_hup));
+    CHECK(p.server->num_streams == 2);
+
+    char buf[sizeof(data)];
+    CHECK(yamux_stream_read(peer[0], sizeof(buf), buf) == sizeof(buf));
+    CHECK(atomic_load(&p.server->memory.buffered) == sizeof(data));
+    CHECK(atomic_load(&p.server->memory.peak) == 2 * sizeof(data));
+
+    // freeing one makes room again
+    yamux_stream_free(peer[0]);
+    CHECK(atomic_load(&p.server->memory.committed) == YAMUX_DEFAULT_WINDOW);
+
+    struct yamux_stream* again = yamux_stream_new(p.client, 0, NULL);
+    CHECK(yamux_stream_write(again, sizeof(data), data) == sizeof(data));
+    CHECK(wait_accepted());
+
+    pair_close(&p);
+}
+
+// streams free_read freed. free_new gives it the first stream, and
+// count_read the others.
+static atomic_int freed;
+
+static void free_read(struct yamux_stream* stream, uint32_t data_len, void* data)
+{
+    (void)data_len;
+    (void)data;
+
+    yamux_stream_free(stream);
+    atomic_fetch_add(&freed, 1);
+}
+static void free_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+
+    if (atomic_load(&freed))
+    {
+        stream->read_fn = count_read;
+        atomic_store(&accepted, stream);
+    }
+    else
+        stream->read_fn = free_read;
+}
+
+// a read_fn may free its stream, on the reader or on a dispatcher
+// thread, and the session goes on with the next one
+static void free_in_read(struct yamux_config* server)
+{
+    struct pair p;
+    CHECK(pair_open(&p, NULL, server));
+
+    p.server->new_stream_fn = free_new;
+
+    atomic_store(&freed, 0);
+    atomic_store(&received, 0);
+    atomic_store(&accepted, NULL);
+    pair_start(&p);
+
+    // a single frame, more would be for a stream the peer doesn't know
+    char data[100] = { 0 };
+    struct yamux_stream* st = yamux_stream_new(p.client, 0, NULL);
+    CHECK(yamux_stream_write(st, sizeof(data), data) == sizeof(data));
+    CHECK(wait_for(&freed, 1));
+
+    st = yamux_stream_new(p.client, 0, NULL);
+    CHECK(write_all(st, sizeof(data), data));
+    CHECK(wait_for(&received, sizeof(data)));
+
+    // the freed stream's window is released. the other's isn't granted
+    // back before there's half a window to grant.
+    struct yamux_stream* peer = wait_accepted();
+    bool settled = false;
+
+    for (int i = 0; i < 5000 && !settled; ++i)
+    {
+        settled = atomic_load(&p.server->memory.committed) + atomic_load(&peer->owed) == YAMUX_DEFAULT_WINDOW;
+        if (!settled)
+            usleep(1000);
+    }
+
+    CHECK(settled);
+
+    pair_close(&p);
+}
+
+static void test_free_in_read(void)
+{
+    free_in_read(NULL);
+
+    struct yamux_config server = YAMUX_DEFAULT_CONFIG;
+    server.dispatch = yamux_dispatch_new(2, 0);
+    CHECK(server.dispatch);
+
+    free_in_read(&server);
+
+    yamux_dispatch_free(server.dispatch);
+}
+
+// reads exactly length bytes, waiting for up to 1s for each part
+static bool read_all(struct yamux_stream* stream, uint32_t length, char* data)
+{
+    for (uint32_t done = 0; done < length; )
+    {
+        uint32_t in = yamux_poll_in, rev;
+        if (yamux_poll(&stream, &in, &rev, 1, 1000) != 1)
+            return false;
+
+        ssize_t res = yamux_stream_read(stream, length - done, data + done);
+        if (res < 0 || (res == 0 && (rev & yamux_poll_hup)))
+            return false;
+
+        done += (uint32_t)res;
+    }
+
+    return true;
+}
+
+static bool compressing(struct yamux_stream* stream)
+{
+    struct yamux_stream_cold* c = atomic_load(&stream->cold);
+    return c && atomic_load(&c->compress);
+}
+
+// the client asks for compression; it's used if the server agrees and
+// LZ4 is built in. the data arrives intact either way.
+static void compression(bool server_agrees)
+{
+    enum { total = 4 * YAMUX_DEFAULT_WINDOW };
+
+    struct yamux_config client = YAMUX_DEFAULT_CONFIG, server = YAMUX_DEFAULT_CONFIG;
+    client.compression = true;
+    server.compression = server_agrees;
+
+    struct pair p;
+    CHECK(pair_open(&p, &client, &server));
+
+    p.server->new_stream_fn = accept_new;
+
+    atomic_store(&accepted, NULL);
+    pair_start(&p);
+
+    char* data = (char*)malloc(total);
+    char* got  = (char*)malloc(total);
+
+    for (int i = 0; i < total; ++i)
+        data[i] = "compressible, "[i % 14] + (char)(i / 0x1000 % 4);
+
+    pthread_t thread;
+    struct writer w = { .stream = yamux_stream_new(p.client, 0, NULL), .length = total, .data = data };
+    pthread_create(&thread, NULL, write_thread, &w);
+
+    struct yamux_stream* peer = wait_accepted();
+    CHECK(peer);
+    CHECK(peer && read_all(peer, total, got) && !memcmp(got, data, total));
+
+    pthread_join(thread, NULL);
+    CHECK(w.ok);
+
+    bool agreed = server_agrees && yamux_compress_available();
+    CHECK(compressing(w.stream) == agreed);
+    CHECK(!peer || compressing(peer) == agreed);
+
+    pair_close(&p);
+    free(data);
+    free(got);
+}
+
+static void test_compression(void)
+{
+    compression(true);
+    compression(false);
+}
+
+// what order_read saw of one stream
+struct order
+{
+    atomic_uint pos;
+    atomic_bool in ; // in a callback of the stream
+    atomic_int  bad; // out of order or concurrent callbacks
+    atomic_bool fin_after_data;
+};
+
+static struct order orders[8];
+static atomic_int   num_orders;
+static atomic_int   fins;
+
+// streams carry byte i % 251 at offset i
+static void order_read(struct yamux_stream* stream, uint32_t data_len, void* data)
+{
+    struct order* o = (struct order*)stream->userdata;
+
+    if (atomic_exchange(&o->in, true))
+        atomic_fetch_add(&o->bad, 1);
+
+    uint32_t pos = atomic_load(&o->pos);
+    for (uint32_t i = 0; i < data_len; ++i)
+        if (((unsigned char*)data)[i] != (pos + i) % 251)
+        {
+            atomic_fetch_add(&o->bad, 1);
+            break;
+        }
+
+    // give other workers a chance to overtake
+    usleep(50);
+
+    atomic_store(&o->pos, pos + data_len);
+    atomic_store(&o->in, false);
+
+    atomic_fetch_add(&received, (int)data_len);
+    yamux_stream_grant(stream, stream->rx_wire);
+}
+static void order_fin(struct yamux_stream* stream)
+{
+    struct order* o = (struct order*)stream->userdata;
+
+    atomic_store(&o->fin_after_data, atomic_load(&o->pos) == 2 * YAMUX_DEFAULT_WINDOW);
+    atomic_fetch_add(&fins, 1);
+}
+static void order_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+
+    stream->userdata = &orders[atomic_fetch_add(&num_orders, 1)];
+    stream->read_fn  = order_read;
+    stream->fin_fn   = order_fin;
+}
+
+// writes w->length bytes of the order pattern in small frames, then
+// closes the stream
+static void* order_thread(void* arg)
+{
+    struct writer* w = (struct writer*)arg;
+
+    char piece[1000];
+    w->ok = true;
+
+    for (uint32_t done = 0; done < w->length && w->ok; done += sizeof(piece))
+    {
+        uint32_t n = w->length - done < sizeof(piece) ? w->length - done : sizeof(piece);
+        for (uint32_t i = 0; i < n; ++i)
+            piece[i] = (char)((done + i) % 251);
+
+        w->ok = write_all(w->stream, n, piece);
+    }
+
+    w->ok = w->ok && yamux_stream_close(w->stream) >= 0;
+
+    return NULL;
+}
+
+// with a dispatcher, a stream's callbacks run one at a time and in
+// order, its FIN last, while the streams share the workers
+static void test_dispatch(void)
+{
+    enum { streams = 8, each = 2 * YAMUX_DEFAULT_WINDOW };
+
+    struct yamux_config server = YAMUX_DEFAULT_CONFIG;
+    server.dispatch = yamux_dispatch_new(4, 0x10000);
+    CHECK(server.dispatch);
+
+    struct pair p;
+    CHECK(pair_open(&p, NULL, &server));
+
+    p.server->new_stream_fn = order_new;
+
+    memset(orders, 0, sizeof(orders));
+    atomic_store(&num_orders, 0);
+    atomic_store(&fins, 0);
+    atomic_store(&received, 0);
+    pair_start(&p);
+
+    pthread_t     threads[streams];
+    struct writer w[streams];
+
+    for (int i = 0; i < streams; ++i)
+    {
+        w[i] = (struct writer){ .stream = yamux_stream_new(p.client, 0, NULL), .length = each };
+        pthread_create(&threads[i], NULL, order_thread, &w[i]);
+    }
+    for (int i = 0; i < streams; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        CHECK(w[i].ok);
+    }
+
+    CHECK(wait_for(&fins, streams));
+    CHECK(atomic_load(&received) == streams * each);
+
+    for (int i = 0; i < streams; ++i)
+    {
+        CHECK(atomic_load(&orders[i].bad) == 0);
+        CHECK(atomic_load(&orders[i].fin_after_data));
+    }
+
+    pair_close(&p);
+    yamux_dispatch_free(server.dispatch);
+}
+
+// completions seen by zc_done
+struct zc_dones
+{
+    atomic_int calls;
+    atomic_int failed;
+};
+
+static void zc_done(void* arg, int status)
+{
+    struct zc_dones* d = (struct zc_dones*)arg;
+
+    if (status)
+        atomic_fetch_add(&d->failed, 1);
+    atomic_fetch_add(&d->calls, 1);
+}
+
+// every yamux_stream_write_zc call is completed exactly once, whether
+// the socket takes MSG_ZEROCOPY (TCP) or it's copied instead (AF_UNIX)
+static void zerocopy(bool tcp)
+{
+    enum { total = 3 * YAMUX_DEFAULT_WINDOW };
+
+    struct yamux_config client = YAMUX_DEFAULT_CONFIG;
+    client.zerocopy_threshold = 0x4000;
+
+    struct pair p;
+    CHECK(tcp ? pair_open_tcp(&p, &client, NULL) : pair_open(&p, &client, NULL));
+
+    p.server->new_stream_fn = count_new;
+
+    atomic_store(&received, 0);
+    pair_start(&p);
+
+    char* data = (char*)calloc(1, total);
+    struct yamux_stream* st = yamux_stream_new(p.client, 0, NULL);
+
+    struct zc_dones d = { 0 };
+    int writes = 0;
+
+    for (uint32_t done = 0; done < total; )
+    {
+        ssize_t res = yamux_stream_write_zc(st, total - done, data + done, zc_done, &d);
+        writes++;
+
+        CHECK(res >= 0 || res == -EAGAIN);
+        if (res < 0 && res != -EAGAIN)
+            break;
+
+        done += res > 0 ? (uint32_t)res : 0;
+
+        if (done < total && yamux_stream_wait_for_window(st) < 0)
+            break;
+    }
+
+    CHECK(wait_for(&received, total));
+
+    // the last completions may only be waiting on the error queue
+    for (int i = 0; i < 5000 && atomic_load(&d.calls) < writes; ++i)
+    {
+        yamux_session_reap_zerocopy(p.client);
+        usleep(1000);
+    }
+
+    CHECK(atomic_load(&d.calls) == writes);
+    CHECK(atomic_load(&d.failed) == 0);
+    CHECK(atomic_load(&p.client->zerocopy.in_flight) == 0);
+    CHECK(!tcp || !p.client->zerocopy.enabled || p.client->zerocopy.sends > 0);
+
+    pair_close(&p);
+
+    // nothing completes twice, not even when the session goes
+    CHECK(atomic_load(&d.calls) == writes);
+    free(data);
+}
+
+static void test_zerocopy(void)
+{
+    zerocopy(false);
+    zerocopy(true);
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void rate_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    count_new(session, stream);
+    yamux_rate_set(yamux_stream_recv_rate(stream), 0x100000, 0);
+}
+
+// a stream's send_rate makes writes stop short instead of sleeping, and
+// its peer's recv_rate holds back window updates. either way 1MB at
+// 1MB/s takes the time the rate and the first burst or window allow.
+static void test_rate(void)
+{
+    enum { total = 0x100000 };
+
+    char* data = (char*)calloc(1, total);
+
+    for (int recv = 0; recv < 2; ++recv)
+    {
+        struct pair p;
+        CHECK(pair_open(&p, NULL, NULL));
+
+        p.server->new_stream_fn = recv ? rate_new : count_new;
+
+        atomic_store(&received, 0);
+        pair_start(&p);
+
+        struct yamux_stream* st = yamux_stream_new(p.client, 0, NULL);
+        double start = now_s(), least;
+
+        if (recv)
+        {
+            // beyond the first window, the burst and the last grant
+            // (up to a window, charged as it goes) wait for the rate
+            least = (double)(total - 2 * YAMUX_DEFAULT_WINDOW - total / 10) / total - 0.05;
+            CHECK(write_all(st, total, data));
+        }
+        else
+        {
+            // 100ms worth goes at once
+            yamux_rate_set(yamux_stream_send_rate(st), 0x100000, 0);
+            least = 0.85;
+
+            ssize_t first = yamux_stream_write(st, total, data);
+            CHECK(first > 0 && first < total);
+            CHECK(yamux_stream_write(st, total, data) == -EAGAIN);
+            CHECK(yamux_stream_send_delay(st) > 0);
+
+            CHECK(first > 0 && write_all(st, total - (uint32_t)first, data));
+        }
+
+        CHECK(wait_for(&received, total));
+
+        double took = now_s() - start;
+        CHECK(took >= least && took < least + 2);
+
+        pair_close(&p);
+    }
+
+    free(data);
+}
+
+// the test's ends of the sockets bridge_new bridged streams to
+static int        bridge_socks[2][2];
+static atomic_int num_bridges;
+static atomic_int bridge_dones;
+static atomic_int bridge_failed;
+
+static void bridge_done(struct yamux_stream* stream, int status)
+{
+    (void)stream;
+
+    if (status)
+        atomic_fetch_add(&bridge_failed, 1);
+    atomic_fetch_add(&bridge_dones, 1);
+}
+static void bridge_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+
+    int i = atomic_load(&num_bridges);
+    int sv[2];
+
+    if (i < 2 && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0)
+    {
+        bridge_socks[i][0] = sv[0];
+        bridge_socks[i][1] = sv[1];
+
+        if (yamux_stream_bridge(stream, sv[1], bridge_done) < 0)
+            close(sv[1]);
+    }
+
+    atomic_fetch_add(&num_bridges, 1);
+}
+
+// reads exactly length bytes from fd, waiting for up to 1s for each part
+static bool read_fd(int fd, size_t length, char* data)
+{
+    for (size_t done = 0; done < length; )
+    {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, 1000) != 1)
+            return false;
+
+        ssize_t res = read(fd, data + done, length - done);
+        if (res <= 0)
+            return false;
+
+        done += (size_t)res;
+    }
+
+    return true;
+}
+
+// bridged streams relay both ways, one whose fd isn't read doesn't hold
+// up the other, and EOF on the fd ends up as the stream's FIN
+static void test_bridge(void)
+{
+    enum { total = 3 * YAMUX_DEFAULT_WINDOW };
+
+    struct pair p;
+    CHECK(pair_open(&p, NULL, NULL));
+
+    p.server->new_stream_fn = bridge_new;
+
+    atomic_store(&num_bridges, 0);
+    atomic_store(&bridge_dones, 0);
+    atomic_store(&bridge_failed, 0);
+    pair_start(&p);
+
+    char* data[2];
+    char* got = (char*)malloc(total);
+
+    pthread_t     threads[2];
+    struct writer w[2];
+
+    for (int i = 0; i < 2; ++i)
+    {
+        data[i] = (char*)malloc(total);
+        for (int k = 0; k < total; ++k)
+            data[i][k] = (char)(k % 251 + i);
+
+        w[i] = (struct writer){ .stream = yamux_stream_new(p.client, 0, NULL), .length = total, .data = data[i] };
+        pthread_create(&threads[i], NULL, write_thread, &w[i]);
+
+        // the first stream gets the first socket
+        for (int k = 0; k < 5000 && atomic_load(&num_bridges) <= i; ++k)
+            usleep(1000);
+    }
+
+    CHECK(atomic_load(&num_bridges) == 2);
+
+    // the first one's fd isn't read yet
+    CHECK(read_fd(bridge_socks[1][0], total, got) && !memcmp(got, data[1], total));
+    pthread_join(threads[1], NULL);
+    CHECK(w[1].ok);
+
+    CHECK(read_fd(bridge_socks[0][0], total, got) && !memcmp(got, data[0], total));
+    pthread_join(threads[0], NULL);
+    CHECK(w[0].ok);
+
+    // back from the fd
+    CHECK(write(bridge_socks[0][0], "reply", 5) == 5);
+    CHECK(read_all(w[0].stream, 5, got) && !memcmp(got, "reply", 5));
+
+    // EOF closes the stream, whose session answers the FIN, which shuts
+    // the fd down and ends the bridge
+    shutdown(bridge_socks[0][0], SHUT_WR);
+
+    uint32_t in = yamux_poll_in, rev;
+    CHECK(yamux_poll(&w[0].stream, &in, &rev, 1, 1000) == 1 && (rev & yamux_poll_hup));
+
+    CHECK(wait_for(&bridge_dones, 1));
+    CHECK(atomic_load(&bridge_failed) == 0);
+    CHECK(read(bridge_socks[0][0], got, 1) == 0);
+
+    pair_close(&p);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        close(bridge_socks[i][0]);
+        free(data[i]);
+    }
+    free(got);
+}
+
+static void echo_read(struct yamux_stream* stream, uint32_t data_len, void* data)
+{
+    yamux_stream_write(stream, data_len, data);
+    yamux_stream_grant(stream, stream->rx_wire);
+}
+static void echo_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+    stream->read_fn = echo_read;
+}
+
+// writes data and waits for its echo
+static bool echo(struct yamux_stream* stream, const char* data)
+{
+    char buf[16];
+    uint32_t length = (uint32_t)strlen(data);
+
+    return yamux_stream_write(stream, length, (void*)data) == (ssize_t)length &&
+        read_all(stream, length, buf) && !memcmp(buf, data, length);
+}
+
+static bool wait_spares(struct yamux_session* session, size_t count)
+{
+    for (int i = 0; i < 5000 && yamux_spares_count(&session->spares) != count; ++i)
+        usleep(1000);
+
+    return yamux_spares_count(&session->spares) == count;
+}
+
+// the session opens spares ahead of time, taking one sends no SYN, and
+// a released one can be taken again. accept_backlog keeps the refiller
+// from replacing what's taken.
+static void test_spares(void)
+{
+    struct yamux_config client = YAMUX_DEFAULT_CONFIG;
+    client.spare_streams  = 2;
+    client.accept_backlog = 2;
+
+    struct pair p;
+    CHECK(pair_open(&p, &client, NULL));
+
+    p.server->new_stream_fn = echo_new;
+    pair_start(&p);
+
+    CHECK(wait_spares(p.client, 2));
+
+    int tag;
+    struct yamux_stream* a = yamux_session_take_stream(p.client, &tag);
+
+    CHECK(a && a->userdata == &tag);
+    CHECK(yamux_stream_get_state(a) == yamux_stream_syn_sent);
+    CHECK(yamux_spares_count(&p.client->spares) == 1);
+    CHECK(echo(a, "taken"));
+
+    CHECK(yamux_stream_release(a) == 0);
+
+    // the reader puts it back between frames
+    struct yamux_stream* b = yamux_session_take_stream(p.client, NULL);
+    CHECK(b && b != a && echo(b, "next"));
+    CHECK(wait_spares(p.client, 1));
+
+    CHECK(yamux_session_take_stream(p.client, NULL) == a);
+    CHECK(a->userdata == NULL);
+    CHECK(echo(a, "again"));
+
+    // both spares were opened up front, nothing since
+    CHECK(p.server->num_streams == 2);
+    CHECK(yamux_session_take_stream(p.client, NULL) == NULL);
+
+    pair_close(&p);
+}
+
+// message i is msg_length(i) bytes of (i + k) % 251
+static uint32_t msg_length(int i)
+{
+    if (i == 50)
+        return 300000; // more than a window
+    if (i == 70)
+        return 40000; // more than a batch
+
+    return (uint32_t)(i * 997 % 5000);
+}
+
+static atomic_int messages;
+static atomic_int messages_bad;
+
+static void msg_check(struct yamux_stream* stream, uint32_t length, void* data)
+{
+    (void)stream;
+
+    int i = atomic_fetch_add(&messages, 1);
+    bool ok = length == msg_length(i);
+
+    for (uint32_t k = 0; ok && k < length; ++k)
+        ok = ((unsigned char*)data)[k] == (i + k) % 251;
+
+    if (!ok)
+        atomic_fetch_add(&messages_bad, 1);
+}
+static void msg_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+    yamux_stream_messages(stream, msg_check, 0, 0);
+}
+
+// messages of any size arrive whole and in order, whether they share a
+// payload or span several, and batches go out on flush or after delay_us
+static void test_messages(void)
+{
+    enum { count = 100 };
+
+    struct pair p;
+    CHECK(pair_open(&p, NULL, NULL));
+
+    p.server->new_stream_fn = msg_new;
+
+    atomic_store(&messages, 0);
+    atomic_store(&messages_bad, 0);
+    pair_start(&p);
+
+    struct yamux_stream* st = yamux_stream_new(p.client, 0, NULL);
+    CHECK(yamux_stream_messages(st, msg_check, 0, 0) == 0);
+
+    char* data = (char*)malloc(msg_length(50));
+
+    for (int i = 0; i < count; ++i)
+    {
+        for (uint32_t k = 0; k < msg_length(i); ++k)
+            data[k] = (char)((i + k) % 251);
+
+        CHECK(yamux_stream_send_message(st, msg_length(i), data) == msg_length(i));
+    }
+
+    CHECK(yamux_stream_flush(st) >= 0);
+    CHECK(wait_for(&messages, count));
+
+    // without a flush
+    struct yamux_stream* delayed = yamux_stream_new(p.client, 0, NULL);
+    CHECK(yamux_stream_messages(delayed, msg_check, 0, 1000) == 0);
+
+    atomic_store(&messages, 0);
+    CHECK(yamux_stream_send_message(delayed, 0, NULL) == 0);
+    CHECK(wait_for(&messages, 1));
+
+    CHECK(atomic_load(&messages_bad) == 0);
+
+    pair_close(&p);
+    free(data);
+}
+
+// messages free_message saw, it frees the stream on "free"
+static atomic_int freeing_seen;
+
+static void free_message(struct yamux_stream* stream, uint32_t length, void* data)
+{
+    atomic_fetch_add(&freeing_seen, 1);
+
+    if (length == 4 && !memcmp(data, "free", 4))
+        yamux_stream_free(stream);
+}
+static void free_message_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+    yamux_stream_messages(stream, free_message, 0, 0);
+}
+
+// a message handler may free its stream, the rest of the payload is
+// dropped and the session goes on
+static void message_free(struct yamux_config* server)
+{
+    struct pair p;
+    CHECK(pair_open(&p, NULL, server));
+
+    p.server->new_stream_fn = free_message_new;
+
+    atomic_store(&freeing_seen, 0);
+    pair_start(&p);
+
+    // one batch, one frame: the peer doesn't know the stream afterwards
+    struct yamux_stream* st = yamux_stream_new(p.client, 0, NULL);
+    CHECK(yamux_stream_messages(st, msg_check, 0, 0) == 0);
+    CHECK(yamux_stream_send_message(st, 1, "a") == 1);
+    CHECK(yamux_stream_send_message(st, 4, "free") == 4);
+    CHECK(yamux_stream_send_message(st, 1, "b") == 1);
+    CHECK(yamux_stream_flush(st) >= 0);
+
+    st = yamux_stream_new(p.client, 0, NULL);
+    CHECK(yamux_stream_messages(st, msg_check, 0, 0) == 0);
+    CHECK(yamux_stream_send_message(st, 1, "c") == 1);
+    CHECK(yamux_stream_flush(st) >= 0);
+
+    CHECK(wait_for(&freeing_seen, 3));
+    usleep(10000);
+    CHECK(atomic_load(&freeing_seen) == 3);
+    CHECK(p.server->num_streams == 1);
+
+    pair_close(&p);
+}
+
+static void test_message_free(void)
+{
+    message_free(NULL);
+
+    struct yamux_config server = YAMUX_DEFAULT_CONFIG;
+    server.dispatch = yamux_dispatch_new(2, 0);
+    CHECK(server.dispatch);
+
+    message_free(&server);
+
+    yamux_dispatch_free(server.dispatch);
+}
+
+// what stall_fn was told
+static atomic_int     stalls;
+static atomic_uint    stall_id;
+static atomic_int     stall_type;
+static atomic_ullong  stall_ns;
+// stalls counted when slow_read's sleep was over
+static atomic_int     stalls_during;
+
+static void on_stall(struct yamux_session* session, yamux_streamid streamid,
+        enum yamux_callback type, uint64_t duration)
+{
+    (void)session;
+
+    atomic_store(&stall_id  , streamid);
+    atomic_store(&stall_type, (int)type);
+    atomic_store(&stall_ns  , duration);
+    atomic_fetch_add(&stalls, 1);
+}
+
+// the first payload takes 100ms
+static void slow_read(struct yamux_stream* stream, uint32_t data_len, void* data)
+{
+    (void)data;
+
+    if (atomic_fetch_add(&received, (int)data_len) == 0)
+    {
+        usleep(100000);
+        atomic_store(&stalls_during, atomic_load(&stalls));
+    }
+
+    yamux_stream_grant(stream, stream->rx_wire);
+}
+static void slow_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+    stream->read_fn = slow_read;
+}
+
+// a callback past stall_threshold is reported once, by the watchdog
+// while it still runs, and shows up in the latency histograms
+static void test_stall(void)
+{
+    struct yamux_config server = YAMUX_DEFAULT_CONFIG;
+    server.stall_threshold = 20000;
+
+    struct pair p;
+    CHECK(pair_open(&p, NULL, &server));
+
+    p.server->new_stream_fn = slow_new;
+    p.server->stall_fn      = on_stall;
+
+    atomic_store(&received, 0);
+    atomic_store(&stalls, 0);
+    atomic_store(&stalls_during, 0);
+    pair_start(&p);
+
+    struct yamux_stream* st = yamux_stream_new(p.client, 0, NULL);
+    CHECK(yamux_stream_write(st, 4, "slow") == 4);
+    CHECK(wait_for(&received, 4));
+
+    CHECK(yamux_stream_write(st, 4, "fast") == 4);
+    CHECK(wait_for(&received, 8));
+    usleep(50000);
+
+    CHECK(atomic_load(&stalls_during) == 1);
+    CHECK(atomic_load(&stalls) == 1);
+    CHECK(atomic_load(&stall_id) == st->id);
+    CHECK(atomic_load(&stall_type) == yamux_callback_read);
+    CHECK(atomic_load(&stall_ns) >= 20000000);
+
+    struct yamux_latency* l = &p.server->latency;
+    CHECK(yamux_latency_count(l, yamux_callback_read) == 2);
+    CHECK(yamux_latency_percentile(l, yamux_callback_read, 1) >= 100000000);
+    CHECK(yamux_latency_percentile(l, yamux_callback_read, 0.5) < 20000000);
+
+    pair_close(&p);
+}
+
+// several windows' worth of data through one stream, recorded for
+// bin/yreplay, which needs window updates to follow it
+static void test_capture(void)
+{
+    enum { total = 4 * YAMUX_DEFAULT_WINDOW };
+
+    struct pair p;
+    CHECK(pair_open(&p, NULL, NULL));
+
+    p.server->capture       = yamux_capture_open(capture_path, yamux_session_server, true);
+    p.server->new_stream_fn = count_new;
+    CHECK(p.server->capture);
+
+    atomic_store(&received, 0);
+    pair_start(&p);
+
+    char* data = (char*)calloc(1, total);
+    struct yamux_stream* st = yamux_stream_new(p.client, 0, NULL);
+
+    CHECK(write_all(st, total, data));
+    CHECK(wait_for(&received, total));
+    CHECK(yamux_stream_close(st) >= 0);
+
+    // the session doesn't own it, and is gone after pair_close
+    struct yamux_capture* cap = p.server->capture;
+
+    pair_close(&p);
+    yamux_capture_close(cap);
+    free(data);
+}
+
+struct test
+{
+    const char* name;
+    void (*fn)(void);
+};
+
+static const struct test tests[] = {
+    { "pool"        , test_pool         },
+    { "window"      , test_window       },
+    { "poll"        , test_poll         },
+    { "budget"      , test_budget       },
+    { "free"        , test_free_in_read },
+    { "compression" , test_compression  },
+    { "dispatch"    , test_dispatch     },
+    { "zerocopy"    , test_zerocopy     },
+    { "rate"        , test_rate         },
+    { "bridge"      , test_bridge       },
+    { "spares"      , test_spares       },
+    { "messages"    , test_messages     },
+    { "message_free", test_message_free },
+    { "stall"       , test_stall        },
+    { "capture"     , test_capture      },
+};
+
+// runs the tests named in argv, or all of them
+static int run_tests(int argc, char* argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    int run = 0;
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+    {
+        bool wanted = argc == 0;
+        for (int a = 0; a < argc; ++a)
+            wanted |= !strcmp(argv[a], tests[i].name);
+
+        if (!wanted)
+            continue;
+
+        int before = failures;
+        tests[i].fn();
+        run++;
+
+        printf("%-12s %s\n", tests[i].name, failures == before ? "ok" : "FAILED");
+    }
+
+    printf("%d tests, %d failed checks\n", run, failures);
+
+    return failures ? 1 : 0;
+}
+
 int main(int argc, char* argv[])
 {
+    if (argc > 1 && !strcmp(argv[1], "test"))
+        return run_tests(argc - 2, argv + 2);
+
     int sock;
     int e;
     ssize_t ee;
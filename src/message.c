@@ -0,0 +1,535 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "message.h"
+#include "stream.h"
+
+// used when yamux_stream_messages is given a batch size of 0
+#define DEFAULT_BATCH (0x10*0x400)
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// yamux_stream_write stops where the send window ends, or where
+// send_rate holds it back (-EAGAIN if that's right away)
+static ssize_t write_all(struct yamux_stream* stream, uint32_t length, char* data)
+{
+    uint32_t done = 0;
+
+    while (done < length)
+    {
+        ssize_t res = yamux_stream_write(stream, length - done, data + done);
+        if (res == -EAGAIN)
+            res = 0;
+        if (res < 0)
+            return res;
+
+        done += (uint32_t)res;
+
+        if (done < length && (res = yamux_stream_wait_for_window(stream)) < 0)
+            return res;
+    }
+
+    return length;
+}
+
+// with m->mutex held: drops what went out from the batch
+static void consume(struct yamux_messages* m, uint32_t n)
+{
+    m->out_len -= n;
+    memmove(m->out, m->out + n, m->out_len);
+}
+
+// with m->mutex held: waits for window until the whole batch went out.
+// whatever couldn't be written stays batched. bytes written or -errno.
+static ssize_t write_out(struct yamux_messages* m)
+{
+    ssize_t done = 0;
+
+    while (m->out_len)
+    {
+        ssize_t res = yamux_stream_write(m->stream, m->out_len, m->out);
+        if (res == -EAGAIN)
+            res = 0;
+        if (res < 0)
+            return res;
+
+        consume(m, (uint32_t)res);
+        done += res;
+
+        if (m->out_len && (res = yamux_stream_wait_for_window(m->stream)) < 0)
+            return res;
+    }
+
+    return done;
+}
+
+// with m->mutex held: what the window and send_rate take right now,
+// the rest stays batched. whether something is left.
+static bool write_some(struct yamux_messages* m)
+{
+    ssize_t res = yamux_stream_write(m->stream, m->out_len, m->out);
+    if (res == -EAGAIN)
+        res = 0;
+
+    // broken, dropped: there's no one to report it to
+    if (res < 0)
+    {
+        m->out_len = 0;
+        return false;
+    }
+
+    consume(m, (uint32_t)res);
+
+    return m->out_len > 0;
+}
+
+// with f->mutex held
+static void queue(struct yamux_flusher* f, struct yamux_messages* m, uint64_t due)
+{
+    m->due    = due;
+    m->queued = true;
+    m->next   = f->first;
+    f->first  = m;
+}
+
+static void* flusher_main(void* arg)
+{
+    struct yamux_flusher* f = (struct yamux_flusher*)arg;
+
+    pthread_mutex_lock(&f->mutex);
+
+    while (!f->stop)
+    {
+        struct yamux_messages* next = NULL;
+
+        for (struct yamux_messages* m = f->first; m; m = m->next)
+            if (!next || m->due < next->due)
+                next = m;
+
+        if (!next)
+        {
+            pthread_cond_wait(&f->cond, &f->mutex);
+            continue;
+        }
+
+        if (next->due > now_ns())
+        {
+            struct timespec ts = {
+                .tv_sec  = (time_t)(next->due / 1000000000u),
+                .tv_nsec = (long  )(next->due % 1000000000u)
+            };
+            pthread_cond_timedwait(&f->cond, &f->mutex, &ts);
+            continue;
+        }
+
+        struct yamux_messages** p = &f->first;
+        while (*p != next)
+            p = &(*p)->next;
+        *p = next->next;
+
+        next->queued = false;
+        f->busy = next;
+
+        // a sender may hold the stream's mutex while queueing, or while
+        // it waits for window: the batch is tried again later then,
+        // like one the window or send_rate doesn't take all of
+        pthread_mutex_unlock(&f->mutex);
+
+        bool left = true;
+
+        if (pthread_mutex_trylock(&next->mutex) == 0)
+        {
+            left = next->out_len && write_some(next);
+            pthread_mutex_unlock(&next->mutex);
+        }
+
+        uint64_t retry = MAX((uint64_t)next->delay_us * 1000u, yamux_stream_send_delay(next->stream));
+
+        pthread_mutex_lock(&f->mutex);
+
+        // a sender may have queued it again meanwhile
+        if (left && !next->queued)
+            queue(f, next, now_ns() + retry);
+
+        f->busy = NULL;
+        pthread_cond_broadcast(&f->cond);
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+
+    return NULL;
+}
+
+static struct yamux_flusher* flusher_new(void)
+{
+    struct yamux_flusher* f = (struct yamux_flusher*)malloc(sizeof(struct yamux_flusher));
+    if (!f)
+        return NULL;
+
+    *f = (struct yamux_flusher){
+        .first = NULL,
+        .busy  = NULL,
+        .stop  = false
+    };
+
+    // deadlines are monotonic
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init (&f->cond , &attr);
+
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&f->thread, NULL, flusher_main, f) != 0)
+    {
+        f->stop = true; // no thread to join
+        yamux_flusher_free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+// the session's flusher, started with the first stream that has a delay
+static struct yamux_flusher* get_flusher(struct yamux_session* session)
+{
+    struct yamux_flusher* f = atomic_load(&session->flusher);
+    if (f)
+        return f;
+
+    if (!(f = flusher_new()))
+        return NULL;
+
+    struct yamux_flusher* other = NULL;
+    if (!atomic_compare_exchange_strong(&session->flusher, &other, f))
+    {
+        yamux_flusher_stop(f);
+        yamux_flusher_free(f);
+        return other;
+    }
+
+    return f;
+}
+
+// with m->mutex held, after the first message went into an empty batch
+static void arm(struct yamux_messages* m)
+{
+    struct yamux_flusher* f = atomic_load(&m->stream->session->flusher);
+
+    pthread_mutex_lock(&f->mutex);
+
+    // still queued for an earlier batch: goes out early, which is fine
+    if (!m->queued)
+    {
+        queue(f, m, now_ns() + (uint64_t)m->delay_us * 1000u);
+        pthread_cond_signal(&f->cond);
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+}
+
+void yamux_flusher_stop(struct yamux_flusher* f)
+{
+    if (!f)
+        return;
+
+    pthread_mutex_lock(&f->mutex);
+    bool running = !f->stop;
+    f->stop = true;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+
+    if (running)
+        pthread_join(f->thread, NULL);
+}
+
+void yamux_flusher_free(struct yamux_flusher* f)
+{
+    if (!f)
+        return;
+
+    pthread_cond_destroy (&f->cond );
+    pthread_mutex_destroy(&f->mutex);
+
+    free(f);
+}
+
+// NULL also if the stream never had cold state
+static struct yamux_messages* get_messages(struct yamux_stream* stream)
+{
+    struct yamux_stream_cold* c = stream ? atomic_load(&stream->cold) : NULL;
+    return c ? c->messages : NULL;
+}
+
+static void fail(struct yamux_stream* stream)
+{
+    struct yamux_messages* m = get_messages(stream);
+
+    free(m->part);
+    m->part = NULL;
+
+    yamux_stream_reset(stream);
+}
+
+// the stream's read_fn
+static void on_read(struct yamux_stream* stream, uint32_t length, void* data)
+{
+    struct yamux_messages* m = get_messages(stream);
+
+    const char* p    = (const char*)data;
+    uint32_t    left = length;
+
+    // message may free the stream, and m with it
+    bool gone = false;
+    m->gone = &gone;
+
+    // reset for an oversized message, the rest is dropped
+    if (yamux_stream_get_state(stream) == yamux_stream_closed)
+        left = 0;
+
+    while (left)
+    {
+        // the rest of a message spanning payloads
+        if (m->part)
+        {
+            uint32_t n = m->part_len - m->part_off;
+            if (n > left)
+                n = left;
+
+            memcpy(m->part + m->part_off, p, n);
+            m->part_off += n;
+            p += n; left -= n;
+
+            if (m->part_off == m->part_len)
+            {
+                m->message(stream, m->part_len, m->part);
+                if (gone)
+                    return;
+
+                free(m->part);
+                m->part = NULL;
+            }
+            continue;
+        }
+
+        // the length, which can be split too
+        uint32_t n = 4 - m->head_len;
+        if (n > left)
+            n = left;
+
+        memcpy(m->head + m->head_len, p, n);
+        m->head_len += n;
+        p += n; left -= n;
+
+        if (m->head_len < 4)
+            break;
+        m->head_len = 0;
+
+        const unsigned char* h = (const unsigned char*)m->head;
+        uint32_t len = (uint32_t)h[0] << 24 | (uint32_t)h[1] << 16 | (uint32_t)h[2] << 8 | h[3];
+
+        if (len > YAMUX_MESSAGE_MAX)
+        {
+            fail(stream);
+            break;
+        }
+
+        // all in this payload: handed on in place
+        if (len <= left)
+        {
+            m->message(stream, len, (void*)p);
+            if (gone)
+                return;
+
+            p += len; left -= len;
+            continue;
+        }
+
+        if (!(m->part = (char*)malloc(len)))
+        {
+            fail(stream);
+            break;
+        }
+        m->part_len = len;
+        m->part_off = 0;
+    }
+
+    m->gone = NULL;
+
+    // consumed or copied, either way the peer may send more: the
+    // window the payload took, batched
+    yamux_stream_grant(stream, stream->rx_wire);
+}
+
+int yamux_stream_messages(struct yamux_stream* stream, yamux_message_fn message,
+        uint32_t batch, uint32_t delay_us)
+{
+    if (!stream || !message || (batch && batch < 4))
+        return -EINVAL;
+    if (get_messages(stream))
+        return -EBUSY;
+
+    struct yamux_stream_cold* c = yamux_stream_cold(stream);
+    if (!c)
+        return -ENOMEM;
+
+    if (!batch)
+        batch = DEFAULT_BATCH;
+
+    if (delay_us && !get_flusher(stream->session))
+        return -EAGAIN;
+
+    struct yamux_messages* m = (struct yamux_messages*)malloc(sizeof(struct yamux_messages));
+    char* out = (char*)malloc(batch);
+
+    if (!m || !out)
+    {
+        free(out);
+        free(m);
+        return -ENOMEM;
+    }
+
+    *m = (struct yamux_messages){
+        .next = NULL,
+
+        .stream  = stream,
+        .message = message,
+
+        .out      = out,
+        .out_len  = 0,
+        .batch    = batch,
+        .delay_us = delay_us,
+
+        .due    = 0,
+        .queued = false,
+
+        .gone     = NULL,
+        .head_len = 0,
+        .part     = NULL,
+        .part_len = 0,
+        .part_off = 0
+    };
+
+    pthread_mutex_init(&m->mutex, NULL);
+
+    c->messages     = m;
+    stream->read_fn = on_read;
+
+    return 0;
+}
+
+ssize_t yamux_stream_send_message(struct yamux_stream* stream, uint32_t length, const void* data)
+{
+    struct yamux_messages* m = get_messages(stream);
+    if (!m || (length && !data))
+        return -EINVAL;
+
+    const char head[4] = {
+        (char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length
+    };
+
+    pthread_mutex_lock(&m->mutex);
+
+    ssize_t res = 0;
+
+    // make room, unless it doesn't fit anyway
+    if (m->out_len && (size_t)m->out_len + 4 + length > m->batch)
+        res = write_out(m);
+
+    if (res >= 0 && (size_t)4 + length <= m->batch)
+    {
+        bool first = !m->out_len;
+
+        memcpy(m->out + m->out_len, head, 4);
+        memcpy(m->out + m->out_len + 4, data, length);
+        m->out_len += 4 + length;
+
+        // not even another length fits
+        if (m->batch - m->out_len < 4)
+            res = write_out(m);
+        else if (first && m->delay_us)
+            arm(m);
+    }
+    else if (res >= 0)
+    {
+        // too large to batch: its start fills one frame, the rest
+        // follows as is
+        uint32_t n = m->batch - 4;
+
+        memcpy(m->out, head, 4);
+        memcpy(m->out + 4, data, n);
+        m->out_len = m->batch;
+
+        if ((res = write_out(m)) >= 0)
+            res = write_all(stream, length - n, (char*)data + n);
+    }
+
+    pthread_mutex_unlock(&m->mutex);
+
+    return res < 0 ? res : (ssize_t)length;
+}
+
+ssize_t yamux_stream_flush(struct yamux_stream* stream)
+{
+    struct yamux_messages* m = get_messages(stream);
+    if (!m)
+        return -EINVAL;
+
+    pthread_mutex_lock(&m->mutex);
+    ssize_t res = write_out(m);
+    pthread_mutex_unlock(&m->mutex);
+
+    return res;
+}
+
+void yamux_messages_detach(struct yamux_stream* stream)
+{
+    struct yamux_messages* m = get_messages(stream);
+    if (!m)
+        return;
+
+    struct yamux_flusher* f = atomic_load(&stream->session->flusher);
+
+    if (f)
+    {
+        pthread_mutex_lock(&f->mutex);
+
+        while (f->busy == m)
+            pthread_cond_wait(&f->cond, &f->mutex);
+
+        if (m->queued)
+        {
+            struct yamux_messages** p = &f->first;
+            while (*p != m)
+                p = &(*p)->next;
+            *p = m->next;
+        }
+
+        pthread_mutex_unlock(&f->mutex);
+    }
+
+    atomic_load(&stream->cold)->messages = NULL;
+
+    // freed from a message callback: on_read stops right there
+    if (m->gone)
+        *m->gone = true;
+
+    pthread_mutex_destroy(&m->mutex);
+
+    free(m->part);
+    free(m->out);
+    free(m);
+}
@@ -0,0 +1,194 @@
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+struct yamux_pool* yamux_pool_new(struct yamux_config* config, size_t num_sessions, yamux_pool_connect_fn connect_fn, void* userdata)
+{
+    if (!num_sessions || !connect_fn)
+        return NULL;
+
+    struct yamux_session** sessions =
+        (struct yamux_session**)calloc(num_sessions, sizeof(struct yamux_session*));
+    if (!sessions)
+        return NULL;
+
+    struct yamux_pool* pool = (struct yamux_pool*)malloc(sizeof(struct yamux_pool));
+    if (!pool)
+    {
+        free(sessions);
+        return NULL;
+    }
+
+    *pool = (struct yamux_pool){
+        .config = config,
+
+        .num_sessions = num_sessions,
+        .sessions     = sessions,
+
+        .num_retired = 0,
+        .cap_retired = 0,
+        .retired     = NULL,
+
+        .connect_fn = connect_fn,
+        .setup_fn   = NULL,
+        .retire_fn  = NULL,
+
+        .userdata = userdata
+    };
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0)
+    {
+        free(sessions);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+void yamux_pool_free(struct yamux_pool* pool)
+{
+    if (!pool)
+        return;
+
+    for (size_t i = 0; i < pool->num_sessions; ++i)
+        yamux_session_free(pool->sessions[i]);
+
+    yamux_pool_reap(pool);
+
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool->retired);
+    free(pool->sessions);
+    free(pool);
+}
+
+void yamux_pool_reap(struct yamux_pool* pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->num_retired; ++i)
+        yamux_session_free(pool->retired[i]);
+    pool->num_retired = 0;
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// hands a closed session to the caller, or keeps it until
+// yamux_pool_reap. must hold pool->mutex.
+static int pool_retire(struct yamux_pool* pool, struct yamux_session* old)
+{
+    if (pool->retire_fn)
+    {
+        pool->retire_fn(pool, old);
+        return 0;
+    }
+
+    if (pool->num_retired == pool->cap_retired)
+    {
+        size_t cap = pool->cap_retired ? pool->cap_retired * 2 : pool->num_sessions;
+
+        struct yamux_session** r = (struct yamux_session**)realloc(pool->retired,
+                cap * sizeof(struct yamux_session*));
+        if (!r)
+            return -ENOMEM;
+
+        pool->retired     = r;
+        pool->cap_retired = cap;
+    }
+
+    pool->retired[pool->num_retired++] = old;
+    return 0;
+}
+
+// (re)connects slot i. must hold pool->mutex.
+static struct yamux_session* pool_connect(struct yamux_pool* pool, size_t i)
+{
+    struct yamux_session* old = pool->sessions[i];
+
+    // no room to keep it: stays in its slot, retried next time
+    if (old && pool_retire(pool, old) < 0)
+        return NULL;
+
+    pool->sessions[i] = NULL;
+
+    int sock = pool->connect_fn(pool);
+    if (sock < 0)
+        return NULL;
+
+    struct yamux_session* sess = yamux_session_new(pool->config, sock,
+            yamux_session_client, pool->userdata);
+    if (!sess)
+    {
+        close(sock);
+        return NULL;
+    }
+
+    if (pool->setup_fn)
+        pool->setup_fn(pool, sess);
+
+    return pool->sessions[i] = sess;
+}
+
+// must hold pool->mutex
+static struct yamux_session* pool_pick(struct yamux_pool* pool)
+{
+    struct yamux_session* best = NULL;
+    size_t best_load = SIZE_MAX;
+
+    for (size_t i = 0; i < pool->num_sessions; ++i)
+    {
+        struct yamux_session* s = pool->sessions[i];
+
+        // closed locally or by a Go Away from the peer
+        if (!s || atomic_load(&s->closed))
+            s = pool_connect(pool, i);
+        if (!s)
+            continue;
+
+        size_t load = yamux_session_load(s);
+        if (load < best_load)
+        {
+            best      = s;
+            best_load = load;
+        }
+    }
+
+    return best;
+}
+
+struct yamux_session* yamux_pool_session(struct yamux_pool* pool)
+{
+    if (!pool)
+        return NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    struct yamux_session* sess = pool_pick(pool);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return sess;
+}
+
+struct yamux_stream* yamux_pool_stream_new(struct yamux_pool* pool, void* userdata)
+{
+    if (!pool)
+        return NULL;
+
+    // still holding the mutex, so the session isn't retired meanwhile
+    pthread_mutex_lock(&pool->mutex);
+
+    struct yamux_session* sess = pool_pick(pool);
+    struct yamux_stream*  st   = sess ? yamux_stream_new(sess, 0, userdata) : NULL;
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return st;
+}
+
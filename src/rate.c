@@ -0,0 +1,303 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rate.h"
+#include "session.h"
+#include "stream.h"
+
+#define NSEC 1000000000ull
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * NSEC + (uint64_t)t.tv_nsec;
+}
+
+void yamux_rate_init(struct yamux_rate* rate, uint64_t bytes_per_sec, uint64_t burst)
+{
+    atomic_init(&rate->rate , 0);
+    atomic_init(&rate->burst, 0);
+    atomic_init(&rate->tat  , 0);
+
+    yamux_rate_set(rate, bytes_per_sec, burst);
+}
+
+void yamux_rate_set(struct yamux_rate* rate, uint64_t bytes_per_sec, uint64_t burst)
+{
+    if (!rate)
+        return;
+
+    if (!burst)
+        burst = bytes_per_sec / 10 ? bytes_per_sec / 10 : 1;
+
+    // keeps burst * NSEC in range
+    if (burst > UINT32_MAX)
+        burst = UINT32_MAX;
+
+    atomic_store(&rate->burst, burst);
+    atomic_store(&rate->rate , bytes_per_sec);
+}
+
+uint32_t yamux_rate_chunk(struct yamux_rate* rate)
+{
+    if (!rate || !atomic_load(&rate->rate))
+        return UINT32_MAX;
+
+    return (uint32_t)atomic_load(&rate->burst);
+}
+
+uint64_t yamux_rate_take(struct yamux_rate* rate, uint64_t length)
+{
+    uint64_t bps = rate ? atomic_load(&rate->rate) : 0;
+    if (!bps)
+        return 0;
+
+    uint64_t now = now_ns();
+    uint64_t inc = length * NSEC / bps;
+    uint64_t tau = atomic_load(&rate->burst) * NSEC / bps;
+
+    // an idle bucket starts over from now, which is what refills it
+    uint64_t tat = atomic_load(&rate->tat), next;
+    do
+        next = (tat > now ? tat : now) + inc;
+    while (!atomic_compare_exchange_weak(&rate->tat, &tat, next));
+
+    // up to a burst may be sent ahead of time
+    return next - now > tau ? next - now - tau : 0;
+}
+
+uint64_t yamux_rate_delay(struct yamux_rate* rate, uint64_t length)
+{
+    uint64_t bps = rate ? atomic_load(&rate->rate) : 0;
+    if (!bps)
+        return 0;
+
+    uint64_t now = now_ns();
+    uint64_t tau = atomic_load(&rate->burst) * NSEC / bps;
+    uint64_t tat = atomic_load(&rate->tat);
+
+    uint64_t next = (tat > now ? tat : now) + length * NSEC / bps;
+
+    return next - now > tau ? next - now - tau : 0;
+}
+
+void yamux_rate_refund(struct yamux_rate* rate, uint64_t length)
+{
+    uint64_t bps = rate ? atomic_load(&rate->rate) : 0;
+    if (!bps)
+        return;
+
+    uint64_t inc = length * NSEC / bps;
+
+    // an idle bucket can't get fuller than it is anyway
+    uint64_t tat = atomic_load(&rate->tat), prev;
+    do
+        prev = tat > inc ? tat - inc : 0;
+    while (!atomic_compare_exchange_weak(&rate->tat, &tat, prev));
+}
+
+void yamux_rate_sleep(uint64_t ns)
+{
+    struct timespec t = { .tv_sec = (time_t)(ns / NSEC), .tv_nsec = (long)(ns % NSEC) };
+
+    while (nanosleep(&t, &t) < 0 && errno == EINTR)
+        ;
+}
+
+// only streams with cold state are ever queued
+static struct yamux_stream_cold* cold(struct yamux_stream* stream)
+{
+    return atomic_load(&stream->cold);
+}
+
+static void* granter_main(void* arg)
+{
+    struct yamux_granter* g = (struct yamux_granter*)arg;
+
+    pthread_mutex_lock(&g->mutex);
+
+    while (!g->stop)
+    {
+        struct yamux_stream* next = NULL;
+
+        for (struct yamux_stream* st = g->first; st; st = cold(st)->grant_next)
+            if (!next || cold(st)->grant_due < cold(next)->grant_due)
+                next = st;
+
+        if (!next)
+        {
+            pthread_cond_wait(&g->cond, &g->mutex);
+            continue;
+        }
+
+        uint64_t due = cold(next)->grant_due;
+
+        if (due > now_ns())
+        {
+            struct timespec ts = {
+                .tv_sec  = (time_t)(due / NSEC),
+                .tv_nsec = (long  )(due % NSEC)
+            };
+            pthread_cond_timedwait(&g->cond, &g->mutex, &ts);
+            continue;
+        }
+
+        struct yamux_stream** p = &g->first;
+        while (*p != next)
+            p = &cold(*p)->grant_next;
+        *p = cold(next)->grant_next;
+
+        cold(next)->grant_queued = false;
+        g->busy = next;
+
+        // may queue the stream again
+        pthread_mutex_unlock(&g->mutex);
+        yamux_stream_grant(next, 0);
+        pthread_mutex_lock(&g->mutex);
+
+        g->busy = NULL;
+        pthread_cond_broadcast(&g->cond);
+    }
+
+    pthread_mutex_unlock(&g->mutex);
+
+    return NULL;
+}
+
+static struct yamux_granter* granter_new(void)
+{
+    struct yamux_granter* g = (struct yamux_granter*)malloc(sizeof(struct yamux_granter));
+    if (!g)
+        return NULL;
+
+    *g = (struct yamux_granter){
+        .first = NULL,
+        .busy  = NULL,
+        .stop  = false
+    };
+
+    // deadlines are monotonic
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init (&g->cond , &attr);
+
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&g->thread, NULL, granter_main, g) != 0)
+    {
+        g->stop = true; // no thread to join
+        yamux_granter_free(g);
+        return NULL;
+    }
+
+    return g;
+}
+
+// the session's granter, started when it's first needed
+static struct yamux_granter* get_granter(struct yamux_session* session)
+{
+    struct yamux_granter* g = atomic_load(&session->granter);
+    if (g)
+        return g;
+
+    if (!(g = granter_new()))
+        return NULL;
+
+    struct yamux_granter* other = NULL;
+    if (!atomic_compare_exchange_strong(&session->granter, &other, g))
+    {
+        yamux_granter_stop(g);
+        yamux_granter_free(g);
+        return other;
+    }
+
+    return g;
+}
+
+int yamux_granter_schedule(struct yamux_stream* stream, uint64_t ns)
+{
+    struct yamux_stream_cold* c = yamux_stream_cold(stream);
+    if (!c)
+        return -ENOMEM;
+
+    struct yamux_granter* g = get_granter(stream->session);
+    if (!g)
+        return -EAGAIN;
+
+    uint64_t due = now_ns() + ns;
+
+    pthread_mutex_lock(&g->mutex);
+
+    if (!c->grant_queued)
+    {
+        c->grant_due    = due;
+        c->grant_queued = true;
+        c->grant_next   = g->first;
+        g->first        = stream;
+    }
+    else if (due < c->grant_due)
+        c->grant_due = due;
+
+    pthread_cond_signal(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+
+    return 0;
+}
+
+void yamux_granter_detach(struct yamux_stream* stream)
+{
+    struct yamux_granter*     g = atomic_load(&stream->session->granter);
+    struct yamux_stream_cold* c = cold(stream);
+    if (!g || !c)
+        return;
+
+    pthread_mutex_lock(&g->mutex);
+
+    while (g->busy == stream)
+        pthread_cond_wait(&g->cond, &g->mutex);
+
+    if (c->grant_queued)
+    {
+        struct yamux_stream** p = &g->first;
+        while (*p != stream)
+            p = &cold(*p)->grant_next;
+        *p = c->grant_next;
+
+        c->grant_queued = false;
+    }
+
+    pthread_mutex_unlock(&g->mutex);
+}
+
+void yamux_granter_stop(struct yamux_granter* g)
+{
+    if (!g)
+        return;
+
+    pthread_mutex_lock(&g->mutex);
+    bool running = !g->stop;
+    g->stop = true;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+
+    if (running)
+        pthread_join(g->thread, NULL);
+}
+
+void yamux_granter_free(struct yamux_granter* g)
+{
+    if (!g)
+        return;
+
+    pthread_cond_destroy (&g->cond );
+    pthread_mutex_destroy(&g->mutex);
+
+    free(g);
+}
@@ -0,0 +1,360 @@
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "yamux.h"
+
+// Feeds a capture (see capture.h) through yamux_session_read over a
+// socketpair, as fast as possible, and reports throughput and heap
+// allocations per frame.
+//
+// The frames are adjusted so they make sense to a fresh session: the
+// first frame of each stream gets a SYN (and loses an ACK), frames for
+// streams that were already closed are dropped, and so is Go Away.
+//
+// usage: yreplay <capture file> [repetitions]
+
+// linked with --wrap so the library's allocations are counted as well
+void* __real_malloc (size_t size);
+void* __real_calloc (size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+static atomic_size_t allocs;
+
+void* __wrap_malloc(size_t size)
+{
+    atomic_fetch_add(&allocs, 1);
+    return __real_malloc(size);
+}
+void* __wrap_calloc(size_t n, size_t size)
+{
+    atomic_fetch_add(&allocs, 1);
+    return __real_calloc(n, size);
+}
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    atomic_fetch_add(&allocs, 1);
+    return __real_realloc(ptr, size);
+}
+
+struct wire
+{
+    char*  data;
+    size_t size;
+    size_t cap ;
+
+    size_t frames;
+    size_t payload;
+};
+
+static int wire_put(struct wire* w, const void* data, size_t size)
+{
+    if (w->size + size > w->cap)
+    {
+        size_t cap = w->cap ? w->cap * 2 : 0x10000;
+        while (cap < w->size + size)
+            cap *= 2;
+
+        char* d = (char*)realloc(w->data, cap);
+        if (!d)
+            return -ENOMEM;
+
+        w->data = d;
+        w->cap  = cap;
+    }
+
+    if (data)
+        memcpy(w->data + w->size, data, size);
+    else
+        memset(w->data + w->size, 0, size);
+
+    w->size += size;
+    return 0;
+}
+
+// stream ids seen so far, and whether they were closed
+struct seen
+{
+    yamux_streamid* ids;
+    bool*           closed;
+    size_t          num;
+    size_t          cap;
+};
+
+static ssize_t seen_find(struct seen* s, yamux_streamid id)
+{
+    for (size_t i = s->num; i-- > 0; )
+        if (s->ids[i] == id)
+            return (ssize_t)i;
+
+    return -1;
+}
+static ssize_t seen_add(struct seen* s, yamux_streamid id)
+{
+    if (s->num == s->cap)
+    {
+        s->cap    = s->cap ? s->cap * 2 : 0x100;
+        s->ids    = (yamux_streamid*)realloc(s->ids, s->cap * sizeof(yamux_streamid));
+        s->closed = (bool*)realloc(s->closed, s->cap * sizeof(bool));
+        if (!s->ids || !s->closed)
+            return -ENOMEM;
+    }
+
+    s->ids   [s->num] = id;
+    s->closed[s->num] = false;
+    return (ssize_t)s->num++;
+}
+
+static int load(FILE* file, struct wire* w, int* type)
+{
+    uint8_t header[12];
+    if (fread(header, sizeof(header), 1, file) != 1 ||
+            memcmp(header, YAMUX_CAPTURE_MAGIC, 8) ||
+            header[8] != YAMUX_CAPTURE_VERSION)
+        return -EINVAL;
+
+    *type = header[9];
+    bool payloads = header[10] & YAMUX_CAPTURE_PAYLOADS;
+
+    struct seen seen = { 0 };
+    char buf[0x10000];
+
+    for (;;)
+    {
+        // inter-arrival time, unused when replaying at full speed
+        int c;
+        do
+            c = fgetc(file);
+        while (c != EOF && (c & 0x80));
+        if (c == EOF)
+            break;
+
+        struct yamux_frame f;
+        if (fread(&f, sizeof(f), 1, file) != 1)
+            return -EINVAL;
+
+        struct yamux_frame h = f;
+        decode_frame(&h);
+
+        uint32_t plen = (h.type == yamux_frame_data) ? h.length : 0;
+        bool keep = h.type != yamux_frame_go_away;
+
+        if (keep && h.streamid)
+        {
+            ssize_t i = seen_find(&seen, h.streamid);
+
+            if (i < 0)
+            {
+                i = seen_add(&seen, h.streamid);
+                if (i < 0)
+                    return (int)i;
+
+                h.flags = (uint16_t)((h.flags | yamux_frame_syn) & ~yamux_frame_ack);
+            }
+            else if (seen.closed[i])
+                keep = false;
+            else
+                h.flags &= (uint16_t)~(yamux_frame_syn | yamux_frame_ack);
+
+            if (keep && (h.flags & (yamux_frame_fin | yamux_frame_rst)))
+                seen.closed[i] = true;
+        }
+
+        if (keep)
+        {
+            f = h;
+            encode_frame(&f);
+
+            if (wire_put(w, &f, sizeof(f)))
+                return -ENOMEM;
+
+            w->frames++;
+            w->payload += plen;
+        }
+
+        for (uint32_t left = plen; left; )
+        {
+            uint32_t n = left < sizeof(buf) ? left : sizeof(buf);
+
+            if (payloads && fread(buf, n, 1, file) != 1)
+                return -EINVAL;
+            if (keep && wire_put(w, payloads ? buf : NULL, n))
+                return -ENOMEM;
+
+            left -= n;
+        }
+    }
+
+    free(seen.ids);
+    free(seen.closed);
+    return 0;
+}
+
+struct feed
+{
+    int sock;
+    const struct wire* wire;
+    int reps;
+};
+
+static void* feed(void* arg)
+{
+    struct feed* fd = (struct feed*)arg;
+
+    for (int r = 0; r < fd->reps; ++r)
+        for (size_t off = 0; off < fd->wire->size; )
+        {
+            ssize_t n = send(fd->sock, fd->wire->data + off, fd->wire->size - off, 0);
+            if (n <= 0)
+                return NULL;
+
+            off += (size_t)n;
+        }
+
+    shutdown(fd->sock, SHUT_WR);
+    return NULL;
+}
+
+// pongs, window updates etc. the session sends back
+static void* drain(void* arg)
+{
+    int sock = *(int*)arg;
+    char buf[0x10000];
+
+    while (recv(sock, buf, sizeof(buf), 0) > 0)
+        ;
+
+    return NULL;
+}
+
+static void on_read(struct yamux_stream* stream, uint32_t data_len, void* data)
+{
+    (void)data_len; (void)data;
+
+    // the peer in the capture only sent more once it got window back
+    yamux_stream_grant(stream, stream->rx_wire);
+}
+static void on_new(struct yamux_session* session, struct yamux_stream* stream)
+{
+    (void)session;
+    stream->read_fn = on_read;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <capture file> [repetitions]\n", argv[0]);
+        return 1;
+    }
+
+    // the feeder may still be sending when a replay stops early
+    signal(SIGPIPE, SIG_IGN);
+
+    int reps = (argc > 2) ? atoi(argv[2]) : 1;
+    if (reps < 1)
+        reps = 1;
+
+    FILE* file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        printf("can't open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    struct wire w = { 0 };
+    int type;
+    int e = load(file, &w, &type);
+    fclose(file);
+    if (e)
+    {
+        printf("can't load %s: %s\n", argv[1], strerror(-e));
+        return 1;
+    }
+
+    if (!w.frames)
+    {
+        printf("%s has no frames to replay\n", argv[1]);
+        return 1;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        printf("socketpair() failed with %i\n", errno);
+        return 1;
+    }
+
+    // every stream id is opened again on each repetition, so the stream
+    // table has to hold all of them
+    struct yamux_config cfg = YAMUX_DEFAULT_CONFIG;
+    cfg.accept_backlog = 0x100000;
+
+    struct yamux_session* sess = yamux_session_new(&cfg, sv[0],
+            (enum yamux_session_type)type, NULL);
+    if (!sess)
+    {
+        printf("yamux_session_new() failed\n");
+        return 1;
+    }
+    sess->new_stream_fn = on_new;
+
+    struct feed fd = { .sock = sv[1], .wire = &w, .reps = reps };
+    pthread_t feeder, drainer;
+    pthread_create(&feeder , NULL, feed , &fd);
+    pthread_create(&drainer, NULL, drain, &sv[1]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t a0 = atomic_load(&allocs);
+
+    size_t frames = 0;
+    ssize_t r;
+    while ((r = yamux_session_read(sess)) >= 0)
+    {
+        frames++;
+
+        // streams are opened again on the next repetition
+        if (frames % w.frames == 0)
+            for (size_t i = 0; i < sess->cap_streams; ++i)
+                if (sess->streams.streams[i])
+                    yamux_stream_free(sess->streams.streams[i]);
+    }
+
+    size_t a1 = atomic_load(&allocs);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double dt = (double)(end.tv_sec - start.tv_sec)
+        + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    size_t expect = w.frames * (size_t)reps;
+
+    if (frames != expect)
+        printf("stopped after %zu of %zu frames (%zi)\n", frames, expect, r);
+
+    printf("frames       %zu\n"        , frames);
+    printf("payload      %zu bytes\n"  , w.payload * (size_t)reps);
+    printf("time         %.6f s\n"     , dt);
+    printf("frames/s     %.0f\n"       , (double)frames / dt);
+    printf("bytes/s      %.0f\n"       , (double)(w.size * (size_t)reps) / dt);
+    printf("allocs/frame %.3f\n"       , frames ? (double)(a1 - a0) / (double)frames : 0.0);
+
+    shutdown(sv[0], SHUT_RDWR);
+    pthread_join(feeder , NULL);
+    pthread_join(drainer, NULL);
+
+    yamux_session_free(sess);
+    close(sv[0]);
+    close(sv[1]);
+    free(w.data);
+
+    return frames == expect ? 0 : 1;
+}
+
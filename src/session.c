@@ -2,15 +2,50 @@
 #include <memory.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "session.h"
 #include "stream.h"
 
 static struct yamux_config dcfg = YAMUX_DEFAULT_CONFIG;
 
+// unsent socket bytes that count as one more stream in yamux_session_load
+#define LOAD_OUTQ_UNIT (0x10*0x400)
+
+// failures are ignored: the socket may not be TCP, and raising the busy
+// poll time above net.core.busy_read needs CAP_NET_ADMIN
+static void setup_socket(int sock, struct yamux_config* config)
+{
+    if (config->nodelay)
+    {
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (config->busy_poll)
+    {
+#ifdef SO_BUSY_POLL
+        int us = (int)config->busy_poll;
+        setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+#endif
+    }
+}
+
 struct yamux_session* yamux_session_new(struct yamux_config* config, int sock, enum yamux_session_type type, void* userdata)
 {
     if (!sock)
@@ -21,17 +56,42 @@ struct yamux_session* yamux_session_new(struct yamux_config* config, int sock, e
 
     size_t ab = config->accept_backlog;
 
-    struct yamux_session_stream* streams =
-        (struct yamux_session_stream*)malloc(sizeof(struct yamux_session_stream) * ab);
+    // a power of two, at most half full
+    size_t ni = 1;
+    while (ni < 2 * ab)
+        ni <<= 1;
+
+    struct yamux_stream_table streams = (struct yamux_stream_table){
+        .ids     = calloc(ab, sizeof(*streams.ids    )),
+        .states  = malloc(ab * sizeof(*streams.states )),
+        .windows = malloc(ab * sizeof(*streams.windows)),
+        .streams = (struct yamux_stream**)calloc(ab, sizeof(struct yamux_stream*)),
+
+        .index      = calloc(ni, sizeof(*streams.index)),
+        .index_mask = ni - 1
+    };
 
-    for (size_t i = 0; i < ab; ++i)
-        streams[i].alive = false;
+    struct yamux_session* sess = (struct yamux_session*)malloc(sizeof(struct yamux_session));
+
+    if (!sess || !streams.ids || !streams.states || !streams.windows || !streams.streams ||
+            !streams.index)
+    {
+        free(streams.ids    );
+        free(streams.states );
+        free(streams.windows);
+        free(streams.streams);
+        free(streams.index  );
+        free(sess);
+        return NULL;
+    }
 
     struct yamux_session s = (struct yamux_session){
         .config = config,
         .type   = type  ,
         .sock   = sock  ,
 
+        .event_fd = -1,
+
         .closed = false,
 
         .nextid = 1 + (type == yamux_session_server),
@@ -40,6 +100,23 @@ struct yamux_session* yamux_session_new(struct yamux_config* config, int sock, e
         .cap_streams = 0,
         .streams     = streams,
 
+        .stalled_streams = 0,
+
+        .capture = NULL,
+
+        .watchdog = NULL,
+
+        .in_buf = NULL,
+        .in_len = 0,
+        .in_off = 0,
+        .in_cap = 0,
+
+        .nonblocking = false,
+        .out_buf     = NULL,
+        .out_len     = 0,
+        .out_off     = 0,
+        .out_cap     = 0,
+
         .since_ping = {.tv_sec = 0, .tv_nsec = 0 },
 
         .get_str_ud_fn = NULL,
@@ -47,14 +124,43 @@ struct yamux_session* yamux_session_new(struct yamux_config* config, int sock, e
         .pong_fn       = NULL,
         .go_away_fn    = NULL,
         .free_fn       = NULL,
+        .notify_fn     = NULL,
+        .stall_fn      = NULL,
 
         .userdata = userdata
     };
 
-    struct yamux_session* sess = (struct yamux_session*)malloc(sizeof(struct yamux_session));
-
     *sess = s;
 
+    yamux_budget_init(&sess->memory, config->memory_budget);
+    yamux_event_init (&sess->poll_event);
+
+    pthread_mutex_init(&sess->lock     , NULL);
+    pthread_mutex_init(&sess->send_lock, NULL);
+
+    // without the ring there are just no spares
+    yamux_spares_init(&sess->spares, config->spare_streams);
+    atomic_init(&sess->refiller, NULL);
+    atomic_init(&sess->orphans , NULL);
+    atomic_init(&sess->released, NULL);
+
+    yamux_rate_init(&sess->send_rate, 0, 0);
+    yamux_rate_init(&sess->recv_rate, 0, 0);
+
+    atomic_init(&sess->relay  , NULL);
+    atomic_init(&sess->flusher, NULL);
+    atomic_init(&sess->granter, NULL);
+
+    yamux_latency_init(&sess->latency);
+
+    // without it slow callbacks are reported once they return
+    if (config->stall_threshold)
+        sess->watchdog = yamux_watchdog_new(sess);
+
+    setup_socket(sock, config);
+
+    yamux_zerocopy_init(&sess->zerocopy, sess, sock, config->zerocopy_threshold != 0);
+
     return sess;
 }
 void yamux_session_free(struct yamux_session* session)
@@ -62,25 +168,77 @@ void yamux_session_free(struct yamux_session* session)
     if (!session)
         return;
 
-    if (!session->closed)
-        yamux_session_close(session, yamux_error_normal);
+    yamux_session_close(session, yamux_error_normal);
 
     if (session->free_fn)
+    {
+        uint64_t t = yamux_callback_begin(session, yamux_callback_free, 0);
         session->free_fn(session);
+        yamux_callback_end(session, yamux_callback_free, 0, t);
+    }
+
+    // before the streams, it might be in a done callback
+    yamux_relay_stop(session->relay);
+    yamux_flusher_stop(session->flusher);
+    yamux_granter_stop(session->granter);
+    yamux_refiller_stop(session->refiller);
 
     for (size_t i = 0; i < session->cap_streams; ++i)
-        if (session->streams[i].alive)
-            yamux_stream_free(session->streams[i].stream);
+        if (atomic_load(&session->streams.ids[i]))
+            yamux_stream_free(session->streams.streams[i]);
+
+    yamux_relay_free(session->relay);
+    yamux_flusher_free(session->flusher);
+    yamux_granter_free(session->granter);
+    yamux_refiller_free(session->refiller);
+
+    if (session->event_fd >= 0)
+        close(session->event_fd);
+
+    // the kernel may still be sending from the callers' buffers
+    yamux_zerocopy_drain  (&session->zerocopy, session->sock);
+    yamux_zerocopy_destroy(&session->zerocopy);
+
+    // after the last callback
+    yamux_watchdog_free(session->watchdog);
+
+    // the streams in it were freed with the others
+    yamux_spares_destroy(&session->spares);
+    pthread_mutex_destroy(&session->lock     );
+    pthread_mutex_destroy(&session->send_lock);
+
+    free(session->in_buf);
+    free(session->out_buf);
+
+    free(session->streams.ids    );
+    free(session->streams.states );
+    free(session->streams.windows);
+    free(session->streams.streams);
+    free(session->streams.index  );
+    free(session                 );
+}
 
-    free(session->streams);
-    free(session         );
+int yamux_session_eventfd(struct yamux_session* session)
+{
+    if (!session)
+        return -EINVAL;
+
+#ifdef __linux__
+    if (session->event_fd < 0)
+        session->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    return session->event_fd < 0 ? -errno : session->event_fd;
+#else
+    return -ENOTSUP;
+#endif
 }
 
 ssize_t yamux_session_close(struct yamux_session* session, enum yamux_error err)
 {
     if (!session)
         return -EINVAL;
-    if (session->closed)
+    // only one Go Away, whichever thread gets here first
+    if (atomic_exchange(&session->closed, true))
         return 0;
 
     struct yamux_frame f = (struct yamux_frame){
@@ -91,10 +249,8 @@ ssize_t yamux_session_close(struct yamux_session* session, enum yamux_error err)
         .length   = (uint32_t)err
     };
 
-    session->closed = true;
-
     encode_frame(&f);
-    return send(session->sock, &f, sizeof(struct yamux_frame), 0);
+    return yamux_session_send(session, &f, sizeof(struct yamux_frame));
 }
 
 ssize_t yamux_session_ping(struct yamux_session* session, uint32_t value, bool pong)
@@ -114,7 +270,420 @@ ssize_t yamux_session_ping(struct yamux_session* session, uint32_t value, bool p
         return -EACCES;
 
     encode_frame(&f);
-    return send(session->sock, &f, sizeof(struct yamux_frame), 0);
+    return yamux_session_send(session, &f, sizeof(struct yamux_frame));
+}
+
+// answers a SYN we can't take with a RST, skipping any payload
+static ssize_t refuse_stream(struct yamux_session* session, struct yamux_frame* f)
+{
+    struct yamux_frame rst = (struct yamux_frame){
+        .version  = YAMUX_VERSION,
+        .type     = yamux_frame_window_update,
+        .flags    = yamux_frame_rst,
+        .streamid = f->streamid,
+        .length   = 0
+    };
+
+    if (f->type == yamux_frame_data)
+        for (uint32_t left = f->length; left; )
+        {
+            char buf[0x1000];
+            size_t n = left < sizeof(buf) ? left : sizeof(buf);
+
+            ssize_t r = yamux_session_recv(session, buf, n);
+            if (r != (ssize_t)n)
+                return -1;
+
+            yamux_capture_payload(session->capture, buf, (size_t)r);
+            left -= (uint32_t)r;
+        }
+
+    encode_frame(&rst);
+    return yamux_session_send(session, &rst, sizeof(struct yamux_frame));
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t elapsed_us(const struct timespec* since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // the nanoseconds alone may go backwards
+    int64_t ns = (int64_t)(now.tv_sec - since->tv_sec) * 1000000000
+        + (int64_t)(now.tv_nsec - since->tv_nsec);
+
+    return ns > 0 ? (uint64_t)ns / 1000 : 0;
+}
+
+// spinning only helps if the sender can run meanwhile. asked once, by
+// whichever reader gets here first.
+static bool can_spin(void)
+{
+    static atomic_int cpus;
+
+    int n = atomic_load(&cpus);
+    if (!n)
+    {
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        atomic_store(&cpus, n);
+    }
+
+    return n > 1;
+}
+
+// sends the leftovers, under send_lock. 1 once they're gone.
+static int flush_out(struct yamux_session* session)
+{
+    while (session->out_off < session->out_len)
+    {
+        ssize_t r = send(session->sock, session->out_buf + session->out_off,
+                session->out_len - session->out_off, MSG_DONTWAIT);
+
+        if (r > 0)
+            session->out_off += (size_t)r;
+        else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        else if (r < 0 && errno == EINTR)
+            continue;
+        else
+            return -1;
+    }
+
+    session->out_off = session->out_len = 0;
+    return 1;
+}
+
+static int keep_out(struct yamux_session* session, const char* buf, size_t length)
+{
+    size_t need = session->out_len + length;
+
+    if (session->out_cap < need)
+    {
+        char* b = (char*)realloc(session->out_buf, need);
+        if (!b)
+            return -ENOMEM;
+
+        session->out_buf = b;
+        session->out_cap = need;
+    }
+
+    memcpy(session->out_buf + session->out_len, buf, length);
+    session->out_len += length;
+
+    return 0;
+}
+
+// all of the frame, under send_lock: what the socket doesn't take now
+// waits behind what's left already
+static ssize_t send_nonblocking(struct yamux_session* session, const char* buf, size_t length)
+{
+    int left = flush_out(session);
+    if (left < 0)
+        return -1;
+
+    size_t sent = 0;
+
+    while (left && sent < length)
+    {
+        ssize_t r = send(session->sock, buf + sent, length - sent, MSG_DONTWAIT);
+
+        if (r > 0)
+            sent += (size_t)r;
+        else if (!r || errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        else if (errno == EINTR)
+            continue;
+        else
+        {
+            // the peer can't find the next frame anymore
+            if (sent)
+                atomic_store(&session->closed, true);
+            return -1;
+        }
+    }
+
+    if (sent < length && keep_out(session, buf + sent, length - sent) < 0)
+    {
+        if (sent)
+            atomic_store(&session->closed, true);
+        return -ENOMEM;
+    }
+
+    return (ssize_t)length;
+}
+
+ssize_t yamux_session_send(struct yamux_session* session, const void* buf, size_t length)
+{
+    pthread_mutex_lock(&session->send_lock);
+    ssize_t res = session->nonblocking
+        ? send_nonblocking(session, (const char*)buf, length)
+        : send(session->sock, buf, length, 0);
+    pthread_mutex_unlock(&session->send_lock);
+
+    return res;
+}
+
+int yamux_session_set_nonblocking(struct yamux_session* session)
+{
+    if (!session)
+        return -EINVAL;
+
+    int flags = fcntl(session->sock, F_GETFL);
+    if (flags < 0 || fcntl(session->sock, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -errno;
+
+    pthread_mutex_lock(&session->send_lock);
+    session->nonblocking = true;
+    pthread_mutex_unlock(&session->send_lock);
+
+    return 0;
+}
+
+bool yamux_session_writable(struct yamux_session* session)
+{
+    if (!session->nonblocking)
+        return true;
+
+    pthread_mutex_lock(&session->send_lock);
+    bool empty = session->out_off == session->out_len;
+    pthread_mutex_unlock(&session->send_lock);
+
+    return empty;
+}
+
+int yamux_session_flush(struct yamux_session* session)
+{
+    if (!session)
+        return -1;
+
+    pthread_mutex_lock(&session->send_lock);
+    int res = flush_out(session);
+    pthread_mutex_unlock(&session->send_lock);
+
+    return res;
+}
+
+bool yamux_session_is_closed(struct yamux_session* session)
+{
+    return !session || atomic_load(&session->closed);
+}
+
+int yamux_session_prefetch(struct yamux_session* session)
+{
+    for (;;)
+    {
+        size_t have = session->in_len - session->in_off;
+        size_t want = sizeof(struct yamux_frame);
+
+        // only DATA frames have a payload, which no window lets grow
+        // past a full one
+        if (have >= want)
+        {
+            struct yamux_frame f;
+            memcpy(&f, session->in_buf + session->in_off, sizeof(f));
+            decode_frame(&f);
+
+            if (f.type == yamux_frame_data)
+            {
+                if (f.length > YAMUX_DEFAULT_WINDOW)
+                    return -EPROTO;
+                want += f.length;
+            }
+        }
+
+        if (have >= want)
+            return 1;
+
+        // make room for the rest of the frame at the end
+        if (session->in_off)
+        {
+            memmove(session->in_buf, session->in_buf + session->in_off, have);
+            session->in_off = 0;
+            session->in_len = have;
+        }
+        if (session->in_cap < want)
+        {
+            char* b = (char*)realloc(session->in_buf, want);
+            if (!b)
+                return -ENOMEM;
+
+            session->in_buf = b;
+            session->in_cap = want;
+        }
+
+        ssize_t r = recv(session->sock, session->in_buf + session->in_len,
+                want - have, MSG_DONTWAIT);
+
+        if (r > 0)
+            session->in_len += (size_t)r;
+        else if (r == 0)
+            return -1;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        else if (errno != EINTR)
+            return -1;
+    }
+}
+
+ssize_t yamux_session_recv(struct yamux_session* session, void* buf_, size_t length)
+{
+    char* buf = (char*)buf_;
+    size_t got = 0;
+
+    if (session->in_len > session->in_off)
+    {
+        got = session->in_len - session->in_off;
+        if (got > length)
+            got = length;
+
+        memcpy(buf, session->in_buf + session->in_off, got);
+        session->in_off += got;
+
+        if (session->in_off == session->in_len)
+            session->in_off = session->in_len = 0;
+
+        if (got == length)
+            return (ssize_t)got;
+    }
+
+    uint32_t budget = session->config->busy_poll;
+    bool spin = budget && can_spin();
+
+    struct timespec start;
+    if (spin)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (got < length)
+    {
+        ssize_t r = recv(session->sock, buf + got, length - got,
+                spin ? MSG_DONTWAIT : MSG_WAITALL);
+
+        if (r > 0)
+            got += (size_t)r;
+        else if (r == 0)
+            break;
+        else if (errno == EINTR)
+            continue;
+        else if (spin && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            // out of budget: block for the rest
+            if (elapsed_us(&start) >= budget)
+                spin = false;
+            else
+                cpu_relax();
+        }
+        else
+            return got ? (ssize_t)got : -1;
+    }
+
+    return (ssize_t)got;
+}
+
+int yamux_session_reap_zerocopy(struct yamux_session* session)
+{
+    if (!session)
+        return -EINVAL;
+
+    return yamux_zerocopy_reap(&session->zerocopy, session->sock);
+}
+
+struct yamux_stream* yamux_session_take_stream(struct yamux_session* session, void* userdata)
+{
+    if (!session || session->closed)
+        return NULL;
+
+    struct yamux_stream* st;
+
+    atomic_store(&session->spares.paused, false);
+
+    while ((st = yamux_spares_pop(&session->spares)))
+    {
+        enum yamux_stream_state state = yamux_stream_get_state(st);
+        atomic_store(&atomic_load(&st->cold)->spare, false);
+
+        if (state == yamux_stream_syn_sent || state == yamux_stream_est)
+        {
+            st->userdata = userdata;
+            yamux_spares_kick(session);
+            return st;
+        }
+
+        // refused or closed by the peer while it waited. the reader may
+        // still be handling the RST or FIN, so it frees it.
+        yamux_spares_orphan(st);
+    }
+
+    yamux_spares_kick(session);
+
+    return yamux_stream_new(session, 0, userdata);
+}
+
+void yamux_session_index_add(struct yamux_session* session, uint32_t slot)
+{
+    struct yamux_stream_table* t = &session->streams;
+    size_t i = (atomic_load(&t->ids[slot]) >> 1) & t->index_mask;
+
+    while (atomic_load(&t->index[i]))
+        i = (i + 1) & t->index_mask;
+
+    atomic_store(&t->index[i], slot + 1);
+}
+
+void yamux_session_index_del(struct yamux_session* session, uint32_t slot)
+{
+    struct yamux_stream_table* t = &session->streams;
+    size_t mask = t->index_mask;
+    size_t i = (atomic_load(&t->ids[slot]) >> 1) & mask;
+
+    while (atomic_load(&t->index[i]) != slot + 1)
+        i = (i + 1) & mask;
+
+    // shift later entries of the run back into the gap, so lookups
+    // can stop at the first empty entry
+    for (size_t j = (i + 1) & mask; ; j = (j + 1) & mask)
+    {
+        uint32_t e = atomic_load(&t->index[j]);
+        if (!e)
+            break;
+
+        size_t home = (atomic_load(&t->ids[e - 1]) >> 1) & mask;
+
+        // j's home lies cyclically in (i, j]: it has to stay
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        atomic_store(&t->index[i], e);
+        i = j;
+    }
+
+    atomic_store(&t->index[i], 0);
+}
+
+// the slot of the open stream with that id, or -1
+static ssize_t find_slot(struct yamux_session* session, yamux_streamid id)
+{
+    struct yamux_stream_table* t = &session->streams;
+
+    for (size_t i = (id >> 1) & t->index_mask; ; i = (i + 1) & t->index_mask)
+    {
+        uint32_t e = atomic_load(&t->index[i]);
+        if (!e)
+            return -1;
+
+        // a closed stream that wasn't freed yet may share the id. the
+        // slot can be freed and taken again meanwhile, its id tells.
+        if (atomic_load(&t->ids[e - 1]) == id &&
+                atomic_load(&t->states[e - 1]) != yamux_stream_closed)
+            return (ssize_t)(e - 1);
+    }
 }
 
 ssize_t yamux_session_read(struct yamux_session* session)
@@ -122,12 +691,23 @@ ssize_t yamux_session_read(struct yamux_session* session)
     if (!session || session->closed)
         return -EINVAL;
 
+    // between frames no callback of this thread runs
+    if (session->spares.target)
+    {
+        yamux_spares_reclaim(session);
+        yamux_spares_kick(session);
+    }
+
+    // a cheap non-blocking check while zerocopy sends are in flight
+    yamux_zerocopy_reap(&session->zerocopy, session->sock);
+
     struct yamux_frame f;
 
-    ssize_t r = recv(session->sock, &f, sizeof(struct yamux_frame), 0);
+    ssize_t r = yamux_session_recv(session, &f, sizeof(struct yamux_frame));
     if (r != sizeof(struct yamux_frame))
         return -1;
 
+    yamux_capture_frame(session->capture, &f);
     decode_frame(&f);
 
     //printf("v%X got frame %X %X for stream %u with len %u\n", f.version, f.type, f.flags, f.streamid, f.length);
@@ -144,7 +724,11 @@ ssize_t yamux_session_read(struct yamux_session* session)
                     yamux_session_ping(session, f.length, true);
 
                     if (session->ping_fn)
+                    {
+                        uint64_t t = yamux_callback_begin(session, yamux_callback_ping, 0);
                         session->ping_fn(session, f.length);
+                        yamux_callback_end(session, yamux_callback_ping, 0, t);
+                    }
                 }
                 else if ((f.flags & yamux_frame_ack) && session->pong_fn)
                 {
@@ -161,78 +745,126 @@ ssize_t yamux_session_read(struct yamux_session* session)
                     else
                         dt.tv_nsec = now.tv_nsec - last.tv_nsec;
 
+                    uint64_t t = yamux_callback_begin(session, yamux_callback_pong, 0);
                     session->pong_fn(session, f.length, dt);
+                    yamux_callback_end(session, yamux_callback_pong, 0, t);
                 }
                 else
                     return -EPROTO;
                 break;
             case yamux_frame_go_away:
-                session->closed = true;
+                atomic_store(&session->closed, true);
                 if (session->go_away_fn)
+                {
+                    uint64_t t = yamux_callback_begin(session, yamux_callback_go_away, 0);
                     session->go_away_fn(session, (enum yamux_error)f.length);
+                    yamux_callback_end(session, yamux_callback_go_away, 0, t);
+                }
                 break;
             default:
                 return -EPROTO;
         }
     else
     {
-        for (size_t i = 0; i < session->cap_streams; ++i)
+        struct yamux_stream_table* t = &session->streams;
+
+        ssize_t slot = find_slot(session, f.streamid);
+
+        // may have missed an entry being moved by another thread
+        if (slot < 0)
         {
-            struct yamux_session_stream* ss = &session->streams[i];
-            struct yamux_stream* s = ss->stream;
+            pthread_mutex_lock(&session->lock);
+            slot = find_slot(session, f.streamid);
+            pthread_mutex_unlock(&session->lock);
+        }
 
-            if (!ss->alive || s->state == yamux_stream_closed)
-                continue;
+        if (slot >= 0)
+        {
+            size_t i = (size_t)slot;
+            struct yamux_stream* s = t->streams[i];
+            bool fin = false;
 
-            if (s->id == f.streamid)
+            if (f.flags & yamux_frame_rst)
             {
-                if (f.flags & yamux_frame_rst)
-                {
-                    s->state = yamux_stream_closed;
+                // a refused spare stays in the ring until it's taken
+                struct yamux_stream_cold* c = atomic_load(&s->cold);
 
-                    if (s->rst_fn)
-                        s->rst_fn(s);
-                }
-                else if (f.flags & yamux_frame_fin)
-                {
-                    // local stream didn't initiate FIN
-                    if (s->state != yamux_stream_closing)
-                        yamux_stream_close(s);
+                if (t->states[i] == yamux_stream_syn_sent && c && atomic_load(&c->spare))
+                    atomic_store(&session->spares.paused, true);
 
-                    s->state = yamux_stream_closed;
+                t->states[i] = yamux_stream_closed;
+                yamux_stream_wake(s);
 
-                    if (s->fin_fn)
-                        s->fin_fn(s);
-                }
-                else if (f.flags & yamux_frame_ack)
-                {
-                    if (s->state != yamux_stream_syn_sent)
-                        return -EPROTO;
+                yamux_dispatch_event(s, yamux_dispatch_on_rst);
+            }
+            else if (f.flags & yamux_frame_fin)
+            {
+                // local stream didn't initiate FIN
+                if (t->states[i] != yamux_stream_closing)
+                    yamux_stream_close(s);
 
-                    s->state = yamux_stream_est;
-                }
-                else if (f.flags)
+                fin = true;
+            }
+            else if (f.flags & yamux_frame_ack)
+            {
+                if (t->states[i] != yamux_stream_syn_sent)
                     return -EPROTO;
 
-                ssize_t re = yamux_stream_process(s, &f, session->sock);
-                return (re < 0) ? re : (re + r);
+                t->states[i] = yamux_stream_est;
             }
+            else if (f.flags & ~yamux_frame_cmp)
+                return -EPROTO;
+
+            ssize_t re = yamux_stream_process(s, &f, session->sock);
+
+            // after the frame's payload; marks the stream closed once
+            // all earlier callbacks ran
+            if (fin && re >= 0)
+                yamux_dispatch_event(s, yamux_dispatch_on_fin);
+
+            return (re < 0) ? re : (re + r);
         }
 
         // stream doesn't exist yet
         if (f.flags & yamux_frame_syn)
         {
+            // every stream starts with a full window the peer may use,
+            // don't take it on if that doesn't fit in the budget
+            if (yamux_session_headroom(session) < YAMUX_DEFAULT_WINDOW)
+                return refuse_stream(session, &f);
+
             void* ud = NULL;
 
             if (session->get_str_ud_fn)
+            {
+                uint64_t t = yamux_callback_begin(session, yamux_callback_userdata, f.streamid);
                 ud = session->get_str_ud_fn(session, f.streamid);
+                yamux_callback_end(session, yamux_callback_userdata, f.streamid, t);
+            }
 
             struct yamux_stream* st = yamux_stream_new(session, f.streamid, ud);
+            if (!st)
+                return refuse_stream(session, &f);
+
+            // agree to compression before anything can send the ACK. only
+            // a window update offers it, on DATA the bit means compressed.
+            if (f.type == yamux_frame_window_update &&
+                    (f.flags & yamux_frame_cmp) && session->config->compression)
+            {
+                // without cold state the ACK just doesn't agree
+                struct yamux_stream_cold* c = yamux_stream_cold(st);
+                if (c)
+                    atomic_store(&c->compress, yamux_compress_new());
+            }
 
-            if (session->new_stream_fn)
-                session->new_stream_fn(session, st);
+            yamux_dispatch_event(st, yamux_dispatch_on_new);
 
-            st->state = yamux_stream_syn_recv;
+            session->streams.states[st->slot] = yamux_stream_syn_recv;
+            yamux_stream_wake(st);
+
+            // the SYN may come with a window update or with data
+            ssize_t re = yamux_stream_process(st, &f, session->sock);
+            return (re < 0) ? re : (re + r);
         }
         else
             return -EPROTO;
@@ -241,3 +873,46 @@ ssize_t yamux_session_read(struct yamux_session* session)
     return 0;
 }
 
+
+size_t yamux_session_headroom(struct yamux_session* session)
+{
+    size_t own    = yamux_budget_headroom(&session->memory);
+    size_t shared = yamux_budget_headroom(session->config->shared_budget);
+
+    return own < shared ? own : shared;
+}
+void yamux_session_commit(struct yamux_session* session, int64_t delta)
+{
+    yamux_budget_commit(&session->memory, delta);
+    yamux_budget_commit(session->config->shared_budget, delta);
+}
+void yamux_session_buffer(struct yamux_session* session, int64_t delta)
+{
+    yamux_budget_buffer(&session->memory, delta);
+    yamux_budget_buffer(session->config->shared_budget, delta);
+}
+
+size_t yamux_session_load(struct yamux_session* session)
+{
+    if (!session)
+        return SIZE_MAX;
+
+    // a stalled stream counts twice: it holds data the peer isn't
+    // taking, and more streams on the same session will stall as well
+    size_t load = session->num_streams + atomic_load(&session->stalled_streams);
+
+    // bytes still sitting in the kernel send buffer, rounded up so any
+    // backlog makes a difference
+    int outq = 0;
+    if (ioctl(session->sock, TIOCOUTQ, &outq) == 0 && outq > 0)
+        load += ((size_t)outq + LOAD_OUTQ_UNIT - 1) / LOAD_OUTQ_UNIT;
+
+    // and what didn't even fit in there, see yamux_session_flush
+    pthread_mutex_lock(&session->send_lock);
+    size_t left = session->out_len - session->out_off;
+    pthread_mutex_unlock(&session->send_lock);
+
+    load += (left + LOAD_OUTQ_UNIT - 1) / LOAD_OUTQ_UNIT;
+
+    return load;
+}
@@ -0,0 +1,318 @@
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "spare.h"
+#include "session.h"
+#include "stream.h"
+
+int yamux_spares_init(struct yamux_spares* spares, size_t target)
+{
+    size_t cells = 1;
+    while (cells < target)
+        cells <<= 1;
+
+    *spares = (struct yamux_spares){
+        .mask  = cells - 1,
+        .cells = NULL,
+
+        .target = target
+    };
+
+    atomic_init(&spares->head  , 0);
+    atomic_init(&spares->tail  , 0);
+    atomic_init(&spares->paused, false);
+
+    if (!target)
+        return 0;
+
+    spares->cells = (struct yamux_spare_cell*)malloc(cells * sizeof(struct yamux_spare_cell));
+    if (!spares->cells)
+    {
+        spares->target = 0;
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < cells; ++i)
+    {
+        atomic_init(&spares->cells[i].seq, i);
+        spares->cells[i].stream = NULL;
+    }
+
+    return 0;
+}
+
+void yamux_spares_destroy(struct yamux_spares* spares)
+{
+    free(spares->cells);
+    spares->cells = NULL;
+}
+
+bool yamux_spares_push(struct yamux_spares* spares, struct yamux_stream* stream)
+{
+    if (!spares->cells)
+        return false;
+
+    size_t pos = atomic_load_explicit(&spares->tail, memory_order_relaxed);
+
+    for (;;)
+    {
+        struct yamux_spare_cell* c = &spares->cells[pos & spares->mask];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+
+        // the cell is free for this lap
+        if (seq == pos)
+        {
+            if (atomic_compare_exchange_weak_explicit(&spares->tail, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+            {
+                c->stream = stream;
+                atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        }
+        // still taken from the last lap: full
+        else if ((intptr_t)(seq - pos) < 0)
+            return false;
+        else
+            pos = atomic_load_explicit(&spares->tail, memory_order_relaxed);
+    }
+}
+
+struct yamux_stream* yamux_spares_pop(struct yamux_spares* spares)
+{
+    if (!spares->cells)
+        return NULL;
+
+    size_t pos = atomic_load_explicit(&spares->head, memory_order_relaxed);
+
+    for (;;)
+    {
+        struct yamux_spare_cell* c = &spares->cells[pos & spares->mask];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+
+        // filled in this lap
+        if (seq == pos + 1)
+        {
+            if (atomic_compare_exchange_weak_explicit(&spares->head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+            {
+                struct yamux_stream* stream = c->stream;
+                atomic_store_explicit(&c->seq, pos + spares->mask + 1, memory_order_release);
+                return stream;
+            }
+        }
+        // not filled yet: empty
+        else if ((intptr_t)(seq - (pos + 1)) < 0)
+            return NULL;
+        else
+            pos = atomic_load_explicit(&spares->head, memory_order_relaxed);
+    }
+}
+
+size_t yamux_spares_count(struct yamux_spares* spares)
+{
+    size_t head = atomic_load(&spares->head);
+    size_t tail = atomic_load(&spares->tail);
+
+    return tail > head ? tail - head : 0;
+}
+
+static void push_to(YAMUX_ATOMIC(struct yamux_stream*)* list, struct yamux_stream* stream)
+{
+    // spares always have their cold state
+    struct yamux_stream_cold* c    = atomic_load(&stream->cold);
+    struct yamux_stream*      head = atomic_load(list);
+
+    do
+        c->spare_next = head;
+    while (!atomic_compare_exchange_weak(list, &head, stream));
+}
+
+void yamux_spares_orphan(struct yamux_stream* stream)
+{
+    push_to(&stream->session->orphans, stream);
+}
+
+void yamux_spares_return(struct yamux_stream* stream)
+{
+    push_to(&stream->session->released, stream);
+}
+
+void yamux_spares_reclaim(struct yamux_session* session)
+{
+    struct yamux_stream* next;
+
+    for (struct yamux_stream* st = atomic_exchange(&session->orphans, NULL); st; st = next)
+    {
+        next = atomic_load(&st->cold)->spare_next;
+        yamux_stream_free(st);
+    }
+
+    // may orphan them again, for the next round
+    for (struct yamux_stream* st = atomic_exchange(&session->released, NULL); st; st = next)
+    {
+        next = atomic_load(&st->cold)->spare_next;
+        yamux_stream_dispatch(st, yamux_dispatch_on_release, NULL, 0);
+    }
+}
+
+// opens streams until enough are ready, they go into the ring once
+// their SYN is out. streams that can't go in are left to the reader,
+// which may already be handling a frame for them.
+static void refill(struct yamux_session* session)
+{
+    struct yamux_spares* sp = &session->spares;
+
+    while (!session->closed && !atomic_load(&sp->paused) &&
+            yamux_spares_count(sp) < sp->target)
+    {
+        struct yamux_stream* st = yamux_stream_new(session, 0, NULL);
+        if (!st)
+            return;
+
+        // never sent its SYN, nothing to tell the peer
+        struct yamux_stream_cold* c = yamux_stream_cold(st);
+        if (!c)
+        {
+            yamux_stream_free(st);
+            return;
+        }
+
+        atomic_store(&c->spare, true);
+
+        if (yamux_stream_init(st) < 0)
+        {
+            yamux_spares_orphan(st);
+            return;
+        }
+
+        // only if streams were released into it meanwhile
+        if (!yamux_spares_push(sp, st))
+        {
+            yamux_stream_reset(st);
+            yamux_spares_orphan(st);
+            return;
+        }
+    }
+}
+
+static void* refiller_main(void* arg)
+{
+    struct yamux_refiller* f = (struct yamux_refiller*)arg;
+
+    pthread_mutex_lock(&f->mutex);
+
+    while (!f->stop)
+    {
+        if (!f->wanted)
+        {
+            pthread_cond_wait(&f->cond, &f->mutex);
+            continue;
+        }
+
+        f->wanted = false;
+
+        pthread_mutex_unlock(&f->mutex);
+        refill(f->session);
+        pthread_mutex_lock(&f->mutex);
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+
+    return NULL;
+}
+
+static struct yamux_refiller* refiller_new(struct yamux_session* session)
+{
+    struct yamux_refiller* f = (struct yamux_refiller*)malloc(sizeof(struct yamux_refiller));
+    if (!f)
+        return NULL;
+
+    *f = (struct yamux_refiller){
+        .session = session,
+        .wanted  = false,
+        .stop    = false
+    };
+
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init (&f->cond , NULL);
+
+    if (pthread_create(&f->thread, NULL, refiller_main, f) != 0)
+    {
+        f->stop = true; // no thread to join
+        yamux_refiller_free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+// the session's refiller, started when it's first needed
+static struct yamux_refiller* get_refiller(struct yamux_session* session)
+{
+    struct yamux_refiller* f = atomic_load(&session->refiller);
+    if (f)
+        return f;
+
+    if (!(f = refiller_new(session)))
+        return NULL;
+
+    struct yamux_refiller* other = NULL;
+    if (!atomic_compare_exchange_strong(&session->refiller, &other, f))
+    {
+        yamux_refiller_stop(f);
+        yamux_refiller_free(f);
+        return other;
+    }
+
+    return f;
+}
+
+void yamux_spares_kick(struct yamux_session* session)
+{
+    struct yamux_spares* sp = &session->spares;
+
+    if (session->closed || atomic_load(&sp->paused) || yamux_spares_count(sp) >= sp->target)
+        return;
+
+    struct yamux_refiller* f = get_refiller(session);
+    if (!f)
+        return;
+
+    pthread_mutex_lock(&f->mutex);
+
+    if (!f->wanted)
+    {
+        f->wanted = true;
+        pthread_cond_signal(&f->cond);
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+}
+
+void yamux_refiller_stop(struct yamux_refiller* f)
+{
+    if (!f)
+        return;
+
+    pthread_mutex_lock(&f->mutex);
+    bool running = !f->stop;
+    f->stop = true;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+
+    if (running)
+        pthread_join(f->thread, NULL);
+}
+
+void yamux_refiller_free(struct yamux_refiller* f)
+{
+    if (!f)
+        return;
+
+    pthread_cond_destroy (&f->cond );
+    pthread_mutex_destroy(&f->mutex);
+
+    free(f);
+}
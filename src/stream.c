@@ -1,87 +1,241 @@
 #include <errno.h>
 #include <memory.h>
-#include <pthread.h> // 引入 pthread 库
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "frame.h"
 #include "stream.h"
 
-#define MIN(x, y) (y ^ ((x ^ y) & -(x < y)))
-#define MAX(x, y) (x ^ ((x ^ y) & -(x < y)))
+#define MIN(x, y) ((y) ^ (((x) ^ (y)) & -((x) < (y))))
+#define MAX(x, y) ((x) ^ (((x) ^ (y)) & -((x) < (y))))
 
-struct yamux_stream *yamux_stream_new(struct yamux_session *session,
-                                      yamux_streamid id, void *userdata) {
-  if (!session)
-    return NULL;
+// 热字段位于 session 的流表中，见 struct yamux_stream_table
+#define STATE(st) ((st)->session->streams.states[(st)->slot])
+#define WINDOW(st) ((st)->session->streams.windows[(st)->slot])
 
-  if (!id) {
-    id = session->nextid;
-    session->nextid += 2;
-  }
+// 跨多个 session 的 yamux_poll 只能睡在其中一个 session 上，
+// 每隔这么久重新扫描一次其余的流
+#define POLL_MIXED_NS 1000000L
 
-  struct yamux_stream *st = NULL;
-  struct yamux_session_stream *ss;
+// 流的主体不超过两个缓存行，可选功能的状态放在 cold 中
+_Static_assert(sizeof(struct yamux_stream) <= 128,
+               "struct yamux_stream must fit in two cache lines");
 
-  if (session->num_streams != session->cap_streams)
-    for (size_t i = 0; i < session->cap_streams; ++i) {
-      ss = &session->streams[i];
+// 不分配冷字段：尚未分配时对应功能一律未使用
+static struct yamux_stream_cold *peek_cold(struct yamux_stream *stream) {
+  return atomic_load(&stream->cold);
+}
 
-      if (!ss->alive) {
-        st = ss->stream;
-        ss->alive = true;
-        goto FOUND;
-      }
-    }
+static struct yamux_compress *get_compress(struct yamux_stream *stream) {
+  struct yamux_stream_cold *c = peek_cold(stream);
+  return c ? atomic_load(&c->compress) : NULL;
+}
+
+static struct yamux_bridge *get_bridge(struct yamux_stream *stream) {
+  struct yamux_stream_cold *c = peek_cold(stream);
+  return c ? atomic_load(&c->bridge) : NULL;
+}
+
+// NULL 即不限速
+static struct yamux_rate *send_rate(struct yamux_stream *stream) {
+  struct yamux_stream_cold *c = peek_cold(stream);
+  return c ? &c->send_rate : NULL;
+}
+
+static struct yamux_rate *recv_rate(struct yamux_stream *stream) {
+  struct yamux_stream_cold *c = peek_cold(stream);
+  return c ? &c->recv_rate : NULL;
+}
+
+static void signal_eventfd(int fd) {
+#ifdef __linux__
+  if (fd >= 0)
+    eventfd_write(fd, 1);
+#else
+  (void)fd;
+#endif
+}
+
+// 窗口、缓冲数据或状态变化后调用
+static void stream_notify(struct yamux_stream *stream) {
+  yamux_event_notify(&stream->event);
+  yamux_event_notify(&stream->session->poll_event);
+
+  struct yamux_stream_cold *c = peek_cold(stream);
+  if (c)
+    signal_eventfd(c->event_fd);
+  signal_eventfd(stream->session->event_fd);
 
-  if (session->cap_streams == session->config->accept_backlog)
+  struct yamux_session *session = stream->session;
+
+  if (session->notify_fn) {
+    yamux_streamid id = stream->id;
+    uint64_t t = yamux_callback_begin(session, yamux_callback_notify, id);
+    session->notify_fn(session, stream);
+    yamux_callback_end(session, yamux_callback_notify, id, t);
+  }
+}
+
+struct yamux_stream *yamux_stream_new(struct yamux_session *session,
+                                      yamux_streamid id, void *userdata) {
+  if (!session)
     return NULL;
 
-  ss = &session->streams[session->cap_streams];
+  // 对端一开始就拥有一个完整的接收窗口，预算不够时不开新流
+  if (yamux_session_headroom(session) < YAMUX_DEFAULT_WINDOW)
+    return NULL;
 
-  if (ss->alive)
+  struct yamux_stream *st = malloc(sizeof(struct yamux_stream));
+  if (!st)
     return NULL;
 
-  session->cap_streams++;
+  pthread_mutex_lock(&session->lock);
 
-  ss->alive = true;
-  st = ss->stream = malloc(sizeof(struct yamux_stream));
+  struct yamux_stream_table *t = &session->streams;
+  size_t slot = session->cap_streams;
 
-FOUND:;
+  // 扫描紧凑的 id 数组寻找空位，不触及各个流本身
+  if (session->num_streams != session->cap_streams)
+    for (slot = 0; slot < session->cap_streams; ++slot)
+      if (!atomic_load(&t->ids[slot]))
+        break;
+
+  if (slot == session->config->accept_backlog) {
+    pthread_mutex_unlock(&session->lock);
+    free(st);
+    return NULL;
+  }
+
+  if (!id) {
+    id = session->nextid;
+    session->nextid += 2;
+  }
 
   struct yamux_stream nst =
       (struct yamux_stream){.id = id,
+                            .slot = (uint32_t)slot,
                             .session = session,
-                            .state = yamux_stream_inited,
-                            .window_size = YAMUX_DEFAULT_WINDOW,
+                            .stalled = false,
 
                             .read_fn = NULL,
                             .fin_fn = NULL,
                             .rst_fn = NULL,
 
+                            .rx = NULL,
+                            .rx_bytes = 0,
+                            .rx_queued = 0,
+                            .rx_wire = 0,
+                            .rx_spare = NULL,
+                            .recv_window = YAMUX_DEFAULT_WINDOW,
+
+                            .cmp_requested = false,
+
+                            .strand = NULL,
+
+                            .owed = 0,
+                            .granting = false,
+
+                            .cold = NULL,
+
                             .userdata = userdata};
   *st = nst;
 
-  // 初始化互斥锁和条件变量
-  if (pthread_mutex_init(&st->mutex, NULL) != 0) {
-    fprintf(stderr, "Error initializing mutex\n");
-    free(st);
-    ss->alive = false;      // Revert alive state if mutex init fails
-    session->cap_streams--; // Revert cap_streams if mutex init fails
+  t->streams[slot] = st;
+  atomic_store(&t->states[slot], yamux_stream_inited);
+  atomic_store(&t->windows[slot], YAMUX_DEFAULT_WINDOW);
+  // 最后写入 id：无锁查找看到它时，流已完整可用
+  atomic_store(&t->ids[slot], id);
+  yamux_session_index_add(session, (uint32_t)slot);
+
+  if (slot == session->cap_streams)
+    session->cap_streams++;
+  session->num_streams++;
+
+  pthread_mutex_unlock(&session->lock);
+
+  yamux_session_commit(session, YAMUX_DEFAULT_WINDOW);
+
+  yamux_event_init(&st->event);
+
+  return st;
+}
+
+struct yamux_stream_cold *yamux_stream_cold(struct yamux_stream *stream) {
+  if (!stream)
     return NULL;
-  }
-  if (pthread_cond_init(&st->cond, NULL) != 0) {
-    fprintf(stderr, "Error initializing condition variable\n");
-    pthread_mutex_destroy(&st->mutex); // Clean up mutex if cond init fails
-    free(st);
-    ss->alive = false;      // Revert alive state if cond init fails
-    session->cap_streams--; // Revert cap_streams if cond init fails
+
+  struct yamux_stream_cold *c = peek_cold(stream);
+  if (c)
+    return c;
+
+  if (!(c = malloc(sizeof(struct yamux_stream_cold))))
     return NULL;
+
+  *c = (struct yamux_stream_cold){.event_fd = -1,
+                                  .compress = NULL,
+                                  .grant_next = NULL,
+                                  .grant_due = 0,
+                                  .grant_queued = false,
+                                  .bridge = NULL,
+                                  .spare = false,
+                                  .spare_next = NULL,
+                                  .messages = NULL};
+
+  yamux_rate_init(&c->send_rate, 0, 0);
+  yamux_rate_init(&c->recv_rate, 0, 0);
+
+  // 多个线程同时分配时只保留一个
+  struct yamux_stream_cold *other = NULL;
+  if (!atomic_compare_exchange_strong(&stream->cold, &other, c)) {
+    free(c);
+    return other;
   }
 
-  return st;
+  return c;
+}
+
+struct yamux_rate *yamux_stream_send_rate(struct yamux_stream *stream) {
+  struct yamux_stream_cold *c = yamux_stream_cold(stream);
+  return c ? &c->send_rate : NULL;
+}
+
+struct yamux_rate *yamux_stream_recv_rate(struct yamux_stream *stream) {
+  struct yamux_stream_cold *c = yamux_stream_cold(stream);
+  return c ? &c->recv_rate : NULL;
+}
+
+enum yamux_stream_state yamux_stream_get_state(struct yamux_stream *stream) {
+  return stream ? (enum yamux_stream_state)STATE(stream) : yamux_stream_closed;
+}
+
+uint32_t yamux_stream_get_window(struct yamux_stream *stream) {
+  return stream ? atomic_load(&WINDOW(stream)) : 0;
+}
+
+// 状态转换使用 CAS，只有赢得转换的一方继续
+static bool state_cas(struct yamux_stream *stream,
+                      enum yamux_stream_state from,
+                      enum yamux_stream_state to) {
+  uint8_t expected = (uint8_t)from;
+  return atomic_compare_exchange_strong(&STATE(stream), &expected,
+                                        (uint8_t)to);
+}
+
+// SYN，按配置附带压缩请求
+static enum yamux_frame_flags syn_flags(struct yamux_stream *stream) {
+  if (!stream->session->config->compression || !yamux_compress_available())
+    return yamux_frame_syn;
+
+  stream->cmp_requested = true;
+  return yamux_frame_syn | yamux_frame_cmp;
 }
 
 ssize_t yamux_stream_init(struct yamux_stream *stream) {
@@ -89,34 +243,27 @@ ssize_t yamux_stream_init(struct yamux_stream *stream) {
     return -EINVAL;
   }
 
-  pthread_mutex_lock(&stream->mutex);
-  if (stream->state != yamux_stream_inited) {
-    pthread_mutex_unlock(&stream->mutex);
+  if (!state_cas(stream, yamux_stream_inited, yamux_stream_syn_sent))
     return -EINVAL;
-  }
 
   struct yamux_frame f = (struct yamux_frame){.version = YAMUX_VERSION,
                                               .type = yamux_frame_window_update,
-                                              .flags = yamux_frame_syn,
+                                              .flags = syn_flags(stream),
                                               .streamid = stream->id,
                                               .length = 0};
 
-  stream->state = yamux_stream_syn_sent;
-  pthread_mutex_unlock(&stream->mutex);
-
   encode_frame(&f);
-  return send(stream->session->sock, &f, sizeof(struct yamux_frame), 0);
+  return yamux_session_send(stream->session, &f, sizeof(struct yamux_frame));
 }
 
 ssize_t yamux_stream_close(struct yamux_stream *stream) {
   if (!stream || stream->session->closed)
     return -EINVAL;
 
-  pthread_mutex_lock(&stream->mutex);
-  if (stream->state != yamux_stream_est) {
-    pthread_mutex_unlock(&stream->mutex);
+  if (!state_cas(stream, yamux_stream_est, yamux_stream_closing))
     return -EINVAL;
-  }
+
+  yamux_stream_wake(stream);
 
   struct yamux_frame f = (struct yamux_frame){.version = YAMUX_VERSION,
                                               .type = yamux_frame_window_update,
@@ -124,59 +271,63 @@ ssize_t yamux_stream_close(struct yamux_stream *stream) {
                                               .streamid = stream->id,
                                               .length = 0};
 
-  stream->state = yamux_stream_closing;
-  pthread_mutex_unlock(&stream->mutex);
-
   encode_frame(&f);
-  return send(stream->session->sock, &f, sizeof(struct yamux_frame), 0);
+  return yamux_session_send(stream->session, &f, sizeof(struct yamux_frame));
 }
 
 ssize_t yamux_stream_reset(struct yamux_stream *stream) {
   if (!stream || stream->session->closed)
     return -EINVAL;
 
-  pthread_mutex_lock(&stream->mutex);
   struct yamux_frame f = (struct yamux_frame){.version = YAMUX_VERSION,
                                               .type = yamux_frame_window_update,
                                               .flags = yamux_frame_rst,
                                               .streamid = stream->id,
                                               .length = 0};
 
-  stream->state = yamux_stream_closed;
-  pthread_mutex_unlock(&stream->mutex);
+  STATE(stream) = yamux_stream_closed;
+  yamux_stream_wake(stream);
 
   encode_frame(&f);
-  return send(stream->session->sock, &f, sizeof(struct yamux_frame), 0);
+  return yamux_session_send(stream->session, &f, sizeof(struct yamux_frame));
 }
 
 static enum yamux_frame_flags get_flags(struct yamux_stream *stream) {
-  // 此函数在调用方加锁，因此不需要内部加锁
-  enum yamux_frame_flags flags = 0;
-  switch (stream->state) {
-  case yamux_stream_inited:
-    stream->state = yamux_stream_syn_sent;
-    flags = yamux_frame_syn;
-    break;
-  case yamux_stream_syn_recv:
-    stream->state = yamux_stream_est;
-    flags = yamux_frame_ack;
-    break;
-  default:
-    flags = 0;
-    break;
+  // 状态转换使用 CAS，无需加锁；只有赢得转换的一方发送 SYN/ACK
+  enum yamux_stream_state state = STATE(stream);
+
+  if (state == yamux_stream_inited &&
+      state_cas(stream, state, yamux_stream_syn_sent))
+    return syn_flags(stream);
+
+  // 同意压缩时在 ACK 上回应 yamux_frame_cmp
+  if (state == yamux_stream_syn_recv &&
+      state_cas(stream, state, yamux_stream_est))
+    return yamux_frame_ack | (get_compress(stream) ? yamux_frame_cmp : 0);
+
+  return 0;
+}
+
+// 归还窗口（额度），并唤醒等待窗口的线程
+static void window_add(struct yamux_stream *stream, uint32_t delta) {
+  uint32_t nws = atomic_fetch_add(&WINDOW(stream), delta) + delta;
+
+  if (nws > 0) {
+    if (atomic_load(&stream->stalled) &&
+        atomic_exchange(&stream->stalled, false))
+      atomic_fetch_sub(&stream->session->stalled_streams, 1);
+
+    stream_notify(stream);
   }
-  return flags;
 }
 
 ssize_t yamux_stream_window_update(struct yamux_stream *stream, int32_t delta) {
-  if (!stream || stream->state == yamux_stream_closed ||
-      stream->state == yamux_stream_closing || stream->session->closed)
+  if (!stream || STATE(stream) == yamux_stream_closed ||
+      STATE(stream) == yamux_stream_closing || stream->session->closed)
     return -EINVAL;
 
   struct yamux_session *s = stream->session;
 
-  int sock = s->sock;
-
   struct yamux_frame f = (struct yamux_frame){.version = YAMUX_VERSION,
                                               .type = yamux_frame_window_update,
                                               .flags = get_flags(stream),
@@ -184,14 +335,24 @@ ssize_t yamux_stream_window_update(struct yamux_stream *stream, int32_t delta) {
                                               .length = (uint32_t)delta};
   encode_frame(&f);
 
-  return send(sock, &f, sizeof(struct yamux_frame), 0);
+  atomic_fetch_add(&stream->recv_window, (uint32_t)delta);
+  yamux_session_commit(s, delta);
+
+  return yamux_session_send(s, &f, sizeof(struct yamux_frame));
 }
 
-ssize_t yamux_stream_write(struct yamux_stream *stream, uint32_t data_length,
-                           void *data_) {
+// 退回没有发出去的字节占用的发送限速额度
+static void send_refund(struct yamux_stream *stream, uint32_t n) {
+  yamux_rate_refund(send_rate(stream), n);
+  yamux_rate_refund(&stream->session->send_rate, n);
+}
+
+// zw 非空时，足够大的帧使用 MSG_ZEROCOPY 发送
+static ssize_t stream_write(struct yamux_stream *stream, uint32_t data_length,
+                            void *data_, struct yamux_zc_write *zw) {
   if (!((size_t)stream | (size_t)data_) ||
-      stream->state == yamux_stream_closed ||
-      stream->state == yamux_stream_closing || stream->session->closed)
+      STATE(stream) == yamux_stream_closed ||
+      STATE(stream) == yamux_stream_closing || stream->session->closed)
     return -EINVAL;
 
   char *data = (char *)data_;
@@ -200,46 +361,154 @@ ssize_t yamux_stream_write(struct yamux_stream *stream, uint32_t data_length,
   char *data_end = data + data_length;
   ssize_t total_sent_data = 0; // 记录实际发送的数据长度
 
-  while (data < data_end) {
-    pthread_mutex_lock(&stream->mutex);
-    uint32_t current_window_size = stream->window_size;
+  // 超出速率限制时不占用窗口等待，由调用方稍后重试
+  if (yamux_stream_send_delay(stream))
+    return -EAGAIN;
+
+  // DATA 帧上的 yamux_frame_cmp 只表示负载已压缩，
+  // 压缩协商放在单独的不带负载的 SYN/ACK 帧上
+  enum yamux_frame_flags open = get_flags(stream);
+  if (open & yamux_frame_cmp) {
+    struct yamux_frame h = (struct yamux_frame){.version = YAMUX_VERSION,
+                                                .type = yamux_frame_window_update,
+                                                .flags = open,
+                                                .streamid = stream->id,
+                                                .length = 0};
+    encode_frame(&h);
 
-    if (current_window_size <= 0) {
-      // 窗口大小不足，返回已发送的数据量，调用方应等待
-      pthread_mutex_unlock(&stream->mutex);
-      return total_sent_data;
-    }
+    ssize_t res = yamux_session_send(s, &h, sizeof(struct yamux_frame));
+    if (res != sizeof(struct yamux_frame))
+      return res < 0 ? res : -EIO;
+    open = 0;
+  }
 
+  while (data < data_end) {
+    struct yamux_compress *cmp = get_compress(stream);
     uint32_t dr = (uint32_t)(data_end - data);
-    uint32_t adv = MIN(dr, current_window_size);
+    uint32_t current_window_size = atomic_load(&WINDOW(stream));
+    uint32_t adv;
+
+    // 限速时每帧不超过一次突发量，等待时间因此较为平均
+    uint32_t chunk = yamux_rate_chunk(send_rate(stream));
+    chunk = MIN(chunk, yamux_rate_chunk(&s->send_rate));
+
+    // 带 SYN/ACK 的第一帧不能不发，其余帧同上。非阻塞 socket
+    // 上还有剩余数据时也先不占用窗口，见 yamux_session_flush
+    if (!open && (yamux_stream_send_delay(stream) ||
+                  !yamux_session_writable(s)))
+      return total_sent_data > 0 ? total_sent_data : -EAGAIN;
+
+    // 用 CAS 预先扣除窗口，无需加锁
+    do {
+      if (current_window_size == 0) {
+        // 窗口大小不足，返回已发送的数据量，调用方应等待
+        if (!atomic_exchange(&stream->stalled, true)) {
+          atomic_fetch_add(&s->stalled_streams, 1);
+
+          // 窗口可能在此期间已被更新
+          if (atomic_load(&WINDOW(stream)) > 0 &&
+              atomic_exchange(&stream->stalled, false))
+            atomic_fetch_sub(&s->stalled_streams, 1);
+        }
+        return total_sent_data;
+      }
+
+      adv = MIN(MIN(dr, current_window_size), chunk);
+      if (cmp)
+        adv = MIN(adv, YAMUX_COMPRESS_CHUNK);
+    } while (!atomic_compare_exchange_weak(&WINDOW(stream),
+                                           &current_window_size,
+                                           current_window_size - adv));
 
-    // 预先扣除
-    stream->window_size -= adv;
+    // 上面已确认速率允许，这里只记账；没发出去的部分再退回
+    yamux_rate_take(send_rate(stream), adv);
+    yamux_rate_take(&s->send_rate, adv);
 
     struct yamux_frame f = (struct yamux_frame){.version = YAMUX_VERSION,
                                                 .type = yamux_frame_data,
-                                                .flags = get_flags(stream),
+                                                .flags = open,
                                                 .streamid = stream->id,
                                                 .length = adv};
-    pthread_mutex_unlock(&stream->mutex);
+    open = 0;
 
     const ssize_t frame_size = sizeof(struct yamux_frame);
-    char sendd[adv + frame_size]; // VLA used here
+
+    // 大帧不经过 sendd：负载由内核直接引用，帧头保存在堆上的记录中。
+    // 非阻塞 socket 上发不完的部分要复制下来，只走复制路径
+    if (zw && !cmp && s->zerocopy.enabled && !s->nonblocking &&
+        adv >= s->config->zerocopy_threshold) {
+      struct yamux_frame h = f;
+      encode_frame(&h);
+
+      pthread_mutex_lock(&s->send_lock);
+      ssize_t res = yamux_zerocopy_send(&s->zerocopy, sock, &h, data, adv, zw);
+      pthread_mutex_unlock(&s->send_lock);
+
+      // -ENOBUFS: 超出 optmem 限制，这一帧改走复制路径
+      if (res != -ENOBUFS) {
+        if (res < 0) {
+          window_add(stream, adv);
+          send_refund(stream, adv);
+          return total_sent_data > 0 ? total_sent_data : res;
+        }
+
+        // 帧只发出了一部分（可能连帧头都不完整），对端已无法
+        // 正确分帧，整个 session 不能再用
+        if (res < frame_size + (ssize_t)adv) {
+          atomic_store(&s->closed, true);
+          yamux_stream_wake(stream);
+          return total_sent_data > 0 ? total_sent_data : -EIO;
+        }
+
+        total_sent_data += adv;
+        data += adv;
+        continue;
+      }
+    }
+    char sendd[(cmp ? yamux_compress_bound(adv) : adv) +
+               frame_size]; // VLA used here
+
+    uint32_t wire = 0;
+    if (cmp)
+      wire = yamux_compress_frame(cmp, data, adv, sendd + frame_size);
+
+    if (wire) {
+      // 窗口按线上字节计算，归还压缩省下的部分
+      f.flags |= yamux_frame_cmp;
+      f.length = wire;
+      window_add(stream, adv - wire);
+
+      encode_frame(&f);
+      memcpy(sendd, &f, frame_size);
+
+      // 压缩帧无法部分重发，而压缩历史已经前进，
+      // 对端无法再同步解压：归还窗口并重置流
+      ssize_t res = yamux_session_send(s, sendd, wire + frame_size);
+      if (res != wire + frame_size) {
+        window_add(stream, wire);
+        send_refund(stream, adv);
+        yamux_stream_reset(stream);
+        return total_sent_data > 0 ? total_sent_data : (res < 0 ? res : -EIO);
+      }
+
+      total_sent_data += adv;
+      data += adv;
+      continue;
+    }
 
     encode_frame(&f);
     memcpy(sendd, &f, frame_size);
     memcpy(sendd + frame_size, data, (size_t)adv);
 
-    ssize_t res = send(sock, sendd, adv + frame_size, 0);
+    ssize_t res = yamux_session_send(s, sendd, adv + frame_size);
     if (res > 0) {
       const ssize_t sent_len = res - frame_size;
       if (sent_len > 0 && sent_len < adv) {
         // 返回未使用的窗口
-        pthread_mutex_lock(&stream->mutex);
-        // res 是发送的总字节数 (帧头 + 数据)，我们只从 window_size
+        // res 是发送的总字节数 (帧头 + 数据)，我们只从窗口
         // 中减去数据部分
-        stream->window_size += adv - sent_len;
-        pthread_mutex_unlock(&stream->mutex);
+        window_add(stream, adv - (uint32_t)sent_len);
+        send_refund(stream, adv - (uint32_t)sent_len);
       }
 
       total_sent_data += sent_len;
@@ -247,9 +516,8 @@ ssize_t yamux_stream_write(struct yamux_stream *stream, uint32_t data_length,
     } else {
       // 发送错误或部分发送，返回已发送的数据量或错误
       // 返回未使用的窗口
-      pthread_mutex_lock(&stream->mutex);
-      stream->window_size += adv;
-      pthread_mutex_unlock(&stream->mutex);
+      window_add(stream, adv);
+      send_refund(stream, adv);
       return total_sent_data > 0 ? total_sent_data : res;
     }
   }
@@ -257,68 +525,497 @@ ssize_t yamux_stream_write(struct yamux_stream *stream, uint32_t data_length,
   return total_sent_data;
 }
 
+ssize_t yamux_stream_write(struct yamux_stream *stream, uint32_t data_length,
+                           void *data) {
+  return stream_write(stream, data_length, data, NULL);
+}
+
+ssize_t yamux_stream_write_zc(struct yamux_stream *stream,
+                              uint32_t data_length, void *data,
+                              yamux_write_done_fn done, void *arg) {
+  if (!stream)
+    return -EINVAL;
+
+  struct yamux_session *s = stream->session;
+
+  struct yamux_zc_write *zw = malloc(sizeof(struct yamux_zc_write));
+  if (!zw)
+    return -ENOMEM;
+
+  *zw = (struct yamux_zc_write){
+      .next = NULL,
+      .streamid = stream->id,
+      .done = done,
+      .arg = arg,
+      .pending = 0,
+      .issued = false};
+
+  ssize_t res = stream_write(stream, data_length, data, zw);
+
+  yamux_zerocopy_reap(&s->zerocopy, s->sock);
+  yamux_zerocopy_issued(&s->zerocopy, zw);
+
+  return res;
+}
+
+int yamux_stream_release(struct yamux_stream *stream) {
+  if (!stream ||
+      (STATE(stream) != yamux_stream_syn_sent &&
+       STATE(stream) != yamux_stream_est) ||
+      atomic_load(&stream->rx_bytes) || stream->session->closed)
+    return -EINVAL;
+
+  struct yamux_spares *sp = &stream->session->spares;
+
+  if (yamux_spares_count(sp) >= sp->target)
+    return -ENOSPC;
+
+  // spares 通过冷字段串成链表
+  if (!yamux_stream_cold(stream))
+    return -ENOMEM;
+
+  // 回调可能正在执行：由执行回调的线程清除回调并放回 spares
+  if (stream->session->config->dispatch) {
+    ssize_t res = yamux_dispatch_release(stream);
+    return res < 0 ? (int)res : 0;
+  }
+
+  yamux_spares_return(stream);
+  return 0;
+}
+
 void yamux_stream_free(struct yamux_stream *stream) {
   if (!stream)
     return;
 
-  if (stream->free_fn)
+  // 丢弃尚未执行的回调，它们占用的窗口一并释放
+  uint32_t dropped = yamux_dispatch_detach(stream);
+
+  yamux_bridge_detach(stream);
+  yamux_messages_detach(stream);
+  yamux_granter_detach(stream);
+
+  if (stream->free_fn) {
+    struct yamux_session *session = stream->session;
+    yamux_streamid id = stream->id;
+    uint64_t t = yamux_callback_begin(session, yamux_callback_free, id);
     stream->free_fn(stream);
+    yamux_callback_end(session, yamux_callback_free, id, t);
+  }
 
-  // 销毁互斥锁和条件变量
-  pthread_mutex_destroy(&stream->mutex);
-  pthread_cond_destroy(&stream->cond);
+  if (stream->stalled)
+    atomic_fetch_sub(&stream->session->stalled_streams, 1);
 
-  struct yamux_stream s = *stream;
+  struct yamux_stream_cold *cold = peek_cold(stream);
 
-  for (size_t i = 0; i < s.session->cap_streams; ++i) {
-    struct yamux_session_stream *ss = &s.session->streams[i];
-    if (ss->alive && ss->stream->id == s.id) {
-      ss->alive = false;
+  if (cold && cold->event_fd >= 0)
+    close(cold->event_fd);
 
-      s.session->num_streams--;
-      if (i == s.session->cap_streams - 1)
-        s.session->cap_streams--;
+  // 未读完的帧仍按线上字节占用承诺额度
+  int64_t committed = stream->recv_window + (int64_t)dropped;
+  struct yamux_rx_queue *rx = stream->rx;
 
-      break;
+  if (rx) {
+    for (struct yamux_rx_chunk *c = rx->first, *next; c; c = next) {
+      next = c->next;
+      if (c->offset < c->length)
+        committed += c->wire;
+      if (c != &rx->stub)
+        free(c);
     }
+    free(rx);
   }
+  free(stream->rx_spare);
+
+  yamux_session_buffer(stream->session, -(int64_t)stream->rx_bytes);
+  yamux_session_commit(stream->session, -committed);
+
+  if (cold)
+    yamux_compress_free(cold->compress);
+  free(cold);
+
+  struct yamux_session *session = stream->session;
+  uint32_t slot = stream->slot;
+
+  pthread_mutex_lock(&session->lock);
+
+  yamux_session_index_del(session, slot);
+  atomic_store(&session->streams.ids[slot], 0);
+  session->streams.streams[slot] = NULL;
+
+  session->num_streams--;
+  if (slot == session->cap_streams - 1)
+    session->cap_streams--;
+
+  pthread_mutex_unlock(&session->lock);
 
   free(stream);
 }
 
+// 收取一个 DATA 帧的负载，需要时解压。plain 指向明文，
+// 可能位于 wire 缓冲区中，也可能位于 out 中
+static ssize_t recv_payload(struct yamux_stream *stream,
+                            struct yamux_frame *f, char *wire,
+                            char *out, char **plain) {
+  if (yamux_session_recv(stream->session, wire, f->length) !=
+      (ssize_t)f->length)
+    return -1; // Error or partial read
+
+  yamux_capture_payload(stream->session->capture, wire, f->length);
+
+  struct yamux_compress *cmp = get_compress(stream);
+
+  if (!(f->flags & yamux_frame_cmp)) {
+    if (cmp)
+      yamux_decompress_raw(cmp, wire, f->length);
+
+    *plain = wire;
+    return f->length;
+  }
+
+  if (!cmp)
+    return -EPROTO; // 未协商压缩
+
+  *plain = out;
+  return yamux_decompress_frame(cmp, wire, f->length, out);
+}
+
+// 取一个至少能放下 length 字节的节点，优先复用上一个用完的
+static struct yamux_rx_chunk *chunk_alloc(struct yamux_stream *stream,
+                                          uint32_t length) {
+  struct yamux_rx_chunk *c = atomic_exchange(&stream->rx_spare, NULL);
+  if (c && c->size >= length)
+    return c;
+  free(c);
+
+  if ((c = malloc(sizeof(struct yamux_rx_chunk) + length)))
+    c->size = length;
+  return c;
+}
+
+// 用完的节点留给下一个负载，替换下来的释放掉
+static void chunk_recycle(struct yamux_stream *stream,
+                          struct yamux_rx_chunk *c) {
+  free(atomic_exchange(&stream->rx_spare, c));
+}
+
+// 收取一个 DATA 帧的负载（需要时解压）到队列节点中
+static ssize_t recv_chunk(struct yamux_stream *stream, struct yamux_frame *f,
+                          struct yamux_rx_chunk **out) {
+  struct yamux_rx_chunk *c;
+
+  if (f->flags & yamux_frame_cmp) {
+    char wire[f->length]; // VLA used here
+
+    if (yamux_session_recv(stream->session, wire, f->length) !=
+        (ssize_t)f->length)
+      return -1; // Error or partial read
+
+    yamux_capture_payload(stream->session->capture, wire, f->length);
+
+    ssize_t length = yamux_compress_length(wire, f->length);
+    if (length < 0)
+      return length;
+
+    c = chunk_alloc(stream, (uint32_t)length);
+    if (!c)
+      return -ENOMEM;
+
+    // 直接解压进队列节点
+    struct yamux_compress *cmp = get_compress(stream);
+
+    if (!cmp || yamux_decompress_frame(cmp, wire, f->length,
+                                       (char *)(c + 1)) != length) {
+      chunk_recycle(stream, c);
+      return -EPROTO;
+    }
+
+    *c = (struct yamux_rx_chunk){.next = NULL,
+                                 .length = (uint32_t)length,
+                                 .offset = 0,
+                                 .wire = f->length,
+                                 .size = c->size,
+                                 .data = (char *)(c + 1)};
+  } else {
+    c = chunk_alloc(stream, f->length);
+    if (!c)
+      return -ENOMEM;
+
+    *c = (struct yamux_rx_chunk){.next = NULL,
+                                 .length = f->length,
+                                 .offset = 0,
+                                 .wire = f->length,
+                                 .size = c->size,
+                                 .data = (char *)(c + 1)};
+
+    if (yamux_session_recv(stream->session, c->data, f->length) !=
+        (ssize_t)f->length) {
+      chunk_recycle(stream, c);
+      return -1; // Error or partial read
+    }
+
+    yamux_capture_payload(stream->session->capture, c->data, f->length);
+
+    struct yamux_compress *cmp = get_compress(stream);
+    if (cmp)
+      yamux_decompress_raw(cmp, c->data, f->length);
+  }
+
+  *out = c;
+  return f->length;
+}
+
+// 把节点挂到接收队列末尾。同一时间只能有一个线程调用：
+// session 读线程，或使用 dispatcher 时该流的工作线程
+static ssize_t rx_push(struct yamux_stream *stream, struct yamux_rx_chunk *c) {
+  struct yamux_rx_queue *rx = stream->rx;
+
+  // 接收队列在第一次缓冲数据时才分配
+  if (!rx) {
+    rx = malloc(sizeof(struct yamux_rx_queue));
+    if (!rx)
+      return -ENOMEM;
+
+    *rx = (struct yamux_rx_queue){.stub = {.next = NULL}};
+    rx->first = rx->last = &rx->stub;
+
+    atomic_store(&stream->rx, rx);
+  }
+
+  atomic_store(&rx->last->next, c);
+  rx->last = c;
+
+  // 数据从“已承诺”转为“已缓冲”，承诺总量不变
+  atomic_fetch_add(&stream->rx_bytes, c->length);
+  yamux_session_buffer(stream->session, c->length);
+
+  stream_notify(stream);
+
+  return c->length;
+}
+
+// 把一个 DATA 帧收进接收队列（仅由 session 读线程调用）
+static ssize_t rx_recv(struct yamux_stream *stream, struct yamux_frame *f) {
+  struct yamux_rx_chunk *c;
+
+  ssize_t res = recv_chunk(stream, f, &c);
+  if (res < 0)
+    return res;
+
+  if ((res = rx_push(stream, c)) < 0) {
+    free(c);
+    return res;
+  }
+
+  return f->length;
+}
+
+// 桥接的流：负载经管道写入 fd。压缩、抓包或负载已被预读时
+// 需要经过用户空间，否则直接从 socket splice 进管道
+static ssize_t bridge_recv(struct yamux_stream *stream, struct yamux_frame *f,
+                           uint32_t used) {
+  struct yamux_session *s = stream->session;
+
+  if (!get_compress(stream) && !s->capture && s->in_len == s->in_off)
+    return yamux_bridge_recv(stream, NULL, f->length, used);
+
+  char buf[f->length]; // VLA used here
+  char out[(f->flags & yamux_frame_cmp) ? YAMUX_COMPRESS_CHUNK : 1];
+  char *plain;
+
+  ssize_t res = recv_payload(stream, f, buf, out, &plain);
+  if (res < 0)
+    return res;
+
+  res = yamux_bridge_recv(stream, plain, (uint32_t)res, used);
+  return res < 0 ? res : f->length;
+}
+
+// 交给 dispatcher，由该流的工作线程调用 read_fn 或放入接收队列
+static ssize_t dispatch_recv(struct yamux_stream *stream,
+                             struct yamux_frame *f, uint32_t used) {
+  struct yamux_rx_chunk *c;
+
+  ssize_t res = recv_chunk(stream, f, &c);
+  if (res < 0)
+    return res;
+
+  // 放入接收队列时按实际扣除的窗口归还
+  c->wire = used;
+
+  atomic_fetch_add(&stream->rx_queued, 1);
+  if ((res = yamux_dispatch_data(stream, c, used)) < 0) {
+    atomic_fetch_sub(&stream->rx_queued, 1);
+    free(c);
+    return res;
+  }
+
+  return f->length;
+}
+
+void yamux_stream_dispatch(struct yamux_stream *stream,
+                           enum yamux_dispatch_event event,
+                           struct yamux_rx_chunk *chunk, uint32_t used) {
+  struct yamux_session *session = stream->session;
+  // 回调中可能释放 stream，计时前先取出 id
+  yamux_streamid id = stream->id;
+  uint64_t t;
+
+  switch (event) {
+  case yamux_dispatch_on_new:
+    if (session->new_stream_fn) {
+      t = yamux_callback_begin(session, yamux_callback_new_stream, id);
+      session->new_stream_fn(session, stream);
+      yamux_callback_end(session, yamux_callback_new_stream, id, t);
+    }
+    break;
+  case yamux_dispatch_on_data:
+    // 在 new_stream_fn 中桥接的流：SYN 带的负载此时才交给桥接
+    if (get_bridge(stream) &&
+        yamux_bridge_recv(stream, chunk->data, chunk->length, used) >= 0) {
+      chunk_recycle(stream, chunk);
+      // 交付之后 session 读线程才能直接交给桥接
+      atomic_fetch_sub(&stream->rx_queued, 1);
+      break;
+    }
+
+    // read_fn 可能是在 new_stream_fn 中才设置的
+    if (!stream->read_fn) {
+      if (rx_push(stream, chunk) < 0) {
+        free(chunk);
+        yamux_session_commit(session, -(int64_t)used);
+      }
+      atomic_fetch_sub(&stream->rx_queued, 1);
+      break;
+    }
+
+    // read_fn 中可能释放 stream
+    atomic_fetch_sub(&stream->rx_queued, 1);
+
+    stream->rx_wire = used;
+
+    t = yamux_callback_begin(session, yamux_callback_read, id);
+    stream->read_fn(stream, chunk->length, chunk->data);
+    yamux_callback_end(session, yamux_callback_read, id, t);
+    // stream 此时可能已释放，节点不能再留给它复用
+    free(chunk);
+
+    yamux_session_commit(session, -(int64_t)used);
+    break;
+  case yamux_dispatch_on_fin:
+    // 排在 FIN 之前的数据都已交付，此时才算对端关闭
+    STATE(stream) = yamux_stream_closed;
+    yamux_stream_wake(stream);
+    yamux_bridge_fin(stream, false);
+
+    if (stream->fin_fn) {
+      t = yamux_callback_begin(session, yamux_callback_fin, id);
+      stream->fin_fn(stream);
+      yamux_callback_end(session, yamux_callback_fin, id, t);
+    }
+    break;
+  case yamux_dispatch_on_rst:
+    yamux_bridge_fin(stream, true);
+
+    if (stream->rst_fn) {
+      t = yamux_callback_begin(session, yamux_callback_rst, id);
+      stream->rst_fn(stream);
+      yamux_callback_end(session, yamux_callback_rst, id, t);
+    }
+    break;
+  case yamux_dispatch_on_release:
+    // 该流之前的回调都已执行完
+    stream->read_fn = NULL;
+    stream->fin_fn = NULL;
+    stream->rst_fn = NULL;
+    stream->free_fn = NULL;
+    stream->userdata = NULL;
+
+    // yamux_stream_release 已分配了冷字段
+    atomic_store(&peek_cold(stream)->spare, true);
+
+    // 期间被对端关闭，或 spares 已经满了：由读线程释放
+    if ((STATE(stream) != yamux_stream_syn_sent &&
+         STATE(stream) != yamux_stream_est) ||
+        !yamux_spares_push(&session->spares, stream)) {
+      atomic_store(&peek_cold(stream)->spare, false);
+      yamux_stream_reset(stream);
+      yamux_spares_orphan(stream);
+    }
+    break;
+  }
+}
+
 ssize_t yamux_stream_process(struct yamux_stream *stream,
                              struct yamux_frame *frame, int sock) {
   struct yamux_frame f = *frame;
+  (void)sock; // 负载经由 yamux_session_recv 读取
+
+  // 对端的 ACK 同意了我们的压缩请求（对端的请求在 session 中处理）。
+  // 协商只出现在窗口更新帧上，DATA 帧的 yamux_frame_cmp 表示负载已压缩
+  if (f.type == yamux_frame_window_update &&
+      (f.flags & yamux_frame_ack) && (f.flags & yamux_frame_cmp) &&
+      stream->cmp_requested && !get_compress(stream)) {
+    // 分配失败时不压缩：对端只会收到未压缩的 DATA 帧
+    struct yamux_stream_cold *c = yamux_stream_cold(stream);
+    if (c)
+      atomic_store(&c->compress, yamux_compress_new());
+  }
 
   switch (f.type) {
   case yamux_frame_data: {
+    // 扣除对端的接收窗口
+    uint32_t rw = atomic_load(&stream->recv_window), used;
+    do {
+      used = MIN(rw, f.length);
+    } while (!atomic_compare_exchange_weak(&stream->recv_window, &rw,
+                                           rw - used));
+
+    if (used < f.length)
+      return -EPROTO; // 对端超出了接收窗口
+
+    // 桥接的流绕过 read_fn 和 dispatcher；桥接前已排队的负载
+    // 还没交付时，后来的也要排队，以保持顺序
+    if (get_bridge(stream) && !atomic_load(&stream->rx_queued)) {
+      ssize_t res = bridge_recv(stream, &f, used);
+      if (res != -ENOENT)
+        return res;
+    }
+
+    if (stream->session->config->dispatch)
+      return dispatch_recv(stream, &f, used);
+
+    // 没有 read_fn 时，数据直接收进接收缓冲区
+    if (!stream->read_fn)
+      return rx_recv(stream, &f);
+
     char buf[f.length]; // VLA used here
+    char out[(f.flags & yamux_frame_cmp) ? YAMUX_COMPRESS_CHUNK : 1];
+    char *plain;
 
-    ssize_t res = recv(sock, buf, (size_t)f.length, 0);
+    ssize_t res = recv_payload(stream, &f, buf, out, &plain);
 
-    if (res != (ssize_t)f.length)
-      return -1; // Error or partial read
+    if (res < 0)
+      return res;
 
-    // read_fn 不修改 stream 状态，无需加锁
-    if (stream->read_fn)
-      stream->read_fn(stream, f.length, buf);
+    stream->rx_wire = used;
 
-    return res;
+    // 回调中可能释放 stream，计时前先取出 session 和 id
+    struct yamux_session *session = stream->session;
+    yamux_streamid id = stream->id;
+
+    uint64_t t = yamux_callback_begin(session, yamux_callback_read, id);
+    stream->read_fn(stream, (uint32_t)res, plain);
+    yamux_callback_end(session, yamux_callback_read, id, t);
+
+    // 数据已交给回调，不再占用内存
+    yamux_session_commit(session, -(int64_t)used);
+
+    return f.length;
   }
   case yamux_frame_window_update: {
-    pthread_mutex_lock(&stream->mutex);
-    uint32_t old_window_size = stream->window_size; // 记录旧的窗口大小
-    uint64_t nws =
-        (uint64_t)((int64_t)stream->window_size + (int64_t)(int32_t)f.length);
-    nws &= 0xFFFFFFFFLL;
-    stream->window_size = (uint32_t)nws;
-    /* printf("new window_size: %lld\n", nws); */
-
-    // 如果窗口从0变为非0，则发出信号
-    if (old_window_size == 0 && stream->window_size > 0) {
-      pthread_cond_signal(&stream->cond);
-    }
-    pthread_mutex_unlock(&stream->mutex);
+    // 窗口更新是一次原子加法（length 为有符号增量，按 32 位回绕）
+    window_add(stream, f.length);
     break;
   }
   default:
@@ -328,24 +1025,275 @@ ssize_t yamux_stream_process(struct yamux_stream *stream,
   return 0;
 }
 
-// 当 stream->window_size 为 0 时，等待其增长
+// 当发送窗口为 0 时，等待其增长
 ssize_t yamux_stream_wait_for_window(struct yamux_stream *stream) {
   if (!stream) {
     return -EINVAL;
   }
 
-  pthread_mutex_lock(&stream->mutex);
-  // 使用 while 循环处理虚假唤醒 (spurious wakeups)
-  while (stream->window_size <= 0) {
+  while (atomic_load(&WINDOW(stream)) == 0) {
     // 如果流已经关闭，则不再等待
-    if (stream->state == yamux_stream_closed ||
-        stream->state == yamux_stream_closing) {
-      pthread_mutex_unlock(&stream->mutex);
+    if (STATE(stream) == yamux_stream_closed ||
+        STATE(stream) == yamux_stream_closing)
       return -EPIPE; // Broken pipe or stream closed
+
+    uint32_t key = yamux_event_prepare(&stream->event);
+
+    // 登记等待者之后再检查一次，避免错过唤醒
+    if (atomic_load(&WINDOW(stream)) > 0 ||
+        STATE(stream) == yamux_stream_closed ||
+        STATE(stream) == yamux_stream_closing) {
+      yamux_event_cancel(&stream->event);
+      continue;
     }
-    pthread_cond_wait(&stream->cond, &stream->mutex);
+
+    yamux_event_wait(&stream->event, key, NULL);
   }
-  pthread_mutex_unlock(&stream->mutex);
+
+  // 此时没有占用窗口，可以等待限速放行
+  uint64_t delay = yamux_stream_send_delay(stream);
+  if (delay)
+    yamux_rate_sleep(delay);
 
   return 0; // 窗口大小已大于 0
 }
+
+uint64_t yamux_stream_send_delay(struct yamux_stream *stream) {
+  uint64_t own = yamux_rate_delay(send_rate(stream), 1);
+  uint64_t all = yamux_rate_delay(&stream->session->send_rate, 1);
+
+  return MAX(own, all);
+}
+
+void yamux_stream_wake(struct yamux_stream *stream) {
+  if (stream)
+    stream_notify(stream);
+}
+
+void yamux_stream_grant(struct yamux_stream *stream, uint32_t consumed) {
+  struct yamux_session *s = stream->session;
+
+  if (consumed)
+    atomic_fetch_add(&stream->owed, consumed);
+
+  for (;;) {
+    // 同一时间只有一个线程发送窗口更新，其余的只记账
+    if (atomic_exchange(&stream->granting, true))
+      return;
+
+    uint32_t owed = atomic_load(&stream->owed);
+    uint64_t wait = 0;
+    bool sent = false;
+
+    // 和 Go 实现一样，攒够半个窗口再发送更新
+    if (owed >= YAMUX_DEFAULT_WINDOW / 2) {
+      // 接收限速：推迟窗口更新，让对端受流控约束
+      uint64_t own = yamux_rate_delay(recv_rate(stream), 1);
+      uint64_t all = yamux_rate_delay(&s->recv_rate, 1);
+      wait = MAX(own, all);
+    }
+
+    if (owed >= YAMUX_DEFAULT_WINDOW / 2 && !wait) {
+      // 内存紧张时缩小归还量
+      size_t room = yamux_session_headroom(s);
+      uint32_t grant = owed;
+
+      if (room < grant)
+        grant = MAX((uint32_t)room, MIN(owed, YAMUX_MIN_WINDOW_GRANT));
+
+      yamux_rate_take(recv_rate(stream), grant);
+      yamux_rate_take(&s->recv_rate, grant);
+
+      if (yamux_stream_window_update(stream, (int32_t)grant) > 0) {
+        atomic_fetch_sub(&stream->owed, grant);
+        sent = true;
+      } else {
+        yamux_rate_refund(recv_rate(stream), grant);
+        yamux_rate_refund(&s->recv_rate, grant);
+      }
+    }
+
+    atomic_store(&stream->granting, false);
+
+    // 交给 session 的 granter 线程，到时再发送
+    if (wait) {
+      yamux_granter_schedule(stream, wait);
+      return;
+    }
+
+    // 持有期间别的线程可能又攒够了半个窗口
+    if (!sent || atomic_load(&stream->owed) < YAMUX_DEFAULT_WINDOW / 2)
+      return;
+  }
+}
+
+ssize_t yamux_stream_read(struct yamux_stream *stream, uint32_t data_length,
+                          void *data_) {
+  if (!((size_t)stream | (size_t)data_))
+    return -EINVAL;
+
+  char *data = (char *)data_;
+  uint32_t n = 0, owed = 0;
+  struct yamux_rx_queue *rx = atomic_load(&stream->rx);
+
+  while (rx && n < data_length) {
+    struct yamux_rx_chunk *c = rx->first;
+
+    if (c->offset == c->length) {
+      struct yamux_rx_chunk *next = atomic_load(&c->next);
+      if (!next)
+        break;
+
+      // 只有在后面还有节点时才回收，写端只会访问最后一个节点
+      if (c != &rx->stub)
+        chunk_recycle(stream, c);
+      rx->first = next;
+      continue;
+    }
+
+    uint32_t m = MIN(data_length - n, c->length - c->offset);
+    memcpy(data + n, c->data + c->offset, m);
+
+    c->offset += m;
+    n += m;
+
+    // 帧读完后才按线上字节归还窗口
+    if (c->offset == c->length) {
+      yamux_session_commit(stream->session, -(int64_t)c->wire);
+      owed += c->wire;
+    }
+  }
+
+  if (!n) {
+    if (STATE(stream) == yamux_stream_closed)
+      return 0;
+    return -EAGAIN;
+  }
+
+  atomic_fetch_sub(&stream->rx_bytes, n);
+  yamux_session_buffer(stream->session, -(int64_t)n);
+
+  yamux_stream_grant(stream, owed);
+
+  return n;
+}
+
+uint32_t yamux_stream_ready(struct yamux_stream *stream) {
+  if (!stream)
+    return yamux_poll_hup;
+
+  uint32_t ev = 0;
+  enum yamux_stream_state state = STATE(stream);
+
+  if (atomic_load(&stream->rx_bytes) || state == yamux_stream_closed)
+    ev |= yamux_poll_in;
+
+  if (state == yamux_stream_closed || state == yamux_stream_closing ||
+      stream->session->closed)
+    ev |= yamux_poll_hup;
+  else if (atomic_load(&WINDOW(stream)) > 0)
+    ev |= yamux_poll_out;
+
+  return ev;
+}
+
+static size_t poll_scan(struct yamux_stream *streams[],
+                        const uint32_t events[], uint32_t revents[],
+                        size_t n) {
+  size_t ready = 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    revents[i] = yamux_stream_ready(streams[i]) & (events[i] | yamux_poll_hup);
+    if (revents[i])
+      ready++;
+  }
+
+  return ready;
+}
+
+int yamux_poll(struct yamux_stream *streams[], const uint32_t events[],
+               uint32_t revents[], size_t n, int timeout) {
+  if (!streams || !events || !revents)
+    return -EINVAL;
+
+  struct timespec deadline;
+  if (timeout > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  // 通知只发给流所属 session 的等待点
+  struct yamux_event *ev = NULL;
+  bool mixed = false;
+  for (size_t i = 0; i < n; ++i) {
+    if (!streams[i])
+      continue;
+    if (!ev)
+      ev = &streams[i]->session->poll_event;
+    else if (ev != &streams[i]->session->poll_event)
+      mixed = true;
+  }
+
+  for (;;) {
+    size_t ready = poll_scan(streams, events, revents, n);
+    if (ready || !timeout || !ev)
+      return (int)ready;
+
+    uint32_t key = yamux_event_prepare(ev);
+
+    // 登记等待者之后再扫描一次，避免错过唤醒
+    ready = poll_scan(streams, events, revents, n);
+    if (ready) {
+      yamux_event_cancel(ev);
+      return (int)ready;
+    }
+
+    struct timespec left, *lp = NULL;
+    if (timeout > 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      left.tv_sec = deadline.tv_sec - now.tv_sec;
+      left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (left.tv_nsec < 0) {
+        left.tv_sec--;
+        left.tv_nsec += 1000000000L;
+      }
+      if (left.tv_sec < 0) {
+        yamux_event_cancel(ev);
+        return 0;
+      }
+      lp = &left;
+    }
+
+    if (mixed && (!lp || left.tv_sec > 0 || left.tv_nsec > POLL_MIXED_NS)) {
+      left = (struct timespec){.tv_sec = 0, .tv_nsec = POLL_MIXED_NS};
+      lp = &left;
+    }
+
+    yamux_event_wait(ev, key, lp);
+  }
+}
+
+int yamux_stream_eventfd(struct yamux_stream *stream) {
+  if (!stream)
+    return -EINVAL;
+
+#ifdef __linux__
+  struct yamux_stream_cold *c = yamux_stream_cold(stream);
+  if (!c)
+    return -ENOMEM;
+
+  if (c->event_fd < 0)
+    c->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  return c->event_fd < 0 ? -errno : c->event_fd;
+#else
+  return -ENOTSUP;
+#endif
+}
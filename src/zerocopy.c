@@ -0,0 +1,276 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#include "zerocopy.h"
+#include "session.h"
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#endif
+
+void yamux_zerocopy_init(struct yamux_zerocopy* zc, struct yamux_session* session, int sock,
+        bool enable)
+{
+    *zc = (struct yamux_zerocopy){
+        .session = session,
+
+        .enabled  = false,
+        .next_seq = 0,
+
+        .first = NULL,
+        .last  = NULL,
+
+        .in_flight = 0,
+
+        .sends  = 0,
+        .copied = 0
+    };
+
+    pthread_mutex_init(&zc->mutex, NULL);
+
+#ifdef HAVE_ZEROCOPY
+    int one = 1;
+    zc->enabled = enable && setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#else
+    (void)sock; (void)enable;
+#endif
+}
+
+static void finish(struct yamux_zerocopy* zc, struct yamux_zc_write* list, int status)
+{
+    for (struct yamux_zc_write *w = list, *next; w; w = next)
+    {
+        next = w->next;
+
+        if (w->done)
+        {
+            uint64_t t = yamux_callback_begin(zc->session, yamux_callback_zerocopy, w->streamid);
+            w->done(w->arg, status);
+            yamux_callback_end(zc->session, yamux_callback_zerocopy, w->streamid, t);
+        }
+        free(w);
+    }
+}
+
+// a frame is done; collects its write into 'finished' if it was the last
+static void release(struct yamux_zc_frame* f, struct yamux_zc_write** finished)
+{
+    struct yamux_zc_write* w = f->write;
+
+    if (!--w->pending && w->issued)
+    {
+        w->next = *finished;
+        *finished = w;
+    }
+
+    free(f);
+}
+
+void yamux_zerocopy_drain(struct yamux_zerocopy* zc, int sock)
+{
+    while (atomic_load(&zc->in_flight))
+    {
+        struct pollfd p = { .fd = sock, .events = 0 };
+
+        // completions show up as POLLERR
+        if (poll(&p, 1, 100) < 0 && errno != EINTR)
+            return;
+        if (p.revents & POLLNVAL)
+            return;
+
+        // after a reset the kernel drops what's queued and reports it
+        // right away; if nothing comes, nothing will
+        if (!yamux_zerocopy_reap(zc, sock) && (p.revents & POLLHUP))
+            return;
+    }
+}
+
+void yamux_zerocopy_destroy(struct yamux_zerocopy* zc)
+{
+    struct yamux_zc_write* finished = NULL;
+
+    for (struct yamux_zc_frame *f = zc->first, *next; f; f = next)
+    {
+        next = f->next;
+        release(f, &finished);
+    }
+    zc->first = zc->last = NULL;
+    atomic_store(&zc->in_flight, 0);
+
+    pthread_mutex_destroy(&zc->mutex);
+
+    finish(zc, finished, -ECANCELED);
+}
+
+ssize_t yamux_zerocopy_send(struct yamux_zerocopy* zc, int sock, const void* header,
+        const void* data, uint32_t length, struct yamux_zc_write* write)
+{
+#ifdef HAVE_ZEROCOPY
+    if (!zc->enabled)
+        return -ENOTSUP;
+
+    const size_t hlen  = sizeof(((struct yamux_zc_frame*)0)->header);
+    const size_t total = hlen + length;
+    size_t sent = 0;
+
+    pthread_mutex_lock(&zc->mutex);
+
+    // a send can be cut short by a signal; the rest of the frame has to
+    // follow right away, as another zerocopy send with its own record
+    while (sent < total)
+    {
+        struct yamux_zc_frame* f = (struct yamux_zc_frame*)malloc(sizeof(struct yamux_zc_frame));
+        if (!f)
+            break;
+
+        memcpy(f->header, header, hlen);
+
+        struct iovec iov[2];
+        int niov = 0;
+
+        if (sent < hlen)
+            iov[niov++] = (struct iovec){ f->header + sent, hlen - sent };
+        size_t doff = sent > hlen ? sent - hlen : 0;
+        iov[niov++] = (struct iovec){ (char*)data + doff, length - doff };
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)niov };
+
+        ssize_t r = sendmsg(sock, &msg, MSG_ZEROCOPY);
+        if (r < 0)
+        {
+            int e = errno;
+            free(f);
+
+            if (e == EINTR)
+                continue;
+
+            pthread_mutex_unlock(&zc->mutex);
+            return sent ? (ssize_t)sent : -e;
+        }
+
+        // every successful send is numbered, even partial ones
+        f->next  = NULL;
+        f->seq   = zc->next_seq++;
+        f->write = write;
+
+        if (zc->last)
+            zc->last->next = f;
+        else
+            zc->first = f;
+        zc->last = f;
+
+        write->pending++;
+        zc->sends++;
+        atomic_fetch_add(&zc->in_flight, 1);
+
+        sent += (size_t)r;
+    }
+
+    pthread_mutex_unlock(&zc->mutex);
+
+    return sent ? (ssize_t)sent : -ENOMEM;
+#else
+    (void)zc; (void)sock; (void)header; (void)data; (void)length; (void)write;
+    return -ENOTSUP;
+#endif
+}
+
+void yamux_zerocopy_issued(struct yamux_zerocopy* zc, struct yamux_zc_write* write)
+{
+    pthread_mutex_lock(&zc->mutex);
+
+    write->issued = true;
+    bool done = !write->pending;
+
+    pthread_mutex_unlock(&zc->mutex);
+
+    if (done)
+    {
+        write->next = NULL;
+        finish(zc, write, 0);
+    }
+}
+
+int yamux_zerocopy_reap(struct yamux_zerocopy* zc, int sock)
+{
+#ifdef HAVE_ZEROCOPY
+    if (!zc->enabled || !atomic_load(&zc->in_flight))
+        return 0;
+
+    struct yamux_zc_write* finished = NULL;
+
+    pthread_mutex_lock(&zc->mutex);
+
+    while (zc->first)
+    {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP   && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cm), sizeof(err));
+
+            if (err.ee_errno || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // sends ee_info to ee_data (inclusive) are done
+            uint32_t lo = err.ee_info, span = err.ee_data - err.ee_info;
+
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied += (size_t)span + 1;
+
+            struct yamux_zc_frame** p = &zc->first;
+            struct yamux_zc_frame*  prev = NULL;
+
+            while (*p)
+            {
+                struct yamux_zc_frame* f = *p;
+
+                if (f->seq - lo > span)
+                {
+                    prev = f;
+                    p = &f->next;
+                    continue;
+                }
+
+                *p = f->next;
+                if (zc->last == f)
+                    zc->last = prev;
+
+                release(f, &finished);
+                atomic_fetch_sub(&zc->in_flight, 1);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&zc->mutex);
+
+    int n = 0;
+    for (struct yamux_zc_write* w = finished; w; w = w->next)
+        n++;
+
+    finish(zc, finished, 0);
+
+    return n;
+#else
+    (void)zc; (void)sock;
+    return 0;
+#endif
+}